@@ -8,22 +8,447 @@
 #include <assert.h>
 
 
-static void freeTree(struct bmtitem* n)
+// ----------------------------------------------------------------------
+// Node slabs;
+
+static void* mallocAlloc(void* userRef, size_t size)
+{
+	return malloc(size);
+}
+static void mallocFree(void* userRef, void* mem, size_t size)
+{
+	free(mem);
+}
+
+void poolInit(struct bmtpool* p, struct bmtAllocator const* allocator)
+{
+	memset(p, 0, sizeof(*p));
+	p->items.slabItems = SLAB_MIN_ITEMS;
+	p->trees = 1;
+	p->items.itemSize = sizeof(struct bmtitem);
+	if (allocator != NULL) {
+		p->allocator = *allocator;
+	} else {
+		p->allocator.alloc = mallocAlloc;
+		p->allocator.free = mallocFree;
+	}
+}
+
+// poolGrow - Allocate a new slab and return the first item in it.
+// Slabs double in size up to SLAB_MAX_ITEMS so small trees stay small.
+struct bmtitem* poolGrow(struct bmtpool* p, struct bmtslabs* s)
+{
+	size_t size = sizeof(struct bmtslab) + s->slabItems * s->itemSize;
+	struct bmtslab* b = p->allocator.alloc(p->allocator.userRef, size);
+	if (b == NULL)
+		die("Out of mem");
+	STATS(p, allocBytes += size);
+	b->size = size;
+	b->next = s->slabs;
+	s->slabs = b;
+	s->cursor = (struct bmtitem*)((char*)b->items + s->itemSize);
+	s->end = (struct bmtitem*)((char*)b->items + size - sizeof(struct bmtslab));
+	if (s->slabItems < SLAB_MAX_ITEMS)
+		s->slabItems *= 2;
+	return b->items;
+}
+
+static void slabsRelease(struct bmtpool* p, struct bmtslabs* s)
+{
+	struct bmtslab* b = s->slabs;
+	while (b != NULL) {
+		struct bmtslab* next = b->next;
+		STATS(p, freeBytes += b->size);
+		p->allocator.free(p->allocator.userRef, b, b->size);
+		b = next;
+	}
+	s->slabs = NULL;
+	s->freeList = s->cursor = s->end = NULL;
+	s->slabItems = SLAB_MIN_ITEMS;
+}
+
+void poolRelease(struct bmtpool* p)
+{
+	containersRelease(p);
+	slabsRelease(p, &p->items);
+}
+
+// slabsMerge - Move the slabs and free items of 'from' to 's'
+static void slabsMerge(struct bmtslabs* s, struct bmtslabs* from)
+{
+	if (from->slabs == NULL)
+		return;
+	if (s->slabs == NULL) {
+		s->slabs = from->slabs;
+		s->cursor = from->cursor;
+		s->end = from->end;
+	} else {
+		// Only the newest slab is scanned up to the cursor, the unused
+		// items must not look like containers
+		memset(from->cursor, 0, (char*)from->end - (char*)from->cursor);
+		struct bmtslab* b = from->slabs;
+		while (b->next != NULL)
+			b = b->next;
+		b->next = s->slabs->next;
+		s->slabs->next = from->slabs;
+	}
+	if (from->freeList != NULL) {
+		struct bmtitem* n = from->freeList;
+		while (n->nextFree != NULL)
+			n = n->nextFree;
+		n->nextFree = s->freeList;
+		s->freeList = from->freeList;
+	}
+	from->slabs = NULL;
+	from->freeList = from->cursor = from->end = NULL;
+}
+
+// poolMerge - Move the items of 'from' to 'p', e.g. from a pool used by
+// another thread. Both pools must have the same item size.
+void poolMerge(struct bmtpool* p, struct bmtpool* from)
+{
+	slabsMerge(&p->items, &from->items);
+	// (all counters are uint64_t)
+	uint64_t* c = (uint64_t*)&p->stats;
+	uint64_t const* fc = (uint64_t const*)&from->stats;
+	for (unsigned i = 0; i < sizeof(p->stats) / sizeof(uint64_t); i++)
+		c[i] += fc[i];
+	memset(&from->stats, 0, sizeof(from->stats));
+	c = (uint64_t*)&p->count;
+	fc = (uint64_t const*)&from->count;
+	for (unsigned i = 0; i < sizeof(p->count) / sizeof(uint64_t); i++)
+		c[i] += fc[i];
+	memset(&from->count, 0, sizeof(from->count));
+}
+
+// ----------------------------------------------------------------------
+
+// freeTree - Release a subtree at 'level'. Shared nodes are only
+// unreferenced.
+void freeTree(struct bmtpool* p, struct bmtitem* n, unsigned level)
 {
 	if (n == NULL || n == FULL)
 		return;
-	if (n->level > 0) {
-		freeTree(n->zero);
-		freeTree(n->one);
+	if (level == 0) {
+		p->count.items[0]--;	/* A bitmap */
+		return;
+	}
+	if (n->refs > 0) {
+		n->refs--;
+		return;
+	}
+	if (n->skip > 0) {
+		freeTree(p, n->next, level - n->skip);
+	} else if (n->kind == KIND_NODE16) {
+		for (unsigned i = 0; i < 16; i++)
+			freeTree(p, n->node16->leg[i], level - 4);
+	} else if (level > p->leafLevel && n->kind == KIND_NODE) {
+		freeTree(p, n->zero, level - 1);
+		freeTree(p, n->one, level - 1);
+	}
+	itemFree(p, n);
+}
+
+// ----------------------------------------------------------------------
+// Shared nodes (copy-on-write);
+
+static struct bmtitem* itemCopy(struct bmtpool* p, struct bmtitem* n);
+
+// itemShare - Add a reference to a subtree at 'level'. A node with a
+// saturated reference count is copied instead, and a bitmap is always
+// a copy.
+struct bmtitem* itemShare(
+	struct bmtpool* p, struct bmtitem* n, unsigned level)
+{
+	if (n == NULL || n == FULL)
+		return n;
+	if (level == 0) {
+		p->count.items[0]++;
+		return n;
+	}
+	if (n->refs < REFS_MAX) {
+		n->refs++;
+		return n;
+	}
+	return itemCopy(p, n);
+}
+
+// itemCopy - A private copy of a node. The legs are shared.
+static struct bmtitem* itemCopy(struct bmtpool* p, struct bmtitem* n)
+{
+	if (isContainer(n))
+		return containerCopy(p, n);
+	if (n->kind == KIND_NODE16)
+		return node16Copy(p, n);
+	struct bmtitem* m = itemAlloc(p, n->level);
+	memcpy(m, n, p->items.itemSize);
+	m->refs = 0;
+	m->skip = 0;
+	chainSkip(p, m, n->skip);
+	if (n->skip > 0) {
+		m->next = itemShare(p, n->next, n->level - n->skip);
+	} else if (n->level > p->leafLevel) {
+		m->zero = itemShare(p, n->zero, n->level - 1);
+		m->one = itemShare(p, n->one, n->level - 1);
+	}
+	return m;
+}
+
+// itemOwn - Make the node at 's' private before it is modified. The
+// node holding 's' must already be private.
+static inline struct bmtitem* itemOwn(struct bmtpool* p, struct bmtitem** s)
+{
+	struct bmtitem* n = *s;
+	if (n == NULL || n == FULL || n->refs == 0)
+		return n;
+	n->refs--;
+	return *s = itemCopy(p, n);
+}
+
+// itemOwnNode - itemOwn() for modifications that need nodes. A
+// container or a Node16 is expanded.
+static inline struct bmtitem* itemOwnNode(
+	struct bmtpool* p, struct bmtitem** s)
+{
+	struct bmtitem* n = itemOwn(p, s);
+	if (n == NULL || n == FULL || n->kind == KIND_NODE)
+		return n;
+	*s = isContainer(n) ? containerExpand(p, n) : node16Expand(p, n);
+	itemFree(p, n);
+	return *s;
+}
+
+// leafOwn - The words of the leaf at 's' to modify, then leafStore()
+// must be called. A bitmap is copied to 'w', a wide leaf is made
+// private (or expanded from NULL/FULL).
+static inline bitmap_t* leafOwn(
+	struct bmtpool* p, struct bmtitem** s, unsigned level, bitmap_t* w)
+{
+	if (level == 0) {
+		*w = bitmapWord(*s);
+		return w;
+	}
+	struct bmtitem* n = itemOwn(p, s);
+	if (n == NULL || n == FULL)
+		*s = n = expandItem(p, level, n);
+	return n->word;
+}
+
+// leafStore - Store and normalize a leaf modified after leafOwn()
+static inline void leafStore(
+	struct bmtpool* p, struct bmtitem** s, unsigned level, bitmap_t const* w)
+{
+	if (level == 0)
+		bitmapSet(p, s, *w);
+	else
+		*s = leafNormalize(p, *s);
+}
+
+// ----------------------------------------------------------------------
+// Chains (path compression);
+
+// isPair - A chain of one level with a NULL/FULL 'next'. Such a
+// node can be described as a chain with either fill so; a pair at the
+// end of a chain takes the fill of the chain, otherwise the fill is the
+// "zero" leg.
+static inline int isPair(struct bmtitem const* n)
+{
+	return n->skip == 1 && (n->next == NULL || n->next == FULL);
+}
+static void pairFlip(struct bmtitem* n)
+{
+	struct bmtitem* next = n->next;
+	n->next = chainFill(n);
+	n->fill = next == FULL;
+	n->prefix ^= 1ULL << (n->level + 5);
+	n->maxfree[0] = itemMaxFree(n->next, n->level - 1);
+}
+
+// pairNormalize - A pair on its own takes the "zero" leg as fill,
+// i.e. the path takes the "one" leg.
+static void pairNormalize(struct bmtitem* n)
+{
+	if (isPair(n) && n->prefix == 0)
+		pairFlip(n);
+}
+
+// chainCrossesChunk - A chain from level 'top' down to 'next' would
+// hide a chunk that may be a container.
+static inline int chainCrossesChunk(
+	struct bmtpool const* p, unsigned top, struct bmtitem const* next)
+{
+	if (p->arrayMax == 0 && p->runsMax == 0)
+		return 0;
+	return top > CHUNK_LEVEL && next->level - next->skip < CHUNK_LEVEL;
+}
+
+// chainMerge - Called when the 'next' of a chain may have changed.
+static struct bmtitem* chainMerge(struct bmtpool* p, struct bmtitem* n)
+{
+	struct bmtitem* next = n->next;
+	if (next == chainFill(n)) {
+		itemFree(p, n);
+		return next;
+	}
+	if (n->level > n->skip && next != NULL && next != FULL &&
+		next->skip > 0 && !chainCrossesChunk(p, n->level, next)) {
+		// A 'next' chain with the same fill, or a pair that can be
+		// flipped to the same fill, is merged. 'next' may be shared so
+		// it is not modified.
+		if (next->fill == n->fill) {
+			n->prefix |= next->prefix;
+			chainSkip(p, n, n->skip + next->skip);
+			n->next = next->next;
+		} else if (isPair(next) && next->next == chainFill(n)) {
+			n->prefix |= next->prefix ^ (1ULL << (next->level + 5));
+			chainSkip(p, n, n->skip + 1);
+			n->next = chainFill(next);
+		} else {
+			next = NULL;
+		}
+		if (next != NULL) {
+			if (next->refs > 0) {
+				next->refs--;
+				n->next = itemShare(p, n->next, n->level - n->skip);
+			} else {
+				itemFree(p, next);
+			}
+		}
+	}
+	pairNormalize(n);
+	n->ones = chainOnes(n);
+	n->maxfree[0] = itemMaxFree(n->next, n->level - n->skip);
+	return n;
+}
+
+// nodeNormalize - Collapse a node with equal NULL/FULL legs and make
+// a node with one NULL/FULL leg into a chain.
+struct bmtitem* nodeNormalize(struct bmtpool* p, struct bmtitem* n)
+{
+	struct bmtitem* zero = n->zero;
+	struct bmtitem* one = n->one;
+	n->ones = itemOnes(zero, n->level - 1) + itemOnes(one, n->level - 1);
+	n->maxfree[0] = itemMaxFree(zero, n->level - 1);
+	n->maxfree[1] = itemMaxFree(one, n->level - 1);
+	if (zero == NULL || zero == FULL) {
+		if (one == zero) {
+			itemFree(p, n);
+			return zero;
+		}
+		n->fill = zero == FULL;
+		n->prefix = 1ULL << (n->level + 5);
+		n->next = one;
+	} else if (one == NULL || one == FULL) {
+		n->fill = one == FULL;
+		n->prefix = 0;
+		n->next = zero;
+	} else {
+		return n;
 	}
-	free(n);
+	chainSkip(p, n, 1);
+	return chainMerge(p, n);
+}
+
+// chainNormalize, itemNormalize - Normalize and check if a chunk
+// should be a container, or a node a Node16
+struct bmtitem* chainNormalize(struct bmtpool* p, struct bmtitem* n)
+{
+	return chunkCheck(p, chainMerge(p, n));
+}
+struct bmtitem* itemNormalize(struct bmtpool* p, struct bmtitem* n)
+{
+	if (n->kind == KIND_NODE16)
+		return node16Normalize(p, n);
+	return node16Check(p, chunkCheck(p, nodeNormalize(p, n)));
+}
+
+// chainMatch - Return the number of chain levels (from the top) where
+// the offset follows the chain path.
+static unsigned chainMatch(struct bmtitem const* n, uint64_t offset)
+{
+	uint64_t x = (offset ^ n->prefix) & chainMask(n->level, n->skip);
+	if (x == 0)
+		return n->skip;
+	// The level of the highest differing bit is (bit - 5)
+	return n->level - (63 - __builtin_clzll(x) - 5);
 }
 
+// chainCut - Cut a chain after 'd' levels (0 < d < skip). The lower
+// part becomes a new chain which is returned.
+static struct bmtitem* chainCut(
+	struct bmtpool* p, struct bmtitem* n, unsigned d)
+{
+	struct bmtitem* m = itemAlloc(p, n->level - d);
+	chainSkip(p, m, n->skip - d);
+	m->fill = n->fill;
+	m->prefix = n->prefix & chainMask(m->level, m->skip);
+	m->next = n->next;
+	m->ones = chainOnes(m);
+	m->maxfree[0] = n->maxfree[0];
+	chainSkip(p, n, d);
+	n->prefix &= chainMask(n->level, d);
+	n->next = m;
+	n->maxfree[0] = itemMaxFree(m, m->level);
+	return m;
+}
+
+// unchain - Make the top level of a chain a normal node.
+static void unchain(struct bmtpool* p, struct bmtitem* n)
+{
+	struct bmtitem* rest = n->next;
+	if (n->skip > 1) {
+		rest = chainCut(p, n, 1);
+		pairNormalize(rest);
+	}
+	struct bmtitem* fill = chainFill(n);
+	int onPath = (n->prefix & (1ULL << (n->level + 5))) != 0;
+	chainSkip(p, n, 0);
+	n->fill = 0;
+	if (onPath) {
+		n->zero = fill;
+		n->one = rest;
+	} else {
+		n->zero = rest;
+		n->one = fill;
+	}
+	n->maxfree[0] = itemMaxFree(n->zero, n->level - 1);
+	n->maxfree[1] = itemMaxFree(n->one, n->level - 1);
+}
+
+// ----------------------------------------------------------------------
+
 struct BitmapTree* bmtCreate(uint64_t size)
 {
-	struct BitmapTree* bmt = CALLOC(sizeof(struct BitmapTree));
+	return bmtCreateWithAllocator(size, NULL);
+}
+
+struct BitmapTree* bmtCreateWithAllocator(
+	uint64_t size, struct bmtAllocator const* allocator)
+{
+	return bmtCreateWithLeaves(size, 64, allocator);
+}
+
+struct BitmapTree* bmtCreateWithLeaves(
+	uint64_t size, unsigned leafBits, struct bmtAllocator const* allocator)
+{
+	if (leafBits < 64 || leafBits > 512 || (leafBits & (leafBits - 1)) != 0)
+		return NULL;
 	if (size > 0x8000000000000000ULL)
 		size = 0;
+	if (leafBits > 64 && size != 0 && size < leafBits)
+		return NULL;
+	if (size != 0 && size < 64)
+		size = 64;				/* One bitmap */
+	struct BitmapTree* bmt = CALLOC(sizeof(struct BitmapTree));
+	bmt->pool = CALLOC(sizeof(struct bmtpool));
+	poolInit(bmt->pool, allocator);
+	if (leafBits > 64) {
+		// The words of a wide leaf extend the item
+		unsigned leafLevel = ulog2(leafBits) - BM_BITS;
+		bmt->pool->leafLevel = leafLevel;
+		bmt->pool->items.itemSize = offsetof(struct bmtitem, word) +
+			(sizeof(bitmap_t) << leafLevel);
+	}
 	// levels are really log2(size) but the last 6 bits are a 64-bit
 	// bitmask so the used levels are log2(size) - 6.
 	if (size == 0) {
@@ -40,268 +465,1384 @@ struct BitmapTree* bmtCreate(uint64_t size)
 	return bmt;
 }
 
-static struct bmtitem* treeClone(struct bmtitem* n) {
+// treeClone - Deep copy a subtree at 'level' into 'p'. Containers are
+// expanded if 'p' does not use them, and 16-way nodes follow 'p'.
+static struct bmtitem* treeClone(
+	struct bmtpool* p, struct bmtitem* n, unsigned level)
+{
 	if (n == NULL || n == FULL)
 		return n;
-	struct bmtitem* b = CALLOC(sizeof(struct bmtitem));
-	b->level = n->level;
-	if (b->level > 0) {
-		b->zero = treeClone(n->zero);
-		b->one = treeClone(n->one);
+	if (level == 0)
+		return itemShare(p, n, 0);
+	if (isContainer(n)) {
+		if (p->arrayMax == 0 && p->runsMax == 0)
+			return node16Check(p, containerExpand(p, n));
+		return containerCopy(p, n);
+	}
+	if (n->kind == KIND_NODE16) {
+		struct bmtitem* leg[16];
+		for (unsigned i = 0; i < 16; i++)
+			leg[i] = treeClone(p, n->node16->leg[i], level - 4);
+		return node16New(p, level, leg);
+	}
+	struct bmtitem* b = itemAlloc(p, n->level);
+	b->ones = n->ones;
+	b->maxfree[0] = n->maxfree[0];
+	b->maxfree[1] = n->maxfree[1];
+	if (n->skip > 0) {
+		chainSkip(p, b, n->skip);
+		b->fill = n->fill;
+		b->prefix = n->prefix;
+		b->next = treeClone(p, n->next, level - n->skip);
+	} else if (level > p->leafLevel) {
+		b->zero = treeClone(p, n->zero, level - 1);
+		b->one = treeClone(p, n->one, level - 1);
+		b = node16Check(p, b);
 	} else {
-		b->bits = n->bits;
+		memcpy(b->word, n->word, sizeof(bitmap_t) << level);
 	}
 	return b;
 }
 
+// The clone shares the pool and the nodes with the original
 struct BitmapTree* bmtClone(struct BitmapTree* b)
 {
 	struct BitmapTree* bmt = CALLOC(sizeof(struct BitmapTree));
-	bmt->size = b->size;
-	bmt->levels = b->levels;
-	bmt->top = treeClone(b->top);
+	*bmt = *b;
+	bmt->epoch = NULL;
+	bmt->journal = NULL;
+	bmt->pool->trees++;
+	bmt->top = itemShare(bmt->pool, b->top, b->levels);
 	return bmt;
 }
 
-void bmtDelete(struct BitmapTree* bmt)
+int bmtRestore(struct BitmapTree* bmt, struct BitmapTree* snapshot)
+{
+	if (bmt->pool != snapshot->pool)
+		return -1;
+	struct bmtitem* top = bmt->top;
+	bmt->top = itemShare(bmt->pool, snapshot->top, bmt->levels);
+	bmt->nextFit = snapshot->nextFit;
+	freeTree(bmt->pool, top, bmt->levels);
+	if (bmt->journal != NULL)
+		bmtCheckpoint(bmt);
+	return 0;
+}
+
+// The nodes are not visited unless the pool is shared, otherwise all
+// slabs are released at once
+void bmtDelete(struct BitmapTree* bmt)
+{
+	if (bmt == NULL)
+		return;
+	struct bmtpool* p = bmt->pool;
+	if (bmt->epoch != NULL)
+		epochRelease(bmt);
+	if (bmt->journal != NULL)
+		journalStop(bmt);
+	if (--p->trees > 0) {
+		freeTree(p, bmt->top, bmt->levels);
+	} else {
+		poolRelease(p);
+		free(p);
+	}
+	free(bmt);
+}
+
+/*
+  The hot paths are iterative. The slots (pointers to the pointers) of
+  the nodes passed on the way down are stored in a path, and the nodes
+  are normalized bottom-up when the tree structure has changed.
+ */
+#define PATH_MAX_DEPTH 64
+struct bmtpath {
+	unsigned depth;
+	int restructured;
+	int expanded;				/* NULL/FULL was expanded */
+	int delta;					/* Change of '1's if not restructured */
+	struct bmtitem** slot[PATH_MAX_DEPTH];
+};
+
+// (the slots are not cleared, they are only read below 'depth')
+static inline void pathInit(struct bmtpath* path)
+{
+	path->depth = 0;
+	path->restructured = 0;
+	path->expanded = 0;
+	path->delta = 0;
+}
+
+// pathStats - Count an operation that passed the nodes in the path
+static inline void pathStats(struct bmtpool* p, struct bmtpath const* path)
+{
+	unsigned b = path->depth / 4;
+	STATS(p, operations++);
+	STATS(p, levels += path->depth);
+	STATS(p, depth[b < BMT_DEPTH_BUCKETS ? b : BMT_DEPTH_BUCKETS - 1]++);
+	(void)b;
+}
+
+// reserveStats - Count a reservation. If nothing was expanded the bit
+// was in an existing leaf or container
+static inline void reserveStats(struct bmtpool* p, struct bmtpath const* path)
+{
+	STATS(p, reserves++);
+	if (!path->expanded)
+		STATS(p, denseReserves++);
+}
+
+static inline void pathPush(struct bmtpath* path, struct bmtitem** s)
+{
+	path->slot[path->depth++] = s;
+}
+
+// pathNormalize - 's' is the slot at 'level' at the bottom of the path.
+// If the tree is not restructured it holds a leaf that may have changed.
+static void pathNormalize(
+	struct bmtpool* p, struct bmtpath* path, struct bmtitem** s,
+	unsigned level)
+{
+	if (!path->restructured) {
+		if (path->delta == 0)
+			return;
+		// Only the '1' count and the free blocks are updated. The free
+		// blocks are not updated above a node where they are unchanged.
+		// 's' is the slot of the leg below 'n'
+		unsigned f = itemMaxFree(*s, level);
+		int changed = 1;
+		while (path->depth > 0) {
+			struct bmtitem** ps = path->slot[--path->depth];
+			struct bmtitem* n = *ps;
+			level = n->level;
+			n->ones += path->delta;
+			uint8_t* m = &n->maxfree[n->skip == 0 && s == &n->one];
+			if (n->kind == KIND_NODE16) {
+				unsigned i = s - n->node16->leg;
+				n->node16->ones[i] += path->delta;
+				m = &n->node16->maxfree[i];
+			}
+			if (changed && *m != f) {
+				*m = f;
+				if (n->kind == KIND_NODE16)
+					node16MaxFree(n);
+				f = itemMaxFree(n, level);
+			} else {
+				changed = 0;
+			}
+			if (level == CHUNK_LEVEL)
+				*ps = chunkCheck(p, n);
+			s = ps;
+		}
+		return;
+	}
+	while (path->depth > 0) {
+		s = path->slot[--path->depth];
+		struct bmtitem* n = *s;
+		*s = n->skip > 0 ? chainNormalize(p, n) : itemNormalize(p, n);
+	}
+}
+
+static int nextBit(
+	struct BitmapTree* bmt, uint64_t from, int value, uint64_t* offset);
+
+// setbit - Set the bit at 'offset' in the subtree at 's' to 'value'.
+// The path to 's' must be in 'path'.
+static void setbit(
+	struct bmtpool* p, struct bmtpath* path, struct bmtitem** s,
+	uint64_t offset, unsigned level, void* value)
+{
+	for (;;) {
+		struct bmtitem* n = *s;
+		if (n == value)
+			break;
+		if (level == 0) {
+			bitmap_t bitmask = 1ULL << (offset & BM_MASK);
+			bitmap_t w = bitmapWord(n);
+			if (((w & bitmask) != 0) == (value == FULL))
+				break;
+			path->delta = value == FULL ? 1 : -1;
+			if (n == NULL || n == FULL)
+				path->expanded = 1;
+			bitmapSet(p, s, w ^ bitmask);
+			D(printf("setbit: bits=0x%016lx, bitmask=0x%lx\n", w ^ bitmask, bitmask));
+			if (path->expanded || *s == NULL || *s == FULL)
+				path->restructured = 1;
+			break;
+		}
+		n = itemOwn(p, s);
+		if (n == NULL || n == FULL) {
+			*s = n = expandItem(p, level, n);
+			path->restructured = 1;
+			path->expanded = 1;
+		} else if (n->kind == KIND_NODE16) {
+			pathPush(path, s);
+			s = &n->node16->leg[node16Index(n, offset)];
+			level -= 4;
+			continue;
+		} else if (isContainer(n)) {
+			path->delta = containerSetBit(
+				p, n, offset & (span(CHUNK_LEVEL) - 1), value == FULL);
+			*s = containerNormalize(p, n);
+			if (*s != n)
+				path->restructured = 1;
+			break;
+		} else if (n->skip > 0) {
+			unsigned d = chainMatch(n, offset);
+			if (d < n->skip) {
+				if (chainFill(n) == value)
+					break;
+				path->restructured = 1;
+				if (d > 0)
+					chainCut(p, n, d);
+				else
+					unchain(p, n);
+			}
+			if (n->skip > 0) {
+				pathPush(path, s);
+				level -= n->skip;
+				s = &n->next;
+				continue;
+			}
+		}
+
+		if (level == p->leafLevel) {
+			// A wide leaf
+			bitmap_t* w = &n->word[(offset >> BM_BITS) & ((1 << level) - 1)];
+			bitmap_t bitmask = 1ULL << (offset & BM_MASK);
+			if (value == FULL) {
+				if ((*w & bitmask) == 0)
+					path->delta = 1;
+				*w |= bitmask;
+			} else {
+				if (*w & bitmask)
+					path->delta = -1;
+				*w &= ~bitmask;
+			}
+			if (path->delta != 0) {
+				*s = leafNormalize(p, n);
+				if (*s != n)
+					path->restructured = 1;
+			}
+			break;
+		}
+		pathPush(path, s);
+		s = &n->leg[(offset >> (level + 5)) & 1];
+		level--;
+	}
+	pathStats(p, path);
+	pathNormalize(p, path, s, level);
+}
+
+void bmtSetBit(struct BitmapTree* bmt, uint64_t offset)
+{
+	if (bmt->size > 0 && offset >= bmt->size)
+		return;
+	struct bmtpath path;
+	pathInit(&path);
+	setbit(bmt->pool, &path, &bmt->top, offset, bmt->levels, FULL);
+	JOURNAL(bmt, JOURNAL_SET, offset, 0);
+}
+
+void bmtClearBit(struct BitmapTree* bmt, uint64_t offset)
+{
+	if (bmt->size > 0 && offset >= bmt->size)
+		return;
+	struct bmtpath path;
+	pathInit(&path);
+	setbit(bmt->pool, &path, &bmt->top, offset, bmt->levels, NULL);
+	JOURNAL(bmt, JOURNAL_CLEAR, offset, 0);
+}
+
+int bmtReserveBit(struct BitmapTree* bmt, uint64_t* offset)
+{
+	struct bmtpath path;
+	struct bmtitem** s = &bmt->top;
+	unsigned level = bmt->levels;
+	pathInit(&path);
+	*offset = 0;
+
+	// Find the first '0'
+	for (;;) {
+		struct bmtitem* n = *s;
+		if (n == FULL)
+			return -1;
+		if (n == NULL)
+			break;
+		if (level == bmt->pool->leafLevel) {
+			// (full leaves are replaced with FULL so there is a '0')
+			bitmap_t b;
+			bitmap_t const* w = leafWords(n, level, &b);
+			unsigned i = wordsFirst(w, 1 << level, 0, BM_MAX);
+			*offset += (i << BM_BITS) + __builtin_ctzll(~w[i]);
+			break;
+		}
+		n = itemOwn(bmt->pool, s);
+		if (n->kind == KIND_NODE16) {
+			// (the legs are not FULL so the first '0' is in leg 0)
+			pathPush(&path, s);
+			s = &n->node16->leg[0];
+			level -= 4;
+			continue;
+		}
+		if (isContainer(n)) {
+			*offset += containerNext(n, 0, 0);
+			break;
+		}
+		if (n->skip > 0) {
+			if (n->fill || (n->prefix == 0 && n->next != FULL)) {
+				// The first '0' is in 'next'
+				*offset += n->prefix;
+				pathPush(&path, s);
+				level -= n->skip;
+				s = &n->next;
+				continue;
+			}
+			// The first '0' is in an empty leg of the chain. If the
+			// path ever takes a "one" leg it is the empty "zero" leg
+			// beside it, else it is the "one" leg at the bottom.
+			if (n->prefix == 0)
+				*offset += 1ULL << (level - n->skip + 6);
+			break;
+		}
+		pathPush(&path, s);
+		if (n->zero != FULL) {
+			s = &n->zero;
+		} else {
+			*offset += 1ULL << (level + 5);
+			s = &n->one;
+		}
+		level--;
+	}
+	setbit(bmt->pool, &path, s, *offset, level, FULL);
+	reserveStats(bmt->pool, &path);
+	JOURNAL(bmt, JOURNAL_SET, *offset, 0);
+	return 0;
+}
+
+int bmtReserveBitFrom(struct BitmapTree* bmt, uint64_t from, uint64_t* offset)
+{
+	// The search is read-only and the set follows the same (now cached)
+	// path, so a dense area below 'from' is never visited
+	if (nextBit(bmt, from, 0, offset) != 0) {
+		if (from == 0 || nextBit(bmt, 0, 0, offset) != 0)
+			return -1;
+	}
+	struct bmtpath path;
+	pathInit(&path);
+	setbit(bmt->pool, &path, &bmt->top, *offset, bmt->levels, FULL);
+	reserveStats(bmt->pool, &path);
+	JOURNAL(bmt, JOURNAL_SET, *offset, 0);
+	return 0;
+}
+
+int bmtReserveNextFit(struct BitmapTree* bmt, uint64_t* offset)
+{
+	if (bmtReserveBitFrom(bmt, bmt->nextFit, offset) != 0)
+		return -1;
+	bmt->nextFit = *offset + 1;
+	if (bmt->size > 0 && bmt->nextFit >= bmt->size)
+		bmt->nextFit = 0;
+	return 0;
+}
+
+int bmtBit(struct BitmapTree* bmt, uint64_t offset)
+{
+	if (bmt->size > 0 && offset >= bmt->size)
+		return 0;
+	struct bmtitem* n = bmt->top;
+	unsigned level = bmt->levels;
+	unsigned leafLevel = bmt->pool->leafLevel;
+	for (;;) {
+		if (n == NULL)
+			return 0;
+		if (n == FULL)
+			return 1;
+		if (level == 0)
+			return (bitmapWord(n) >> (offset & BM_MASK)) & 1;
+		if (n->skip > 0) {
+			if ((offset ^ n->prefix) & chainMask(level, n->skip))
+				return n->fill;
+			level -= n->skip;
+			n = n->next;
+		} else if (n->kind == KIND_NODE16) {
+			n = n->node16->leg[node16Index(n, offset)];
+			level -= 4;
+		} else if (n->kind != KIND_NODE) {
+			return containerBit(n, offset & (span(CHUNK_LEVEL) - 1));
+		} else if (level > leafLevel) {
+			n = n->leg[(offset >> (level + 5)) & 1];
+			level--;
+		} else {
+			bitmap_t w = n->word[(offset >> BM_BITS) & ((1 << leafLevel) - 1)];
+			return (w >> (offset & BM_MASK)) & 1;
+		}
+	}
+}
+
+// setbranch - Set the 2^wantedLevel bits at 'offset' in the subtree
+// at 's' to 'value'. The path to 's' must be in 'path'.
+static void setbranch(
+	struct bmtpool* p, struct bmtpath* path, struct bmtitem** s,
+	uint64_t offset, unsigned level, unsigned wantedLevel, void* value)
+{
+	// The node level that is replaced by 'value'
+	unsigned target = wantedLevel > 6 ? wantedLevel - 6 : 0;
+	for (;;) {
+		struct bmtitem* n = *s;
+		if (n == value)
+			break;
+		if (wantedLevel >= level + 6) {
+			// We have found the wanted level
+			freeTree(p, n, level);
+			*s = value;
+			path->restructured = 1;
+			break;
+		}
+		if (level == p->leafLevel) {
+			D(printf("setbranch: wantedLevel=%u\n", wantedLevel));
+			// We must set/clear sections in the bitmap
+			bitmap_t b;
+			bitmap_t* w = leafOwn(p, s, level, &b);
+			unsigned first = offset & (span(level) - 1);
+			wordsSetRange(w, first, first + (1 << wantedLevel) - 1, value == FULL);
+			leafStore(p, s, level, w);
+			path->restructured = 1;	/* (to re-count the '1's) */
+			break;
+		}
+		n = itemOwn(p, s);
+		if (n != NULL && n != FULL && n->kind == KIND_NODE16 &&
+			target + 4 <= level) {
+			// The wanted level is in a leg
+			pathPush(path, s);
+			s = &n->node16->leg[node16Index(n, offset)];
+			level -= 4;
+			continue;
+		}
+		n = itemOwnNode(p, s);
+		if (n == NULL || n == FULL) {
+			*s = n = expandItem(p, level, n);
+			path->restructured = 1;
+			path->expanded = 1;
+		} else if (n->skip > 0) {
+			// Only the chain levels above the wanted level are relevant
+			unsigned d = chainMatch(n, offset);
+			unsigned above = level - target;
+			if (d >= above && above < n->skip)
+				d = above;		/* The wanted level is inside the chain */
+			if (d < n->skip) {
+				if (d < above && chainFill(n) == value)
+					break;
+				path->restructured = 1;
+				if (d > 0)
+					chainCut(p, n, d);
+				else
+					unchain(p, n);
+			}
+			if (n->skip > 0) {
+				pathPush(path, s);
+				level -= n->skip;
+				s = &n->next;
+				continue;
+			}
+		}
+		pathPush(path, s);
+		s = &n->leg[(offset >> (level + 5)) & 1];
+		level--;
+	}
+	pathStats(p, path);
+	pathNormalize(p, path, s, level);
+}
+
+int bmtsetbranch(
+	struct BitmapTree* bmt, uint64_t offset, uint64_t size, void* value)
+{
+	if (size == 0) {
+		size = bmt->size;
+		if (offset == 0 && size == 0) {
+			// Handle full set
+			freeTree(bmt->pool, bmt->top, bmt->levels);
+			bmt->top = value;
+			return 0;
+		}
+	}
+
+	// Is size a power of 2?
+	if (size == 0)
+		return -1;
+	if (bmt->size > 0 && size > bmt->size)
+		return -1;
+	unsigned level = 0;			/* level = log2(size) */
+	uint64_t m = 1;
+	while (size != m) {
+		if (size < m)
+			return -1;
+		m = m << 1;
+		level++;
+	}
+	D(printf("bmtsetbranch: level=%u\n", level));
+	// Is offset a multiple of size?
+	if (offset % size)
+		return -1;
+	// Is offset + size out of range?
+	if (bmt->size == 0) {
+		if (offset > (UINT64_MAX - size + 1))
+			return -1;
+	} else if ((offset + size) > bmt->size)
+		return -1;
+
+	struct bmtpath path;
+	pathInit(&path);
+	setbranch(
+		bmt->pool, &path, &bmt->top, offset, bmt->levels, level, value);
+	return 0;
+}
+
+int bmtSetBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size)
+{
+	if (bmtsetbranch(bmt, offset, size, FULL) != 0)
+		return -1;
+	JOURNAL(bmt, JOURNAL_SET_BRANCH, offset, size);
+	return 0;
+}
+int bmtClearBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size)
+{
+	if (bmtsetbranch(bmt, offset, size, NULL) != 0)
+		return -1;
+	JOURNAL(bmt, JOURNAL_CLEAR_BRANCH, offset, size);
+	return 0;
+}
+
+int bmtReserveBranch(struct BitmapTree* bmt, uint64_t size, uint64_t* offset)
+{
+	if (size == 0)
+		size = bmt->size;
+	if (size == bmt->size) {
+		// The whole array
+		if (bmt->top != NULL)
+			return -1;
+		bmt->top = FULL;
+		*offset = 0;
+		JOURNAL(bmt, JOURNAL_SET_BRANCH, 0, size);
+		return 0;
+	}
+	if ((bmt->size > 0 && size > bmt->size) || (size & (size - 1)) != 0)
+		return -1;
+	unsigned wantedLevel = __builtin_ctzll(size);
+	unsigned need = wantedLevel + 1;	/* (as maxfree) */
+	struct bmtpath path;
+	struct bmtitem** s = &bmt->top;
+	unsigned level = bmt->levels;
+	if (itemMaxFree(bmt->top, level) < need)
+		return -1;
+	pathInit(&path);
+	*offset = 0;
+
+	// Follow the first leg that has a large enough free block
+	for (;;) {
+		if (*s == NULL)
+			break;
+		if (level == bmt->pool->leafLevel) {
+			bitmap_t b;
+			*offset += wordsFirstFree(
+				leafWords(*s, level, &b), 1 << level, wantedLevel);
+			break;
+		}
+		struct bmtitem* n = itemOwn(bmt->pool, s);
+		if (n->kind == KIND_NODE16) {
+			unsigned i;
+			for (i = 0; n->node16->maxfree[i] < need; i++);
+			pathPush(&path, s);
+			level -= 4;
+			*offset += i * span(level);
+			s = &n->node16->leg[i];
+			continue;
+		}
+		n = itemOwnNode(bmt->pool, s);
+		if (n->skip > 0) {
+			struct bmtpos pos = {n, level}, zero, one;
+			while (pos.n == n) {
+				posLegs(pos, &zero, &one);
+				if (posMaxFree(zero) >= need) {
+					pos = zero;
+				} else {
+					*offset += span(one.level);
+					pos = one;
+				}
+			}
+			if (pos.n == NULL)
+				break;			/* In a free leg of the chain */
+			pathPush(&path, s);
+			level -= n->skip;
+			s = &n->next;
+			continue;
+		}
+		pathPush(&path, s);
+		level--;
+		if (n->maxfree[0] >= need) {
+			s = &n->zero;
+		} else {
+			*offset += span(level);
+			s = &n->one;
+		}
+	}
+	setbranch(bmt->pool, &path, s, *offset, level, wantedLevel, FULL);
+	JOURNAL(bmt, JOURNAL_SET_BRANCH, *offset, size);
+	return 0;
+}
+
+// setrange - Set the bits [first,last] in the subtree at 's' starting
+// at 'base' to 'value'. Subtrees that are inside the range are replaced
+// so only the nodes on the paths to 'first' and 'last' are visited.
+static void setrange(
+	struct bmtpool* p, struct bmtitem** s, unsigned level, uint64_t base,
+	uint64_t first, uint64_t last, void* value)
+{
+	struct bmtitem* n = *s;
+	if (n == value)
+		return;
+	if (first == base && last == base + span(level) - 1) {
+		freeTree(p, n, level);
+		*s = value;
+		return;
+	}
+	if (level == p->leafLevel) {
+		bitmap_t b;
+		bitmap_t* w = leafOwn(p, s, level, &b);
+		wordsSetRange(w, first - base, last - base, value == FULL);
+		leafStore(p, s, level, w);
+		return;
+	}
+	n = itemOwnNode(p, s);
+	if (n == NULL || n == FULL)
+		*s = n = expandItem(p, level, n);
+	if (n->skip > 0) {
+		unsigned bottom = level - n->skip;
+		uint64_t start = base | (n->prefix & chainMask(level, n->skip));
+		uint64_t end = start + span(bottom) - 1;
+		int inside = first >= start && last <= end;
+		if (chainFill(n) == value || inside) {
+			// Only the part on the chain path can change
+			if (last < start || first > end)
+				return;
+			setrange(p, &n->next, bottom, start,
+					 first > start ? first : start, last < end ? last : end, value);
+			*s = chainNormalize(p, n);
+			return;
+		}
+		unchain(p, n);
+	}
+	uint64_t mid = base + span(level - 1);
+	if (first < mid)
+		setrange(p, &n->zero, level - 1, base, first,
+				 last < mid ? last : mid - 1, value);
+	if (last >= mid)
+		setrange(p, &n->one, level - 1, mid, first > mid ? first : mid,
+				 last, value);
+	*s = itemNormalize(p, n);
+}
+
+static int bmtsetrange(
+	struct BitmapTree* bmt, uint64_t first, uint64_t last, void* value)
+{
+	if (first > last || (bmt->size > 0 && last >= bmt->size))
+		return -1;
+	setrange(bmt->pool, &bmt->top, bmt->levels, 0, first, last, value);
+	JOURNAL(bmt, value == FULL ? JOURNAL_SET_RANGE : JOURNAL_CLEAR_RANGE,
+			first, last - first);
+	return 0;
+}
+
+int bmtSetRange(struct BitmapTree* bmt, uint64_t first, uint64_t last)
+{
+	return bmtsetrange(bmt, first, last, FULL);
+}
+int bmtClearRange(struct BitmapTree* bmt, uint64_t first, uint64_t last)
+{
+	return bmtsetrange(bmt, first, last, NULL);
+}
+
+// ----------------------------------------------------------------------
+// Bulk operations;
+
+/*
+  The sorted offsets are split between the legs of each node, so a
+  node is visited once and normalized once after all its legs are
+  updated, and a bitmap is updated with one mask. Offsets that follow
+  a chain path are a contiguous part of the array.
+ */
+
+// split - The index of the first offset >= 'x' (binary search)
+static size_t split(uint64_t const* o, size_t cnt, uint64_t x)
+{
+	size_t lo = 0, hi = cnt;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (o[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// chainSplit - Get the offsets [*i,*j) that follow the chain path
+static void chainSplit(
+	struct bmtitem const* n, unsigned level, uint64_t const* o, size_t cnt,
+	size_t* i, size_t* j)
+{
+	uint64_t start = (o[0] & ~(span(level) - 1)) |
+		(n->prefix & chainMask(level, n->skip));
+	uint64_t end = start + span(level - n->skip);
+	*i = split(o, cnt, start);
+	*j = end == 0 ? cnt : split(o, cnt, end);
+}
+
+// setbits - Set the sorted 'offsets' in the subtree at 's' to 'value'
+static void setbits(
+	struct bmtpool* p, struct bmtitem** s, unsigned level,
+	uint64_t const* o, size_t cnt, void* value)
+{
+	struct bmtitem* n = *s;
+	if (cnt == 0 || n == value)
+		return;
+	if (level == p->leafLevel) {
+		bitmap_t b;
+		bitmap_t* words = leafOwn(p, s, level, &b);
+		unsigned wmask = (1 << level) - 1;
+		for (size_t i = 0; i < cnt; i++) {
+			bitmap_t* w = &words[(o[i] >> BM_BITS) & wmask];
+			if (value == FULL)
+				*w |= 1ULL << (o[i] & BM_MASK);
+			else
+				*w &= ~(1ULL << (o[i] & BM_MASK));
+		}
+		leafStore(p, s, level, words);
+		return;
+	}
+	n = itemOwnNode(p, s);
+	if (n == NULL || n == FULL)
+		*s = n = expandItem(p, level, n);
+	if (n->skip > 0) {
+		size_t i, j;
+		chainSplit(n, level, o, cnt, &i, &j);
+		if (chainFill(n) == value || (i == 0 && j == cnt)) {
+			// Offsets outside the chain path are in legs == value
+			setbits(p, &n->next, level - n->skip, o + i, j - i, value);
+			*s = chainNormalize(p, n);
+			return;
+		}
+		unchain(p, n);
+	}
+	size_t i = split(o, cnt, (o[0] & ~(span(level) - 1)) + span(level - 1));
+	setbits(p, &n->zero, level - 1, o, i, value);
+	setbits(p, &n->one, level - 1, o + i, cnt - i, value);
+	*s = itemNormalize(p, n);
+}
+
+static int isSorted(uint64_t const* offsets, size_t cnt)
+{
+	for (size_t i = 1; i < cnt; i++) {
+		if (offsets[i] < offsets[i - 1])
+			return 0;
+	}
+	return 1;
+}
+static int cmpOffset(void const* a, void const* b)
+{
+	uint64_t x = *(uint64_t const*)a, y = *(uint64_t const*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bmtsetbits(
+	struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt, void* value)
+{
+	uint64_t* sorted = NULL;
+	if (!isSorted(offsets, cnt)) {
+		sorted = malloc(cnt * sizeof(uint64_t));
+		if (sorted == NULL)
+			die("Out of mem");
+		memcpy(sorted, offsets, cnt * sizeof(uint64_t));
+		qsort(sorted, cnt, sizeof(uint64_t), cmpOffset);
+		offsets = sorted;
+	}
+	if (bmt->size > 0)
+		cnt = split(offsets, cnt, bmt->size);
+	setbits(bmt->pool, &bmt->top, bmt->levels, offsets, cnt, value);
+	if (bmt->journal != NULL) {
+		for (size_t i = 0; i < cnt; i++)
+			JOURNAL(bmt, value == FULL ? JOURNAL_SET : JOURNAL_CLEAR,
+					offsets[i], 0);
+	}
+	free(sorted);
+}
+
+void bmtSetBits(struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt)
+{
+	bmtsetbits(bmt, offsets, cnt, FULL);
+}
+void bmtClearBits(
+	struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt)
+{
+	bmtsetbits(bmt, offsets, cnt, NULL);
+}
+
+// testbits - Get the sorted 'offsets' in a subtree
+static uint64_t testbits(
+	struct bmtitem const* n, unsigned level, unsigned leafLevel,
+	uint64_t const* o, size_t cnt, uint8_t* values)
+{
+	if (cnt == 0)
+		return 0;
+	if (n == NULL || n == FULL) {
+		if (values != NULL)
+			memset(values, n == FULL, cnt);
+		return n == FULL ? cnt : 0;
+	}
+	if (level == leafLevel) {
+		uint64_t ones = 0;
+		unsigned wmask = (1 << level) - 1;
+		bitmap_t b;
+		bitmap_t const* words = leafWords(n, level, &b);
+		for (size_t i = 0; i < cnt; i++) {
+			bitmap_t w = words[(o[i] >> BM_BITS) & wmask];
+			unsigned v = (w >> (o[i] & BM_MASK)) & 1;
+			if (values != NULL)
+				values[i] = v;
+			ones += v;
+		}
+		return ones;
+	}
+	if (n->kind == KIND_NODE16) {
+		uint64_t ones = 0, base = o[0] & ~(span(level) - 1);
+		size_t i = 0;
+		for (unsigned k = 0; k < 16 && i < cnt; k++) {
+			size_t j = k == 15 ? cnt :
+				i + split(o + i, cnt - i, base + (k + 1) * span(level - 4));
+			ones += testbits(n->node16->leg[k], level - 4, leafLevel, o + i,
+							 j - i, values == NULL ? NULL : values + i);
+			i = j;
+		}
+		return ones;
+	}
+	if (n->kind != KIND_NODE) {
+		uint64_t ones = 0;
+		for (size_t i = 0; i < cnt; i++) {
+			int v = containerBit(n, o[i] & (span(CHUNK_LEVEL) - 1));
+			if (values != NULL)
+				values[i] = v;
+			ones += v;
+		}
+		return ones;
+	}
+	size_t i, j;
+	if (n->skip > 0) {
+		chainSplit(n, level, o, cnt, &i, &j);
+		struct bmtitem const* fill = chainFill(n);
+		return testbits(fill, 0, leafLevel, o, i, values) +
+			testbits(n->next, level - n->skip, leafLevel, o + i, j - i,
+					 values == NULL ? NULL : values + i) +
+			testbits(fill, 0, leafLevel, o + j, cnt - j,
+					 values == NULL ? NULL : values + j);
+	}
+	i = split(o, cnt, (o[0] & ~(span(level) - 1)) + span(level - 1));
+	return testbits(n->zero, level - 1, leafLevel, o, i, values) +
+		testbits(n->one, level - 1, leafLevel, o + i, cnt - i,
+				 values == NULL ? NULL : values + i);
+}
+
+uint64_t bmtTestBits(
+	struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt,
+	uint8_t* values)
+{
+	if (!isSorted(offsets, cnt)) {
+		uint64_t ones = 0;
+		for (size_t i = 0; i < cnt; i++) {
+			int v = bmtBit(bmt, offsets[i]);
+			if (values != NULL)
+				values[i] = v;
+			ones += v;
+		}
+		return ones;
+	}
+	size_t valid = cnt;
+	if (bmt->size > 0)
+		valid = split(offsets, cnt, bmt->size);
+	if (values != NULL)
+		memset(values + valid, 0, cnt - valid);
+	return testbits(
+		bmt->top, bmt->levels, bmt->pool->leafLevel, offsets, valid, values);
+}
+
+// ----------------------------------------------------------------------
+// Iteration;
+
+// firstBit - The offset of the first bit == 'value' in a position
+// that has one.
+static uint64_t firstBit(
+	struct bmtpos p, unsigned leafLevel, uint64_t base, int value)
 {
-	if (bmt == NULL)
-		return;
-	freeTree(bmt->top);
-	free(bmt);
+	struct bmtpos zero, one;
+	for (;;) {
+		if (p.n == NULL || p.n == FULL)
+			return base;
+		if (p.level == leafLevel) {
+			bitmap_t b;
+			return base + wordsNext(
+				leafWords(p.n, p.level, &b), 1 << leafLevel, 0, value);
+		}
+		if (isContainer(p.n))
+			return base + containerNext(p.n, 0, value);
+		posLegs(p, &zero, &one);
+		if (posHas(zero, value)) {
+			p = zero;
+		} else {
+			p = one;
+			base += span(p.level);
+		}
+	}
 }
 
-static struct bmtitem* setbit(
-	struct bmtitem* n, uint64_t offset, unsigned level, void* value)
+// nextBit - Find the first bit == 'value' at or above 'from'. On the way
+// down to 'from' the last (lowest) "one" leg that has a matching bit is
+// remembered. If there is no match below 'from' the search continues
+// from the start of that leg.
+static int nextBit(
+	struct BitmapTree* bmt, uint64_t from, int value, uint64_t* offset)
 {
-	if (n == value)
-		return n;
-	if (n == NULL || n == FULL)
-		n = expandItem(level, n);
-
-	uint64_t bitmask;
-	if (level > 0) {
-		bitmask = 1ULL << (level + 5);
-		if (offset & bitmask) {
-			n->one = setbit(n->one, offset, level - 1, value);
-		} else {
-			n->zero = setbit(n->zero, offset, level - 1, value);
+	if (bmt->size > 0 && from >= bmt->size)
+		return -1;
+	struct bmtpos p = {bmt->top, bmt->levels};
+	struct bmtpos zero, one, cand;
+	unsigned leafLevel = bmt->pool->leafLevel;
+	uint64_t candBase = 0;
+	int haveCand = 0;
+	for (;;) {
+		if (p.n == NULL || p.n == FULL) {
+			if ((p.n == FULL) == value) {
+				*offset = from;
+				return 0;
+			}
+			break;
 		}
-		if (n->zero == value && n->one == value) {
-			free(n);
-			return value;
+		if (p.level == leafLevel) {
+			uint64_t mask = span(leafLevel) - 1;
+			bitmap_t b;
+			int x = wordsNext(
+				leafWords(p.n, p.level, &b), 1 << leafLevel, from & mask, value);
+			if (x >= 0) {
+				*offset = (from & ~mask) + x;
+				return 0;
+			}
+			break;
 		}
-	} else {
-		bitmask = 1ULL << (offset & 0x3f);
-		if (value == FULL) {
-			n->bits |= bitmask;
-			if (n->bits == UINT64_MAX) {
-				free(n);
-				return FULL;
+		if (isContainer(p.n)) {
+			uint64_t mask = span(CHUNK_LEVEL) - 1;
+			int x = containerNext(p.n, from & mask, value);
+			if (x >= 0) {
+				*offset = (from & ~mask) + x;
+				return 0;
 			}
+			break;
+		}
+		posLegs(p, &zero, &one);
+		uint64_t bit = 1ULL << (p.level + 5);
+		if (from & bit) {
+			p = one;
 		} else {
-			n->bits &= ~bitmask;
-			if (n->bits == 0) {
-				free(n);
-				return NULL;
+			if (posHas(one, value)) {
+				cand = one;
+				candBase = (from & ~(bit - 1)) | bit;
+				haveCand = 1;
 			}
+			p = zero;
 		}
-		D(printf("setbit: bits=0x%016lx, bitmask=0x%lx\n", n->bits,bitmask));
 	}
-	return n;
+	if (!haveCand)
+		return -1;
+	*offset = firstBit(cand, leafLevel, candBase, value);
+	return 0;
 }
 
-void bmtSetBit(struct BitmapTree* bmt, uint64_t offset)
+int bmtNextSet(struct BitmapTree* bmt, uint64_t from, uint64_t* offset)
 {
-	if (bmt->size > 0 && offset >= bmt->size)
-		return;
-	bmt->top = setbit(bmt->top, offset, bmt->levels, FULL);
+	return nextBit(bmt, from, 1, offset);
+}
+int bmtNextClear(struct BitmapTree* bmt, uint64_t from, uint64_t* offset)
+{
+	return nextBit(bmt, from, 0, offset);
 }
 
-void bmtClearBit(struct BitmapTree* bmt, uint64_t offset)
+void bmtCursorInit(
+	struct bmtCursor* c, struct BitmapTree* bmt, uint64_t from, int value)
 {
-	if (bmt->size > 0 && offset >= bmt->size)
-		return;
-	bmt->top = setbit(bmt->top, offset, bmt->levels, NULL);
+	c->bmt = bmt;
+	c->next = from;
+	c->value = value != 0;
+	c->end = 0;
 }
 
-struct bmtitem* reserveBit(
-	struct bmtitem* n, unsigned level, uint64_t* offset, int* rc)
+int bmtCursorNext(struct bmtCursor* c, uint64_t* offset, uint64_t* length)
 {
-	if (n == FULL)
-		return n;
-	if (n == NULL) {
-		n = CALLOC(sizeof(struct bmtitem));
-		n->level = level;
+	uint64_t start, end;
+	if (c->end || nextBit(c->bmt, c->next, c->value, &start) != 0) {
+		c->end = 1;
+		return -1;
 	}
-	if (level > 0) {
-		if (n->zero != FULL) {
-			n->zero = reserveBit(n->zero, level - 1, offset, rc);
-		} else {
-			*offset += 1ULL << (level + 5);
-			n->one = reserveBit(n->one, level - 1, offset, rc);
-		}
-		if (n->zero == FULL && n->one == FULL) {
-			free(n);
-			return FULL;
-		}
-	} else {
-		unsigned o = 0;
-		uint64_t bitmask = 1;
-		for (o = 0; o < 64; o++) {
-			bitmask = 1ULL << o;
-			if ((n->bits & bitmask) == 0)
-				break;
-		}
-		assert(o < 64);	/* Full bitmasks should have been replaced with FULL */
-		*offset += o;
-		n->bits |= bitmask;
-		*rc = 0;
-		if (n->bits == UINT64_MAX) {
-			free(n);
-			return FULL;
-		}
+	if (nextBit(c->bmt, start, !c->value, &end) != 0) {
+		// The run goes to the end of the array
+		end = c->bmt->size;
+		c->end = 1;
 	}
-	return n;
+	*offset = start;
+	*length = end - start;
+	c->next = end;
+	return 0;
 }
 
-int bmtReserveBit(struct BitmapTree* bmt, uint64_t* offset)
+// ----------------------------------------------------------------------
+// Set algebra;
+
+/*
+  Two trees are traversed together. When one side is NULL/FULL the
+  result for the subtree is given by the other side as is, inverted or
+  as a constant, so only the parts where both trees have nodes are
+  visited. In-place operations keep the nodes of the first tree.
+ */
+enum { OP_OR, OP_AND, OP_ANDNOT, OP_XOR };
+enum { KEEP, INVERT, ZERO, ONE };
+
+// constAction - The result when one operand is NULL/FULL ('v')
+static int constAction(int op, int v, int constIsFirst)
 {
-	int rc = -1;
-	*offset = 0;
-	bmt->top = reserveBit(bmt->top, bmt->levels, offset, &rc);
-	return rc;
+	switch (op) {
+	case OP_OR:
+		return v ? ONE : KEEP;
+	case OP_AND:
+		return v ? KEEP : ZERO;
+	case OP_XOR:
+		return v ? INVERT : KEEP;
+	default:
+		if (constIsFirst)
+			return v ? INVERT : ZERO;
+		return v ? ZERO : KEEP;
+	}
 }
 
-static int getbit(struct bmtitem* n, uint64_t offset)
+static bitmap_t wordOp(int op, bitmap_t a, bitmap_t b)
 {
-	if (n == NULL)
-		return 0;
-	if (n == FULL)
-		return 1;
-
-	uint64_t bitmask;
-	if (n->level > 0) {
-		bitmask = 1ULL << (n->level + 5);
-		if (offset & bitmask) {
-			return getbit(n->one, offset);
-		} else {
-			return getbit(n->zero, offset);
-		}
+	switch (op) {
+	case OP_OR:
+		return a | b;
+	case OP_AND:
+		return a & b;
+	case OP_XOR:
+		return a ^ b;
+	default:
+		return a & ~b;
 	}
-
-	bitmask = 1ULL << (offset & 0x3f);
-	return (n->bits & bitmask) != 0;
 }
 
-int bmtBit(struct BitmapTree* bmt, uint64_t offset)
+// complement - Invert a subtree in place. This keeps it normalized.
+static void complement(
+	struct bmtpool* p, struct bmtitem** s, unsigned level)
 {
-	if (bmt->size > 0 && offset >= bmt->size)
-		return 0;
-	return getbit(bmt->top, offset);
+	struct bmtitem* n = *s;
+	if (n == NULL || n == FULL) {
+		*s = n == NULL ? FULL : NULL;
+		return;
+	}
+	if (level == 0) {
+		bitmapSet(p, s, ~bitmapWord(n));
+		return;
+	}
+	n = itemOwn(p, s);
+	if (n->kind == KIND_NODE16) {
+		// The legs stay items
+		for (unsigned i = 0; i < 16; i++)
+			complement(p, &n->node16->leg[i], level - 4);
+		node16Update(n);
+		if (level == CHUNK_LEVEL)
+			*s = chunkCheck(p, n);
+		return;
+	}
+	n = itemOwnNode(p, s);
+	if (level == p->leafLevel) {
+		for (unsigned i = 0; i < (1u << level); i++)
+			n->word[i] = ~n->word[i];
+		leafUpdate(n, level);
+		return;
+	}
+	if (n->skip > 0) {
+		n->fill = !n->fill;
+		complement(p, &n->next, level - n->skip);
+		n->maxfree[0] = itemMaxFree(n->next, level - n->skip);
+	} else {
+		complement(p, &n->zero, level - 1);
+		complement(p, &n->one, level - 1);
+		n->maxfree[0] = itemMaxFree(n->zero, level - 1);
+		n->maxfree[1] = itemMaxFree(n->one, level - 1);
+	}
+	n->ones = span(level) - n->ones;
+	if (level == CHUNK_LEVEL)
+		*s = chunkCheck(p, n);
 }
 
-static struct bmtitem* setbranch(
-	struct bmtitem* n, uint64_t offset, unsigned level,
-	unsigned wantedLevel, void* value)
+// posClone - Clone (and maybe invert) the subtree at a position
+static struct bmtitem* posClone(
+	struct bmtpool* p, struct bmtpos b, int invert)
 {
-	if (n == value) {
-		return n;
+	struct bmtitem* n;
+	if (b.level > 0 && b.n != NULL && b.n != FULL && b.n->skip > 0 &&
+		b.level < b.n->level) {
+		// The rest of a chain
+		unsigned bottom = b.n->level - b.n->skip;
+		n = itemAlloc(p, b.level);
+		chainSkip(p, n, b.level - bottom);
+		n->fill = b.n->fill;
+		n->prefix = b.n->prefix & chainMask(n->level, n->skip);
+		n->next = treeClone(p, b.n->next, bottom);
+		n = chainNormalize(p, n);
+	} else if (b.n != NULL && b.n != FULL && b.level > 0 &&
+			   b.n->kind == KIND_NODE16 && b.level < b.n->level) {
+		// Binary nodes inside a Node16
+		struct bmtpos zero, one;
+		posLegs(b, &zero, &one);
+		n = itemAlloc(p, b.level);
+		n->zero = posClone(p, zero, 0);
+		n->one = posClone(p, one, 0);
+		n = nodeNormalize(p, n);
+	} else {
+		n = treeClone(p, b.n, b.level);
 	}
-	if (n == NULL || n == FULL)
-		n = expandItem(level, n);
+	if (invert)
+		complement(p, &n, b.level);
+	return n;
+}
 
-	if (level > 0 && (level + 6) > wantedLevel) {
-		uint64_t bitmask = 1ULL << (level + 5);
-		if (offset & bitmask) {
-			n->one = setbranch(n->one, offset, level - 1, wantedLevel, value);
-		} else {
-			n->zero = setbranch(n->zero, offset, level - 1, wantedLevel, value);
-		}
-		if (n->zero == value && n->one == value) {
-			free(n);
-			return value;
+// combine - Combine the subtree at 's' with 'b' in place
+static void combine(
+	struct bmtpool* p, struct bmtitem** s, unsigned level, struct bmtpos b,
+	int op)
+{
+	struct bmtitem* n = *s;
+	if (b.n == NULL || b.n == FULL) {
+		switch (constAction(op, b.n == FULL, 0)) {
+		case KEEP:
+			break;
+		case INVERT:
+			complement(p, s, level);
+			break;
+		case ZERO:
+			freeTree(p, n, level);
+			*s = NULL;
+			break;
+		default:
+			freeTree(p, n, level);
+			*s = FULL;
 		}
-		return n;
+		return;
 	}
-	// We have found the wanted level
-	if (wantedLevel >= 6) {
-		freeTree(n);
-		return value;
-	}
-	assert(n->level == 0);
-	D(printf("setbranch: level=%u, wantedLevel=%u\n", n->level, wantedLevel));
-	// We must set/clear sections in the bitmap
-	// Create a mask that has 2^wantedLevel bits and shift it to position
-	unsigned shift = 1 << wantedLevel;
-	uint64_t m = (1ULL << shift) - 1;
-	shift = offset & 0x3f;
-	m = m << shift;
-	if (value == FULL) {
-		n->bits |= m;
-		if (n->bits == UINT64_MAX) {
-			free(n);
-			return FULL;
-		}
-	} else {
-		n->bits &= ~m;
-		if (n->bits == 0) {
-			free(n);
-			return NULL;
+	if (n == NULL || n == FULL) {
+		switch (constAction(op, n == FULL, 1)) {
+		case KEEP:
+			*s = posClone(p, b, 0);
+			break;
+		case INVERT:
+			*s = posClone(p, b, 1);
+			break;
+		case ZERO:
+			*s = NULL;
+			break;
+		default:
+			*s = FULL;
 		}
+		return;
 	}
-	D(printf("setbranch: m=0x%016lx, bits=0x%016lx\n", m, n->bits));
-	return n;
+	if (level == p->leafLevel) {
+		bitmap_t nb, bb;
+		bitmap_t* w = leafOwn(p, s, level, &nb);
+		bitmap_t const* bw = leafWords(b.n, level, &bb);
+		for (unsigned i = 0; i < (1u << level); i++)
+			w[i] = wordOp(op, w[i], bw[i]);
+		leafStore(p, s, level, w);
+		return;
+	}
+	if (isContainer(b.n)) {
+		// Combine with a temporary expansion. Clones are deep, so
+		// nothing in the result refers to it
+		struct bmtitem* t = containerExpand(p, b.n);
+		combine(p, s, level, (struct bmtpos){t, level}, op);
+		freeTree(p, t, level);
+		return;
+	}
+	n = itemOwnNode(p, s);
+	if (n->skip > 0)
+		unchain(p, n);
+	struct bmtpos zero, one;
+	posLegs(b, &zero, &one);
+	combine(p, &n->zero, level - 1, zero, op);
+	combine(p, &n->one, level - 1, one, op);
+	*s = itemNormalize(p, n);
 }
 
-int bmtsetbranch(
-	struct BitmapTree* bmt, uint64_t offset, uint64_t size, void* value)
+// combineNew - Combine two subtrees into a new subtree
+static struct bmtitem* combineNew(
+	struct bmtpool* p, struct bmtpos a, struct bmtpos b, int op)
 {
-	if (size == 0) {
-		size = bmt->size;
-		if (offset == 0 && size == 0) {
-			// Handle full set
-			freeTree(bmt->top);
-			bmt->top = value;
-			return 0;
-		}
+	struct bmtpos other = b;
+	int action;
+	if (b.n == NULL || b.n == FULL) {
+		action = constAction(op, b.n == FULL, 0);
+		other = a;
+	} else if (a.n == NULL || a.n == FULL) {
+		action = constAction(op, a.n == FULL, 1);
+	} else if (a.level == p->leafLevel) {
+		bitmap_t w[8], ab, bb;	/* (leafLevel <= 3) */
+		bitmap_t const* aw = leafWords(a.n, a.level, &ab);
+		bitmap_t const* bw = leafWords(b.n, b.level, &bb);
+		for (unsigned i = 0; i < (1u << a.level); i++)
+			w[i] = wordOp(op, aw[i], bw[i]);
+		return leafNew(p, a.level, w);
+	} else if (isContainer(a.n) || isContainer(b.n)) {
+		// Combine temporary expansions of containers (see combine())
+		struct bmtitem* ta = NULL;
+		struct bmtitem* tb = NULL;
+		if (isContainer(a.n))
+			a.n = ta = containerExpand(p, a.n);
+		if (isContainer(b.n))
+			b.n = tb = containerExpand(p, b.n);
+		struct bmtitem* n = combineNew(p, a, b, op);
+		freeTree(p, ta, a.level);
+		freeTree(p, tb, b.level);
+		return n;
+	} else {
+		struct bmtpos az, ao, bz, bo;
+		posLegs(a, &az, &ao);
+		posLegs(b, &bz, &bo);
+		struct bmtitem* n = itemAlloc(p, a.level);
+		n->zero = combineNew(p, az, bz, op);
+		n->one = combineNew(p, ao, bo, op);
+		return itemNormalize(p, n);
 	}
+	switch (action) {
+	case KEEP:
+		return posClone(p, other, 0);
+	case INVERT:
+		return posClone(p, other, 1);
+	case ZERO:
+		return NULL;
+	default:
+		return FULL;
+	}
+}
 
-	// Is size a power of 2?
-	if (size == 0)
-		return -1;
-	if (bmt->size > 0 && size > bmt->size)
+static int bmtcombine(struct BitmapTree* a, struct BitmapTree* b, int op)
+{
+	if (a->levels != b->levels || a->pool->leafLevel != b->pool->leafLevel)
 		return -1;
-	unsigned level = 0;			/* level = log2(size) */
-	uint64_t m = 1;
-	while (size != m) {
-		if (size < m)
-			return -1;
-		m = m << 1;
-		level++;
+	if (a == b) {
+		if (op == OP_ANDNOT || op == OP_XOR) {
+			freeTree(a->pool, a->top, a->levels);
+			a->top = NULL;
+			if (a->journal != NULL)
+				bmtCheckpoint(a);
+		}
+		return 0;
 	}
-	D(printf("bmtsetbranch: level=%u\n", level));
-	// Is offset a multiple of size?
-	if (offset % size)
-		return -1;
-	// Is offset + size out of range?
-	if (bmt->size == 0) {
-		if (offset > (UINT64_MAX - size + 1))
-			return -1;
-	} else if ((offset + size) > bmt->size)
-		return -1;
-
-	bmt->top = setbranch(bmt->top, offset, bmt->levels, level, value);
+	struct bmtpos bp = {b->top, b->levels};
+	combine(a->pool, &a->top, a->levels, bp, op);
+	if (a->journal != NULL)
+		bmtCheckpoint(a);
 	return 0;
 }
 
-int bmtSetBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size)
+static struct BitmapTree* bmtcombineNew(
+	struct BitmapTree* a, struct BitmapTree* b, int op)
 {
-	return bmtsetbranch(bmt, offset, size, FULL);
+	if (a->levels != b->levels || a->pool->leafLevel != b->pool->leafLevel)
+		return NULL;
+	struct BitmapTree* bmt = bmtCreateWithLeaves(
+		a->size, bmtLeafBits(a), &a->pool->allocator);
+	bmt->pool->arrayMax = a->pool->arrayMax;
+	bmt->pool->runsMax = a->pool->runsMax;
+	bmt->pool->node16 = a->pool->node16;
+	struct bmtpos ap = {a->top, a->levels};
+	struct bmtpos bp = {b->top, b->levels};
+	bmt->top = combineNew(bmt->pool, ap, bp, op);
+	return bmt;
 }
-int bmtClearBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size)
+
+int bmtUnion(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombine(a, b, OP_OR);
+}
+int bmtIntersect(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombine(a, b, OP_AND);
+}
+int bmtDifference(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombine(a, b, OP_ANDNOT);
+}
+int bmtXor(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombine(a, b, OP_XOR);
+}
+
+struct BitmapTree* bmtUnionNew(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombineNew(a, b, OP_OR);
+}
+struct BitmapTree* bmtIntersectNew(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombineNew(a, b, OP_AND);
+}
+struct BitmapTree* bmtDifferenceNew(
+	struct BitmapTree* a, struct BitmapTree* b)
 {
-	return bmtsetbranch(bmt, offset, size, NULL);
+	return bmtcombineNew(a, b, OP_ANDNOT);
+}
+struct BitmapTree* bmtXorNew(struct BitmapTree* a, struct BitmapTree* b)
+{
+	return bmtcombineNew(a, b, OP_XOR);
+}
+
+// ----------------------------------------------------------------------
+// Branches; Subtrees are moved between trees of different size. A
+// subtree of 2^wantedLevel bits has the same node levels in both.
+
+// branchClone - Clone the subtree of 2^wantedLevel bits at 'offset'
+// into the pool 'p'
+struct bmtitem* branchClone(
+	struct BitmapTree* bmt, uint64_t offset, unsigned wantedLevel,
+	struct bmtpool* p)
+{
+	struct bmtpos b = {bmt->top, bmt->levels};
+	struct bmtitem* tmp = NULL;
+	while (b.level + BM_BITS > wantedLevel) {
+		if (b.n == NULL || b.n == FULL)
+			break;
+		if (isContainer(b.n))
+			b.n = tmp = containerExpand(p, b.n);
+		struct bmtpos leg[2];
+		posLegs(b, &leg[0], &leg[1]);
+		b = leg[(offset >> (b.level + 5)) & 1];
+	}
+	struct bmtitem* n = posClone(p, b, 0);
+	freeTree(p, tmp, CHUNK_LEVEL);
+	return n;
+}
+
+// branchGraft - Replace the subtree of 2^wantedLevel bits at 'offset'
+// with 'n' which must be allocated from the pool of the tree
+void branchGraft(
+	struct BitmapTree* bmt, uint64_t offset, unsigned wantedLevel,
+	struct bmtitem* n)
+{
+	struct bmtpath path;
+	pathInit(&path);
+	setbranch(
+		bmt->pool, &path, &bmt->top, offset, bmt->levels, wantedLevel, n);
 }
 
 // ----------------------------------------------------------------------
@@ -355,25 +1896,43 @@ uint64_t bmtSize(struct BitmapTree* bmt)
 	return bmt->size;
 }
 
-static int itemCmp(struct bmtitem* n1, struct bmtitem* n2)
+// posCmp - Compare the subtrees at two positions. The structure may
+// differ where one tree uses containers, so positions are compared
+// level by level and containers by their runs.
+static int posCmp(struct bmtpos a, struct bmtpos b, unsigned leafLevel)
 {
-	if (n1 == NULL && n2 == NULL)
-		return 0;
-	if (n1 == FULL && n2 == FULL)
-		return 0;
-	D(printf("itemCmp: level=%u,%u\n", n1->level, n2->level));
-	if (n1->level != n2->level)
+	if (a.n == b.n)
+		return 0;				/* (shared) */
+	if (a.n == NULL || a.n == FULL || b.n == NULL || b.n == FULL)
 		return 1;
-	if (n1->level > 0) {
-		if (itemCmp(n1->zero, n2->zero) != 0)
-			return 1;
-		if (itemCmp(n1->one, n2->one) != 0)
-			return 1;
-		return 0;
+	D(printf("posCmp: level=%u\n", a.level));
+	if (a.level == leafLevel) {
+		bitmap_t ab, bb;
+		return memcmp(
+			leafWords(a.n, a.level, &ab), leafWords(b.n, b.level, &bb),
+			sizeof(bitmap_t) << leafLevel) != 0;
 	}
-	if (n1->bits != n2->bits)
-		return 1;
-	return 0;
+	if (isContainer(a.n) || isContainer(b.n)) {
+		uint32_t ca, cb;
+		uint16_t* ra = chunkRuns(a.n, a.level, leafLevel, &ca);
+		uint16_t* rb = chunkRuns(b.n, b.level, leafLevel, &cb);
+		int rc = ca != cb || memcmp(ra, rb, ca * 2 * sizeof(uint16_t)) != 0;
+		free(ra);
+		free(rb);
+		return rc;
+	}
+	if (a.n->skip > 0 && a.n->level == a.level && b.n->skip == a.n->skip &&
+		b.n->level == b.level && b.n->fill == a.n->fill &&
+		b.n->prefix == a.n->prefix) {
+		// Equal chains
+		struct bmtpos an = {a.n->next, a.level - a.n->skip};
+		struct bmtpos bn = {b.n->next, an.level};
+		return posCmp(an, bn, leafLevel);
+	}
+	struct bmtpos az, ao, bz, bo;
+	posLegs(a, &az, &ao);
+	posLegs(b, &bz, &bo);
+	return posCmp(az, bz, leafLevel) || posCmp(ao, bo, leafLevel);
 }
 int bmtCompare(struct BitmapTree* bmt1, struct BitmapTree* bmt2)
 {
@@ -381,61 +1940,339 @@ int bmtCompare(struct BitmapTree* bmt1, struct BitmapTree* bmt2)
 		return 1;
 	if (bmt1->levels != bmt2->levels)
 		return 1;
-	return itemCmp(bmt1->top, bmt2->top);
+	if (bmt1->pool->leafLevel != bmt2->pool->leafLevel)
+		return 1;
+	struct bmtpos a = {bmt1->top, bmt1->levels};
+	struct bmtpos b = {bmt2->top, bmt2->levels};
+	return posCmp(a, b, bmt1->pool->leafLevel);
 }
 
 
-static uint64_t countOnesInWord(uint64_t w)
+// bmtOnes - The '1' count is kept in the nodes so this is O(1)
+uint64_t bmtOnes(struct BitmapTree* bmt)
+{
+	if (bmt->top == FULL && bmt->size == 0)
+		return UINT64_MAX;		/* This is one too few */
+	return itemOnes(bmt->top, bmt->levels);
+}
+
+uint64_t bmtRank(struct BitmapTree* bmt, uint64_t offset)
 {
-	uint64_t cnt = 0;
-	uint64_t m;
-	for (m = 0x8000000000000000; m != 0; m = m >> 1) {
-		if (m & w)
-			cnt++;
+	if (bmt->size > 0 && offset >= bmt->size)
+		return bmtOnes(bmt);
+	struct bmtitem* n = bmt->top;
+	unsigned level = bmt->levels;
+	uint64_t rank = 0;
+	for (;;) {
+		if (n == NULL)
+			return rank;
+		if (n == FULL)
+			return rank + (offset & (span(level) - 1));
+		if (level == bmt->pool->leafLevel) {
+			unsigned i = (offset >> BM_BITS) & ((1 << level) - 1);
+			bitmap_t b;
+			bitmap_t const* w = leafWords(n, level, &b);
+			return rank + wordsPopcount(w, i) + __builtin_popcountll(
+				w[i] & ((1ULL << (offset & BM_MASK)) - 1));
+		}
+		if (n->kind == KIND_NODE16) {
+			unsigned i = node16Index(n, offset);
+			for (unsigned j = 0; j < i; j++)
+				rank += n->node16->ones[j];
+			level -= 4;
+			n = n->node16->leg[i];
+			continue;
+		}
+		if (n->kind != KIND_NODE)
+			return rank + containerRank(n, offset & (span(level) - 1));
+		if (n->skip > 0) {
+			unsigned d = chainMatch(n, offset);
+			// The "zero" legs beside the path where it takes the
+			// "one" leg are below the offset
+			uint64_t matched = chainMask(n->level, d);
+			if (n->fill)
+				rank += offset & matched;
+			if (d == n->skip) {
+				level -= n->skip;
+				n = n->next;
+				continue;
+			}
+			// The path and the offset diverge; the offset is in a
+			// fill leg and if it takes the "one" leg the rest of the
+			// chain is below it
+			level -= d;
+			if (offset & (1ULL << (level + 5))) {
+				uint64_t ones = chainOnes(n);
+				if (n->fill)
+					ones -= span(n->level) - span(level - 1);
+				rank += ones;
+			}
+			if (n->fill)
+				rank += offset & (span(level - 1) - 1);
+			return rank;
+		}
+		if (offset & (1ULL << (level + 5)))
+			rank += itemOnes(n->zero, level - 1);
+		level--;
+		n = n->leg[(offset >> (level + 6)) & 1];
 	}
-	D(printf("countOnesInWord: %lu\n", cnt));
-	return cnt;
 }
-static uint64_t cntOnes(struct bmtitem* n, unsigned level)
+
+// count - The number of 'value' bits in a subtree. The subtree must not
+// be NULL or FULL for a 2^64 span.
+static uint64_t count(struct bmtitem const* n, unsigned level, int value)
 {
-	if (n == NULL)
-		return 0;
-	if (n == FULL) {
-		if ((level + 6) == 64)
-			return UINT64_MAX;		/* This is one too few */
+	uint64_t ones = itemOnes(n, level);
+	return value ? ones : span(level) - ones;
+}
 
-		return 1ULL << (level + 6);
+static int selectBit(
+	struct BitmapTree* bmt, uint64_t k, int value, uint64_t* offset)
+{
+	struct bmtitem* n = bmt->top;
+	unsigned level = bmt->levels;
+	void* match = value ? FULL : NULL;
+	if (n == NULL || n == FULL) {
+		if (n != match || (bmt->size > 0 && k >= bmt->size))
+			return -1;
+		*offset = k;
+		return 0;
 	}
-	if (level == 0)
-		return countOnesInWord(n->bits);
+	if (k >= count(n, level, value))
+		return -1;
 
-	return cntOnes(n->zero, level - 1) + cntOnes(n->one, level - 1);
+	uint64_t base = 0;
+	for (;;) {
+		if (n == match) {
+			*offset = base + k;
+			return 0;
+		}
+		assert(n != NULL && n != FULL);
+		if (level == bmt->pool->leafLevel) {
+			bitmap_t b;
+			bitmap_t const* words = leafWords(n, level, &b);
+			bitmap_t w;
+			for (unsigned i = 0;; i++, base += 64) {
+				w = value ? words[i] : ~words[i];
+				unsigned c = __builtin_popcountll(w);
+				if (k < c)
+					break;
+				k -= c;
+			}
+			while (k-- > 0)
+				w &= w - 1;
+			*offset = base + __builtin_ctzll(w);
+			return 0;
+		}
+		if (n->kind == KIND_NODE16) {
+			unsigned i;
+			level -= 4;
+			for (i = 0;; i++) {
+				uint64_t ones = n->node16->ones[i];
+				uint64_t c = value ? ones : span(level) - ones;
+				if (k < c)
+					break;
+				k -= c;
+				base += span(level);
+			}
+			n = n->node16->leg[i];
+			continue;
+		}
+		if (n->kind != KIND_NODE) {
+			*offset = base + containerSelect(n, k, value);
+			return 0;
+		}
+		if (n->skip > 0) {
+			// Walk the chain levels. The fill legs are either all or
+			// none matching.
+			int fillMatch = chainFill(n) == match;
+			unsigned bottom = n->level - n->skip;
+			uint64_t restOnes = itemOnes(n->next, bottom);
+			for (; level > bottom; level--) {
+				uint64_t legSpan = span(level - 1);
+				uint64_t fc = fillMatch ? legSpan : 0;
+				if (n->prefix & (1ULL << (level + 5))) {
+					// The fill leg is the "zero" leg
+					if (k < fc) {
+						*offset = base + k;
+						return 0;
+					}
+					k -= fc;
+					base += legSpan;
+				} else {
+					uint64_t ones = restOnes;
+					if (n->fill)
+						ones += legSpan - span(bottom);
+					uint64_t rc = value ? ones : legSpan - ones;
+					if (k >= rc) {
+						// In the fill leg which is the "one" leg
+						*offset = base + legSpan + k - rc;
+						return 0;
+					}
+				}
+			}
+			n = n->next;
+			continue;
+		}
+		level--;
+		uint64_t c = count(n->zero, level, value);
+		if (k < c) {
+			n = n->zero;
+		} else {
+			k -= c;
+			base += span(level);
+			n = n->one;
+		}
+	}
 }
-uint64_t bmtOnes(struct BitmapTree* bmt)
+int bmtSelect(struct BitmapTree* bmt, uint64_t k, uint64_t* offset)
 {
-	return cntOnes(bmt->top, bmt->levels);
+	return selectBit(bmt, k, 1, offset);
+}
+int bmtSelectZero(struct BitmapTree* bmt, uint64_t k, uint64_t* offset)
+{
+	return selectBit(bmt, k, 0, offset);
 }
 
-static uint64_t cntNodes(struct bmtitem* n)
+// walkCounts - Count the items in a subtree as the pool does
+static void walkCounts(
+	struct bmtitem* n, unsigned level, unsigned leafLevel,
+	struct bmtcounts* c)
 {
 	if (n == NULL || n == FULL)
-		return 0;
-	if (n->level == 0)
-		return 1;
-	return 1 + cntNodes(n->zero) + cntNodes(n->one);
+		return;
+	c->items[level]++;
+	if (level == leafLevel)
+		return;
+	if (n->skip > 0) {
+		c->chains++;
+		c->pathBytes += (n->skip + 7) / 8;
+		walkCounts(n->next, level - n->skip, leafLevel, c);
+	} else if (n->kind == KIND_NODE16) {
+		c->node16s++;
+		for (unsigned i = 0; i < 16; i++)
+			walkCounts(n->node16->leg[i], level - 4, leafLevel, c);
+	} else if (n->kind != KIND_NODE) {
+		c->containers++;
+		c->valueBytes += containerBytes(n);
+	} else {
+		walkCounts(n->zero, level - 1, leafLevel, c);
+		walkCounts(n->one, level - 1, leafLevel, c);
+	}
 }
+
+// treeCounts - The counts of the pool if only this tree uses it, else
+// the tree is walked
+static struct bmtcounts const* treeCounts(
+	struct BitmapTree* bmt, struct bmtcounts* c)
+{
+	struct bmtpool* p = bmt->pool;
+	if (p->trees == 1 && bmt->epoch == NULL &&
+		__atomic_load_n(&p->readers, __ATOMIC_RELAXED) == 0)
+		return &p->count;
+	memset(c, 0, sizeof(*c));
+	walkCounts(bmt->top, bmt->levels, p->leafLevel, c);
+	return c;
+}
+
+static uint64_t countItems(struct bmtcounts const* c)
+{
+	uint64_t items = 0;
+	for (unsigned i = 0; i < 64; i++)
+		items += c->items[i];
+	return items;
+}
+
 uint64_t bmtNodes(struct BitmapTree* bmt)
 {
-	return cntNodes(bmt->top);
+	struct bmtcounts tmp;
+	return countItems(treeCounts(bmt, &tmp));
+}
+
+uint64_t bmtLeaves(struct BitmapTree* bmt)
+{
+	struct bmtcounts tmp;
+	struct bmtcounts const* c = treeCounts(bmt, &tmp);
+	return c->items[bmt->pool->leafLevel] + c->containers;
+}
+
+unsigned bmtDepth(struct BitmapTree* bmt)
+{
+	struct bmtcounts tmp;
+	struct bmtcounts const* c = treeCounts(bmt, &tmp);
+	for (unsigned i = 0; i <= bmt->levels; i++) {
+		if (c->items[i] > 0)
+			return bmt->levels - i + 1;
+	}
+	return 0;
+}
+
+// The size as written by "tree-store"; each item has a type byte, then
+// the skip and path of chains, the words of leaves and the count and
+// values of containers. A Node16 is written as the 15 nodes it
+// replaces. The frames have a 4 byte header.
+uint64_t bmtSerializedSize(struct BitmapTree* bmt)
+{
+	if (bmt->top == NULL || bmt->top == FULL)
+		return 3;
+	struct bmtcounts tmp;
+	struct bmtcounts const* c = treeCounts(bmt, &tmp);
+	unsigned leafLevel = bmt->pool->leafLevel;
+	uint64_t bytes = countItems(c) + c->chains + c->pathBytes +
+		c->items[leafLevel] * (sizeof(bitmap_t) << leafLevel) +
+		c->containers * sizeof(uint16_t) + c->valueBytes + 14 * c->node16s;
+	return 3 + bytes + 4 * ((bytes + 32767) / 32768);
+}
+
+unsigned bmtLeafBits(struct BitmapTree* bmt)
+{
+	return 64 << bmt->pool->leafLevel;
 }
 
 uint64_t bmtAllocated(struct BitmapTree* bmt)
 {
-	return sizeof(struct BitmapTree) + bmtNodes(bmt) * sizeof(struct bmtitem);
+	struct bmtpool* p = bmt->pool;
+	struct bmtcounts tmp;
+	struct bmtcounts const* c = treeCounts(bmt, &tmp);
+	// Bitmaps are kept in the legs
+	return sizeof(struct BitmapTree) + sizeof(struct bmtpool) +
+		(countItems(c) - c->items[0]) * p->items.itemSize + c->valueBytes +
+		c->node16s * sizeof(struct bmtnode16);
+}
+
+int bmtStats(struct BitmapTree* bmt, struct bmtStats* stats)
+{
+#ifdef BMT_NO_STATS
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#else
+	*stats = bmt->pool->stats;
+	return 0;
+#endif
+}
+
+void bmtStatsReset(struct BitmapTree* bmt)
+{
+	memset(&bmt->pool->stats, 0, sizeof(bmt->pool->stats));
+}
+
+int bmtSetContainers(
+	struct BitmapTree* bmt, unsigned arrayMax, unsigned runsMax)
+{
+	struct bmtpool* p = bmt->pool;
+	if (bmt->levels < CHUNK_LEVEL || arrayMax > 65535 || runsMax > 32768)
+		return -1;
+	// Existing nodes are not converted
+	if (p->trees > 1 || (bmt->top != NULL && bmt->top != FULL))
+		return -1;
+	p->arrayMax = arrayMax;
+	p->runsMax = runsMax;
+	return 0;
 }
 
 
-static void nodePrint(struct bmtitem* n, unsigned maxlevel, unsigned level)
+static void nodePrint(
+	struct bmtitem* n, unsigned maxlevel, unsigned level, unsigned leafLevel)
 {
 	if (n == NULL || n == FULL) {
 		for (int i = 0; i < (maxlevel - level) * 2; i++)
@@ -443,19 +2280,49 @@ static void nodePrint(struct bmtitem* n, unsigned maxlevel, unsigned level)
 		printf("(%u) %s\n", level, n == NULL ? "NULL":"FULL");
 		return;
 	}
-	if (level == 0) {
+	if (level == leafLevel) {
+		bitmap_t b;
+		for (int i = 0; i < (maxlevel - level) * 2; i++)
+			putchar(' ');
+		printf("(%u)", level);
+		for (unsigned i = 0; i < (1u << leafLevel); i++)
+			printf(" 0x%016lx", leafWords(n, level, &b)[i]);
+		putchar('\n');
+		return;
+	}
+	if (n->kind == KIND_NODE16) {
+		for (unsigned k = 0; k < 16; k++) {
+			if (k == 8) {
+				for (int i = 0; i < (maxlevel - level) * 2; i++)
+					putchar(' ');
+				printf("(%u) node16 ones=%lu\n", level, n->ones);
+			}
+			nodePrint(n->node16->leg[k], maxlevel, level - 4, leafLevel);
+		}
+		return;
+	}
+	if (n->kind != KIND_NODE) {
+		for (int i = 0; i < (maxlevel - level) * 2; i++)
+			putchar(' ');
+		printf("(%u) %s cnt=%u, ones=%lu\n", level,
+			   n->kind == KIND_ARRAY ? "array":"runs", n->cnt, n->ones);
+		return;
+	}
+	if (n->skip > 0) {
 		for (int i = 0; i < (maxlevel - level) * 2; i++)
 			putchar(' ');
-		printf("(%u) 0x%016lx\n", level, n->bits);
+		printf("(%u) chain skip=%u, prefix=0x%016lx, fill=%s\n",
+			   level, n->skip, n->prefix, n->fill ? "FULL":"NULL");
+		nodePrint(n->next, maxlevel, level - n->skip, leafLevel);
 		return;
 	}
-	nodePrint(n->zero, maxlevel, level - 1);
+	nodePrint(n->zero, maxlevel, level - 1, leafLevel);
 	for (int i = 0; i < (maxlevel - level) * 2; i++)
 		putchar(' ');
 	printf("(%u)\n", level);
-	nodePrint(n->one, maxlevel, level - 1);
+	nodePrint(n->one, maxlevel, level - 1, leafLevel);
 }
 void bmtPrint(struct BitmapTree* bmt)
 {
-	nodePrint(bmt->top, bmt->levels, bmt->levels);
+	nodePrint(bmt->top, bmt->levels, bmt->levels, bmt->pool->leafLevel);
 }
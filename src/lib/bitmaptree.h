@@ -8,18 +8,91 @@
 #include <stddef.h>
 
 struct BitmapTree;
+struct bmtReader;
+struct bmtShards;
+struct bmtImage;
 
 /*
   bmtCreate - Create an empty (all '0') BitmapTree of the desired
   size.  The size will be rounded up to the nearest power of 2 if
-  needed. A size of '0' will be interpreted as 2^64 (full size bit
-  array).
+  needed, and to at least 64. A size of '0' will be interpreted as
+  2^64 (full size bit array).
 
-  The initial memory size for *any* sized BitmapTree is 24 byte.
+  The initial memory size is the same for *any* sized BitmapTree (the
+  tree and its pool, see bmtAllocated()). Nodes are allocated on demand
+  in slabs owned by the tree.
   return: BitmapTree
  */
 struct BitmapTree* bmtCreate(uint64_t size);
+
+/*
+  bmtClone - Create a snapshot of a tree in O(1). The clone shares the
+  nodes with the original and nodes are copied when they are modified
+  in either tree (copy-on-write), so only the modified paths use new
+  memory. A tree and its clones use the same node slabs and must not
+  be used from different threads concurrently.
+ */
 struct BitmapTree* bmtClone(struct BitmapTree* bmt);
+
+// bmtRestore - Roll back a tree to a clone (snapshot) of it. This is
+// a pointer swap, the snapshot is kept and can be used again.
+// return: 0 - OK, != 0 - 'snapshot' is not a clone of 'bmt'
+int bmtRestore(struct BitmapTree* bmt, struct BitmapTree* snapshot);
+
+/*
+  bmtAllocator - A user supplied allocator. Tree nodes are allocated
+  in slabs, so 'alloc' is called seldom and with fairly large sizes.
+  The 'size' passed to 'free' is the same as was passed to 'alloc'.
+  'alloc' may return NULL which is treated as out-of-memory.
+ */
+struct bmtAllocator {
+	void* (*alloc)(void* userRef, size_t size);
+	void (*free)(void* userRef, void* mem, size_t size);
+	void* userRef;
+};
+
+// bmtCreateWithAllocator - Like bmtCreate() but nodes are allocated
+// with the passed allocator. A NULL allocator means malloc/free.
+// Clones inherit the allocator.
+struct BitmapTree* bmtCreateWithAllocator(
+	uint64_t size, struct bmtAllocator const* allocator);
+
+/*
+  bmtCreateWithLeaves - Like bmtCreateWithAllocator() but the leaves
+  (bitmaps) have 'leafBits' bits; 64 (default), 128, 256 or 512. Wide
+  leaves make the tree lower with fewer but larger nodes, which is
+  better for dense trees. For sparse trees the default is best.
+  return: BitmapTree, or NULL if 'leafBits' is invalid or larger than
+  the size.
+ */
+struct BitmapTree* bmtCreateWithLeaves(
+	uint64_t size, unsigned leafBits, struct bmtAllocator const* allocator);
+
+/*
+  bmtSetContainers - Store sparse and dense chunks of 2^16 bits as
+  containers (as in Roaring bitmaps). A chunk with at most 'arrayMax'
+  '1's is stored as a sorted array of 16-bit offsets, and a chunk with
+  less than 'runsMax' '0's as a list of runs. Containers are converted
+  between the kinds and to nodes when they grow beyond the limits.
+  4096/2048 are good values; (0,0) turns containers off (default).
+  return: 0 - OK, != 0 - The tree is not empty (or full) or shared with
+  a clone, the size is < 2^16 or a limit is invalid (arrayMax >= 2^16
+  or runsMax > 2^15)
+ */
+int bmtSetContainers(
+	struct BitmapTree* bmt, unsigned arrayMax, unsigned runsMax);
+
+/*
+  bmtSetNode16 - Use 16-way nodes (on != 0) or binary nodes only
+  (default). In dense parts of the tree a node and the three levels of
+  nodes below it are replaced by one item with 16 legs and their '1'
+  counts, so bmtBit(), bmtRank() and bmtSelect() pass 4 times fewer
+  items. The existing nodes are converted. The stored formats are the
+  same, a tree that is read uses binary nodes until this is called.
+  return: 0 - OK, != 0 - The tree is shared with a clone or concurrent
+  readers
+ */
+int bmtSetNode16(struct BitmapTree* bmt, int on);
 void bmtDelete(struct BitmapTree* bmt);
 
 // bmtSetBit - set a bit to '1'
@@ -32,6 +105,15 @@ void bmtClearBit(struct BitmapTree* bmt, uint64_t offset);
 // return; 0 - Bit reserved at 'offset'. != 0 - No free bit found.
 int bmtReserveBit(struct BitmapTree* bmt, uint64_t* offset);
 
+// bmtReserveBitFrom - Same as bmtReserveBit() but the search starts at
+// 'from' and wraps around to the start of the array.
+int bmtReserveBitFrom(struct BitmapTree* bmt, uint64_t from, uint64_t* offset);
+
+// bmtReserveNextFit - Same as bmtReserveBitFrom() with 'from' after the
+// bit reserved last time. This avoids walking a densely used area at the
+// start of the array on every reservation.
+int bmtReserveNextFit(struct BitmapTree* bmt, uint64_t* offset);
+
 // bmtBit - Get the value of a bit. Invalid offset returns '0'.
 int bmtBit(struct BitmapTree* bmt, uint64_t offset);
 
@@ -45,6 +127,110 @@ int bmtSetBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size);
 // bmtClearBranch - Same as bmtSetBranch() but set a "branch" to '0'.
 int bmtClearBranch(struct BitmapTree* bmt, uint64_t offset, uint64_t size);
 
+// bmtSetRange - Set the bits from 'first' to 'last' (inclusive) to '1'.
+// The range does not have to be aligned. It is split in branches in
+// one traversal.
+// return: 0 - OK, != 0 - invalid params
+int bmtSetRange(struct BitmapTree* bmt, uint64_t first, uint64_t last);
+
+// bmtClearRange - Same as bmtSetRange() but set the bits to '0'.
+int bmtClearRange(struct BitmapTree* bmt, uint64_t first, uint64_t last);
+
+// bmtReserveBranch - Find the first "branch" of 'size' bits that are
+// all '0' and reserve it by setting them to '1'. The 'size' must be a
+// power of 2 and the branch is aligned on 'size', e.g. a subnet.
+// Size==0 will be translated to size=array-size. The search is O(depth).
+// return; 0 - Branch reserved at 'offset'. != 0 - No free branch found
+// or invalid size.
+int bmtReserveBranch(struct BitmapTree* bmt, uint64_t size, uint64_t* offset);
+
+
+// ----------------------------------------------------------------------
+// Bulk operations;
+
+// bmtSetBits - Set the bits at 'offsets' to '1'. The tree is traversed
+// once for all offsets. Sorted offsets are fastest, otherwise they are
+// sorted in a copy. Invalid offsets are ignored.
+void bmtSetBits(struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt);
+
+// bmtClearBits - Same as bmtSetBits() but set the bits to '0'.
+void bmtClearBits(
+	struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt);
+
+// bmtTestBits - Get the bits at 'offsets'. If 'values' != NULL the bits
+// are stored there in the same order. Unsorted offsets are looked up
+// one at the time. Invalid offsets give '0'.
+// return: The number of '1's
+uint64_t bmtTestBits(
+	struct BitmapTree* bmt, uint64_t const* offsets, size_t cnt,
+	uint8_t* values);
+
+// ----------------------------------------------------------------------
+// Iteration;
+
+// bmtNextSet - Find the first '1' at or above 'from'.
+// return; 0 - found at 'offset', != 0 - No '1' found.
+int bmtNextSet(struct BitmapTree* bmt, uint64_t from, uint64_t* offset);
+
+// bmtNextClear - Find the first '0' at or above 'from'.
+// return; 0 - found at 'offset', != 0 - No '0' found.
+int bmtNextClear(struct BitmapTree* bmt, uint64_t from, uint64_t* offset);
+
+/*
+  bmtCursor - Iterate over maximal runs of '1's or '0's. NULL and FULL
+  subtrees are passed in one step so the cost is proportional to the
+  number of nodes, not bits. The tree must not be modified while
+  iterating. Example, print the free ranges;
+
+    struct bmtCursor c;
+    uint64_t offset, length;
+    bmtCursorInit(&c, bmt, 0, 0);
+    while (bmtCursorNext(&c, &offset, &length) == 0)
+      printf("%lu, %lu\n", offset, length);
+ */
+struct bmtCursor {
+	struct BitmapTree* bmt;
+	uint64_t next;
+	int value;
+	int end;
+};
+
+// bmtCursorInit - Start iterating runs of 'value' at 'from'.
+void bmtCursorInit(
+	struct bmtCursor* c, struct BitmapTree* bmt, uint64_t from, int value);
+
+// bmtCursorNext - Get the next run. If 'from' is inside a run the
+// first run starts at 'from'. A 'length' of 0 means 2^64 (a full size
+// array with all bits equal).
+// return; 0 - a run is returned, != 0 - no more runs.
+int bmtCursorNext(struct bmtCursor* c, uint64_t* offset, uint64_t* length);
+
+// ----------------------------------------------------------------------
+// Set algebra;
+
+// The trees are traversed together and subtrees where one tree is all
+// '0' or all '1' are not visited, so the cost depends on the overlap of
+// the trees, not on the size. The trees must have the same size and
+// leaf size.
+
+// bmtUnion - a = a | b
+// return: 0 - OK, != 0 - different sizes
+int bmtUnion(struct BitmapTree* a, struct BitmapTree* b);
+// bmtIntersect - a = a & b
+int bmtIntersect(struct BitmapTree* a, struct BitmapTree* b);
+// bmtDifference - a = a & ~b
+int bmtDifference(struct BitmapTree* a, struct BitmapTree* b);
+// bmtXor - a = a ^ b
+int bmtXor(struct BitmapTree* a, struct BitmapTree* b);
+
+// bmtUnionNew - Same as bmtUnion() but the result is a new tree. The
+// new tree inherits the allocator from 'a'.
+// return: The new tree or NULL if the trees have different sizes
+struct BitmapTree* bmtUnionNew(struct BitmapTree* a, struct BitmapTree* b);
+struct BitmapTree* bmtIntersectNew(struct BitmapTree* a, struct BitmapTree* b);
+struct BitmapTree* bmtDifferenceNew(
+	struct BitmapTree* a, struct BitmapTree* b);
+struct BitmapTree* bmtXorNew(struct BitmapTree* a, struct BitmapTree* b);
 
 // ----------------------------------------------------------------------
 // Serialize;
@@ -64,6 +250,8 @@ extern bmtRead_t bmtRead;
 
 // bmtSerializeAlgorithm - Set the method for serialization. Available;
 // "tree-store" - Store the tree in the customary fashion (default)
+// "packed-tree" - A bit-packed format, typically 2-3 times smaller than
+//   "tree-store" but slower to write and read
 // return; 0 - OK, != 0 - failed
 int bmtSerializeMethod(char const* method);
 
@@ -73,6 +261,184 @@ int bmtSerializeMethod(char const* method);
 int bmtSerializeMethodRegister(
 	char const* name, bmtRead_t readFn, bmtWrite_t writeFn, int set);
 
+// bmtWriteParallel - Write the bmt in "tree-store" format with subtrees
+// encoded by 'threads' threads. An index of the subtrees is written so
+// they can be read in parallel by bmtReadParallel(). The output is also
+// read by bmtRead() with "tree-store". Small trees, and 'threads' < 2,
+// are written as by bmtWrite(). The encoded tree is kept in memory.
+void bmtWriteParallel(
+	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef,
+	unsigned threads);
+
+// bmtReadParallel - Read a bmt in "tree-store" format. If the tree has a
+// subtree index, the subtrees are read by 'threads' threads.
+// return NULL on failure
+struct BitmapTree* bmtReadParallel(
+	bmtReadFn_t readFn, void* userRef, unsigned threads);
+
+
+// ----------------------------------------------------------------------
+// Journal;
+
+/*
+  Instead of writing the whole tree after every change, modifications
+  can be appended to a log as compact records. A checkpoint writes the
+  tree with bmtWrite() and truncates the log. To recover, read the last
+  image with bmtRead() and replay the log with bmtJournalReplay().
+
+  Set/clear of bits, branches and ranges, and reservations are recorded.
+  Set algebra and bmtRestore() on a tree with a journal take a
+  checkpoint. Records are appended in commits of 'batch' records (group
+  commit). Records that are not committed are lost in a crash, use
+  bmtJournalFlush() to commit them.
+ */
+struct bmtJournal {
+	bmtWriteFn_t append;		/* Append a commit to the log */
+	bmtWriteFn_t image;			/* Write the checkpoint image */
+	// Called when the image is written. The log shall be emptied
+	void (*truncate)(void* userRef);
+	void* userRef;
+	unsigned batch;				/* Records per commit. 0 = 1 */
+};
+
+// bmtJournalStart - Start journaling. A checkpoint is taken first.
+// Stopped by bmtJournalStop() or bmtDelete(). Clones have no journal.
+// return: 0 - OK, != 0 - a journal is already used or invalid params
+int bmtJournalStart(struct BitmapTree* bmt, struct bmtJournal const* journal);
+int bmtJournalStop(struct BitmapTree* bmt);
+
+// bmtJournalFlush - Commit the collected records
+// return: 0 - OK, != 0 - no journal
+int bmtJournalFlush(struct BitmapTree* bmt);
+
+// bmtCheckpoint - Write an image and truncate the log
+// return: 0 - OK, != 0 - no journal
+int bmtCheckpoint(struct BitmapTree* bmt);
+
+// bmtJournalReplay - Apply the records in a log, e.g. on a tree read
+// from the checkpoint image. The replay ends at an incomplete commit.
+// return: The number of records or -1 if the log is invalid
+int64_t bmtJournalReplay(
+	struct BitmapTree* bmt, bmtReadFn_t readFn, void* userRef);
+
+// ----------------------------------------------------------------------
+// Images;
+
+/*
+  An image is a flat copy of a tree without pointers that is queried
+  in place, for instance mmap'ed from a file. Opening an image is O(1)
+  and the memory of a mapped file is shared by all processes that map
+  it. Example;
+
+    int fd = open(path, O_RDONLY);
+    void* data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    struct bmtImage* img = bmtImageOpen(data, len);
+    if (bmtImageBit(img, offset)) ...
+
+  Images are read-only. Use bmtImagePromote() to get a tree to modify.
+ */
+
+// bmtImageWrite - Write an image of the bmt
+void bmtImageWrite(
+	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef);
+
+// bmtImageOpen - Use an image in memory. The memory must be 8-byte
+// aligned and is used until bmtImageClose(). Only the header is checked,
+// a corrupt image gives wrong results but no reads outside the image.
+// return: The image or NULL if the header is invalid
+struct bmtImage* bmtImageOpen(void const* data, size_t len);
+void bmtImageClose(struct bmtImage* img);
+
+// bmtImageBit, bmtImageOnes, bmtImageRank, bmtImageNextSet,
+// bmtImageNextClear - As the functions for a tree
+int bmtImageBit(struct bmtImage* img, uint64_t offset);
+uint64_t bmtImageOnes(struct bmtImage* img);
+uint64_t bmtImageRank(struct bmtImage* img, uint64_t offset);
+int bmtImageNextSet(struct bmtImage* img, uint64_t from, uint64_t* offset);
+int bmtImageNextClear(struct bmtImage* img, uint64_t from, uint64_t* offset);
+
+// bmtImagePromote - Create a tree with the contents of an image, e.g.
+// before the first write. The image is checked and is not modified.
+// return: The tree or NULL if the image is invalid
+struct BitmapTree* bmtImagePromote(struct bmtImage* img);
+
+// ----------------------------------------------------------------------
+// Concurrent readers;
+
+/*
+  A tree in concurrent mode can be read by many threads without locks
+  while one thread (the writer) modifies it with the normal functions.
+  Changes are not visible to readers until they are published, so a
+  writer may batch changes. Nodes replaced by the writer are released
+  when no reader can use them (epoch-based reclamation).
+
+  A reader thread uses a bmtReader and reads in read sections;
+
+    struct BitmapTree* view = bmtReadBegin(reader);
+    if (bmtBit(view, offset)) ...
+    bmtReadEnd(reader);
+
+  Only functions that don't modify the tree may be used on the view
+  and the view must not be used after bmtReadEnd(). Read sections
+  should be short since they delay the release of replaced nodes.
+ */
+
+// bmtConcurrent - Enable concurrent mode for a tree.
+// return: 0 - OK, != 0 - failed
+int bmtConcurrent(struct BitmapTree* bmt);
+
+// bmtPublish - Make the changes visible to readers and release nodes
+// that are not used by any reader. Called by the writer.
+// return: 0 - OK, != 0 - the tree is not in concurrent mode
+int bmtPublish(struct BitmapTree* bmt);
+
+// bmtReaderCreate - Create a reader. All readers must be deleted before
+// the tree is deleted.
+// return: The reader or NULL if the tree is not in concurrent mode
+struct bmtReader* bmtReaderCreate(struct BitmapTree* bmt);
+void bmtReaderDelete(struct bmtReader* r);
+
+// bmtReadBegin - Start a read section
+// return: A read-only view of the last published tree
+struct BitmapTree* bmtReadBegin(struct bmtReader* r);
+
+// bmtReadEnd - End a read section
+void bmtReadEnd(struct bmtReader* r);
+
+// ----------------------------------------------------------------------
+// Sharded reservation;
+
+/*
+  For reservations from many threads the bit range can be split in
+  shards, each with a lock of its own. A thread reserves bits in its
+  "home" shard (e.g. the thread or cpu index) and reserves from other
+  shards only when the home shard is full. All functions are thread
+  safe.
+
+  Use bmtShardsTree() to get a normal tree, for instance to serialize
+  it. A tree that is read with bmtRead() can be sharded again.
+ */
+
+// bmtShardsCreate - Create shards with the contents of a tree. The tree
+// is not used after the call. 'count' must be a power of 2 and a shard
+// must be at least one leaf. The shards use the allocator of the tree
+// from many threads.
+// return: The shards or NULL on failure
+struct bmtShards* bmtShardsCreate(struct BitmapTree* bmt, unsigned count);
+void bmtShardsDelete(struct bmtShards* s);
+
+// bmtShardsReserveBit - Reserve a bit, preferably in the 'home' shard
+// (modulo the shard count).
+// return; 0 - OK, != 0 - all bits are set
+int bmtShardsReserveBit(struct bmtShards* s, unsigned home, uint64_t* offset);
+
+void bmtShardsSetBit(struct bmtShards* s, uint64_t offset);
+void bmtShardsClearBit(struct bmtShards* s, uint64_t offset);
+int bmtShardsBit(struct bmtShards* s, uint64_t offset);
+uint64_t bmtShardsOnes(struct bmtShards* s);
+
+// bmtShardsTree - Create a tree with a consistent image of all shards
+struct BitmapTree* bmtShardsTree(struct bmtShards* s);
 
 // ----------------------------------------------------------------------
 // Stats;
@@ -83,14 +449,75 @@ uint64_t bmtSize(struct BitmapTree* bmt);
 // bmtCompare - return zero if the bmt's are equal
 int bmtCompare(struct BitmapTree* bmt1, struct BitmapTree* bmt2);
 
-// bmtOnes - return the number of 'ones' in the bitmap.
+// bmtOnes - return the number of 'ones' in the bitmap. The count is
+// kept up to date in the tree so this is O(1).
 uint64_t bmtOnes(struct BitmapTree* bmt);
 
+// bmtRank - return the number of 'ones' below 'offset'.
+uint64_t bmtRank(struct BitmapTree* bmt, uint64_t offset);
+
+// bmtSelect - Find the offset of the k'th 'one' (counted from 0).
+// return; 0 - found, != 0 - there are not that many 'ones'.
+int bmtSelect(struct BitmapTree* bmt, uint64_t k, uint64_t* offset);
+
+// bmtSelectZero - Same as bmtSelect() but find the k'th 'zero'.
+int bmtSelectZero(struct BitmapTree* bmt, uint64_t k, uint64_t* offset);
+
+/*
+  Size functions. The counts are kept up to date by the pool, so they
+  are O(1) unless the pool is shared with clones or concurrent readers.
+  The tree is walked in that case.
+ */
+
 // bmtNodes - return the number of nodes in the tree.
 uint64_t bmtNodes(struct BitmapTree* bmt);
 
-// bmtAllocated - return number of allocated bytes
+// bmtLeaves - return the number of leaves (bitmaps and containers)
+uint64_t bmtLeaves(struct BitmapTree* bmt);
+
+// bmtDepth - return the number of levels from the top down to the
+// deepest node, both included. A chain spans the levels it skips, so a
+// lone bit in a 2^64 tree gives 59 (with 64 bit leaves). 0 if empty/full
+unsigned bmtDepth(struct BitmapTree* bmt);
+
+// bmtLeafBits - return the number of bits in a leaf.
+unsigned bmtLeafBits(struct BitmapTree* bmt);
+
+// bmtAllocated - return number of allocated bytes, including the
+// values of containers and the legs of 16-way nodes
 uint64_t bmtAllocated(struct BitmapTree* bmt);
 
+// bmtSerializedSize - return the number of bytes written by
+// "tree-store". Allocated container values are counted, so the size
+// may be larger for trees with containers.
+uint64_t bmtSerializedSize(struct BitmapTree* bmt);
+
 // bmtPrint - Prints the BitmapTree to stdout
 void bmtPrint(struct BitmapTree* bmt);
+
+/*
+  Statistics. Counters are kept for the pool of a tree, so they are
+  shared with clones. The counters are cheap enough to be used in
+  production but can be removed by compiling with -DBMT_NO_STATS.
+  Only modifications are counted in 'operations', 'levels' and
+  'depth'. Lookups (bmtBit(), bmtRank(), bmtSelect(), bmtNextSet()...)
+  are not, they may run in concurrent readers and counting them would
+  need an atomic update in every lookup.
+ */
+#define BMT_DEPTH_BUCKETS 16
+struct bmtStats {
+	uint64_t expansions;		/* NULL/FULL expanded to an item */
+	uint64_t frees;				/* Items freed, e.g. collapsed to NULL/FULL */
+	uint64_t operations;		/* Bit and branch modifications */
+	uint64_t levels;			/* Nodes passed by the operations */
+	uint64_t depth[BMT_DEPTH_BUCKETS];	/* Operations by nodes passed / 4 */
+	uint64_t reserves;			/* Reserved bits */
+	uint64_t denseReserves;		/* Reserved in an existing leaf/container */
+	uint64_t allocBytes;		/* Allocated from the allocator */
+	uint64_t freeBytes;			/* Released to the allocator */
+};
+
+// bmtStats - Get the counters.
+// return: 0 - OK, != 0 - not available (BMT_NO_STATS)
+int bmtStats(struct BitmapTree* bmt, struct bmtStats* stats);
+void bmtStatsReset(struct BitmapTree* bmt);
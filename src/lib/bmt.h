@@ -7,35 +7,241 @@
 // Internal interface for BitmapTree
 
 #include <bitmaptree.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #define Dx(x) x
 #define D(x)
 #define CALLOC(x) callocOrDie(x)
-#define FULL (void*)1
+#define FULL (void*)UINTPTR_MAX
 
 typedef uint64_t bitmap_t;
 #define BM_BITS 6
 #define BM_MASK 0x3fUL
 #define BM_MAX UINT64_MAX
 
+/*
+  A node is a bitmap (level 0), a node with "zero" and "one" legs, or a
+  "chain" (skip > 0). A chain replaces 'skip' levels of nodes where one
+  leg is always 'fill' (0=NULL, 1=FULL). The path through the chain is
+  given by the 'prefix' bits for the skipped levels and it ends in
+  'next' at level (level - skip). 'next' is never equal to the fill
+  and never a chain with the same fill.
+
+  Nodes keep the number of '1's in the subtree in 'ones', and the
+  largest free (all '0') aligned block in each leg in 'maxfree' as
+  log2(size) + 1, or 0 if there is no free bit. A chain keeps it for
+  'next' in maxfree[0].
+
+  A bitmap is not an item. The word is kept in place of the pointer in
+  the leg, the 'next' of a chain or the top that holds it, so an empty
+  bitmap is NULL and a full bitmap is FULL (all bits '1'). A subtree at
+  level 0 must never be dereferenced, see bitmapWord().
+
+  Clones (snapshots) share nodes. 'refs' is the number of extra
+  references to a shared node, and a shared node is copied before it
+  is modified, so only the nodes on the modified path are copied.
+
+  A tree may have wide leaves of 2^leafLevel words at level 'leafLevel'
+  (kept in the pool). The words extend the item, so all items in such
+  a tree are larger. A wide leaf keeps 'ones' and 'maxfree' (in both
+  legs) like a node.
+
+  A "container" (kind != KIND_NODE) holds a chunk of 2^16 bits at
+  CHUNK_LEVEL as sorted 16-bit values; the offsets of the '1's (an
+  array) or (first, last) pairs (runs). The values are allocated
+  outside the item. A container keeps 'ones' and 'maxfree' like a wide
+  leaf. See containers.c.
+
+  A "Node16" (kind KIND_NODE16) replaces a node and the three levels of
+  nodes below it. The 16 legs at (level - 4), their '1' counts and
+  'maxfree' are allocated outside the item, and the item keeps the
+  totals like a node (maxfree in both legs). The legs are never
+  NULL/FULL. Only used if set in the pool, see node16.c.
+ */
+#define CHUNK_LEVEL (16 - BM_BITS)
+enum { KIND_NODE, KIND_ARRAY, KIND_RUNS, KIND_NODE16 };
+struct bmtnode16 {
+	struct bmtitem* leg[16];
+	uint64_t ones[16];
+	uint8_t maxfree[16];
+};
 struct bmtitem {
-	unsigned level;
+	uint8_t level;
+	uint8_t skip;
+	uint8_t fill;
+	uint8_t maxfree[2];
+	uint8_t kind;
+	uint16_t refs;
+	union {
+		uint64_t ones;
+		struct bmtitem* nextFree;
+	};
 	union {
 		struct {
 			struct bmtitem* zero;
 			struct bmtitem* one;
 		};
-		bitmap_t bits;
+		struct bmtitem* leg[2];	/* zero, one indexed by the offset bit */
+		bitmap_t word[2];		/* A wide leaf has 2^leafLevel words */
+		struct {
+			uint16_t* vals;		/* Values or (first, last) pairs */
+			uint32_t cnt;		/* Number of values or runs */
+			uint32_t cap;		/* Allocated values */
+		};
+		struct bmtnode16* node16;
+		struct {
+			uint64_t prefix;
+			struct bmtitem* next;
+		};
 	};
 };
 
+/*
+  Nodes are allocated from slabs owned by the tree. Released nodes are
+  kept on an intrusive free list (linked through "nextFree") and all
+  slabs are released at once when the tree is deleted. Clones share the
+  pool with the original tree, so the slabs are released when the last
+  of them is deleted.
+
+  Bitmaps are kept in the legs so all items are at least 32 bytes.
+ */
+#define SLAB_MIN_ITEMS 16
+#define SLAB_MAX_ITEMS 4096
+#define REFS_MAX UINT16_MAX
+struct bmtslab {
+	struct bmtslab* next;
+	size_t size;
+	struct bmtitem items[];
+};
+struct bmtslabs {
+	struct bmtitem* freeList;
+	struct bmtitem* cursor;		/* Next unused item in the newest slab */
+	struct bmtitem* end;
+	struct bmtslab* slabs;
+	unsigned slabItems;			/* Item count for the next slab */
+	size_t itemSize;
+};
+
+/*
+  The pool keeps counts of the live items, so the size of a tree that
+  does not share the pool (no clones or concurrent readers) is known
+  without a walk. Items are counted per level when allocated and freed,
+  chains when the skip changes (chainSkip()), and containers and 16-way
+  nodes when the values or legs are allocated and released. Bitmaps
+  are counted at level 0 when a leg gets or loses one (bitmapSet(),
+  itemShare(), freeTree()).
+ */
+struct bmtcounts {
+	uint64_t items[64];			/* By level */
+	uint64_t chains;
+	uint64_t pathBytes;			/* Stored chain paths, (skip+7)/8 bytes */
+	uint64_t containers;
+	uint64_t valueBytes;		/* Allocated container values */
+	uint64_t node16s;
+};
+
+struct bmtpool {
+	struct bmtslabs items;
+	unsigned trees;				/* Trees using the pool */
+	unsigned leafLevel;			/* log2 of the words in a leaf */
+	unsigned arrayMax;			/* Container limits, 0 = not used */
+	unsigned runsMax;
+	unsigned node16;			/* 16-way nodes are used */
+	struct bmtAllocator allocator;
+	struct bmtStats stats;
+	struct bmtcounts count;
+	unsigned readers;			/* Concurrent readers of the pool */
+};
+
+// STATS - Update a counter, e.g. STATS(p, frees++)
+#ifdef BMT_NO_STATS
+#define STATS(p, x)
+#else
+#define STATS(p, x) (p)->stats.x
+#endif
+
 struct BitmapTree {
 	uint64_t size;
 	unsigned levels;
+	uint64_t nextFit;			/* Start of the next bmtReserveNextFit() */
+	struct bmtitem* top;
+	struct bmtpool* pool;
+	struct bmtepoch* epoch;		/* Concurrent readers, or NULL */
+	struct bmtjournal* journal;	/* Or NULL */
+};
+
+/*
+  Journal (journal.c). Modifications are recorded after they are done,
+  reservations as the bits or branch that was set.
+ */
+enum {
+	JOURNAL_SET = 1, JOURNAL_CLEAR, JOURNAL_SET_BRANCH, JOURNAL_CLEAR_BRANCH,
+	JOURNAL_SET_RANGE, JOURNAL_CLEAR_RANGE
+};
+void journalRecord(
+	struct bmtjournal* j, unsigned op, uint64_t offset, uint64_t arg);
+void journalStop(struct BitmapTree* bmt);
+#define JOURNAL(bmt, op, offset, arg) do {							\
+		if ((bmt)->journal != NULL)										\
+			journalRecord((bmt)->journal, (op), (offset), (arg));		\
+	} while (0)
+
+/*
+  Concurrent readers. The published tree holds a reference to its
+  nodes so the writer copies them on modification. A replaced tree is
+  "retired" in the current epoch and released when no reader is in a
+  read section started in that epoch or before.
+ */
+struct bmtReader {
+	struct BitmapTree view;		/* Read-only view of the published tree */
+	struct bmtepoch* e;
+	uint64_t epoch;				/* Epoch of the read section, 0 = none */
+	struct bmtReader* next;
+};
+struct bmtretired {
+	struct bmtretired* next;
 	struct bmtitem* top;
+	uint64_t epoch;
+};
+struct bmtepoch {
+	struct bmtitem* published;
+	uint64_t epoch;				/* The global epoch, starts at 1 */
+	pthread_mutex_t lock;		/* Protects the reader list */
+	struct bmtReader* readers;
+	struct bmtretired* retired;
+};
+
+/*
+  Sharded reservation. Each shard is a separate tree for a part of the
+  bit range with its own lock and pool. Shards are padded to separate
+  cache lines.
+ */
+struct bmtshard {
+	union {
+		struct {
+			pthread_mutex_t lock;
+			struct BitmapTree* bmt;
+			uint64_t base;
+			int full;			/* Read without the lock to skip the shard */
+		};
+		char pad[128];
+	};
+};
+struct bmtShards {
+	uint64_t size;
+	unsigned levels;			/* Of the whole tree */
+	unsigned count;
+	unsigned shift;				/* log2 of the shard size */
+	unsigned arrayMax;			/* Container limits of the tree */
+	unsigned runsMax;
+	struct bmtshard* shard;
 };
 
 static inline void die(char const* fmt, ...)__attribute__ ((__noreturn__));
@@ -54,17 +260,493 @@ static inline void* callocOrDie(size_t size)
 	return mem;
 }
 
-static inline struct bmtitem* expandItem(unsigned level, void* value)
+// span - The number of bits in a subtree. 2^64 is returned as 0 which
+// gives correct results in (modulo 2^64) arithmetic
+static inline uint64_t span(unsigned level)
+{
+	return (level + 6) == 64 ? 0 : 1ULL << (level + 6);
+}
+
+// bitmapWord - The word of a bitmap (a subtree at level 0)
+static inline bitmap_t bitmapWord(struct bmtitem const* n)
+{
+	return (uintptr_t)n;
+}
+
+// isContainer - An item that holds its chunk as values
+static inline int isContainer(struct bmtitem const* n)
+{
+	return n->kind == KIND_ARRAY || n->kind == KIND_RUNS;
+}
+
+// node16Index - The leg of a 16-way node that holds 'offset'
+static inline unsigned node16Index(struct bmtitem const* n, uint64_t offset)
+{
+	return (offset >> (n->level + 2)) & 15;
+}
+
+// itemOnes - The number of '1's in a subtree
+static inline uint64_t itemOnes(struct bmtitem const* n, unsigned level)
+{
+	if (n == NULL)
+		return 0;
+	if (n == FULL)
+		return span(level);
+	if (level == 0)
+		return __builtin_popcountll(bitmapWord(n));
+	return n->ones;
+}
+
+// leafMaxFree - The largest free aligned block in a bitmap (log2 + 1)
+static const bitmap_t alignedMask[BM_BITS] = {
+	0x5555555555555555ULL, 0x1111111111111111ULL, 0x0101010101010101ULL,
+	0x0001000100010001ULL, 0x0000000100000001ULL, 0x0000000000000001ULL
+};
+static inline unsigned leafMaxFree(bitmap_t bits)
+{
+	bitmap_t z = ~bits;		/* The starts of free blocks */
+	unsigned k;
+	if (z == 0)
+		return 0;
+	for (k = 0; k < BM_BITS; k++) {
+		bitmap_t next = z & (z >> (1 << k)) & alignedMask[k];
+		if (next == 0)
+			break;
+		z = next;
+	}
+	return k + 1;
+}
+
+// leafFirstFree - The offset of the first free aligned block of
+// 2^k bits in a bitmap that has one
+static inline unsigned leafFirstFree(bitmap_t bits, unsigned k)
+{
+	bitmap_t z = ~bits;
+	for (unsigned i = 0; i < k; i++)
+		z &= (z >> (1 << i)) & alignedMask[i];
+	return __builtin_ctzll(z);
+}
+
+/*
+  Multi-word bitmaps (wide leaves). 'cnt' is a power of 2 <= 8. The
+  word scans use AVX2/AVX-512 when the compiler targets them (e.g.
+  CFLAGS=-march=native), otherwise plain loops.
+ */
+
+// wordsPopcount - The number of '1's in 'cnt' words
+static inline uint64_t wordsPopcount(bitmap_t const* b, unsigned cnt)
+{
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+	if (cnt == 8)
+		return _mm512_reduce_add_epi64(
+			_mm512_popcnt_epi64(_mm512_loadu_si512(b)));
+#endif
+	uint64_t ones = 0;
+	for (unsigned i = 0; i < cnt; i++)
+		ones += __builtin_popcountll(b[i]);
+	return ones;
+}
+
+// wordsFirst - The index of the first word from 'from' that is not 'w',
+// or 'cnt'
+static inline unsigned wordsFirst(
+	bitmap_t const* b, unsigned cnt, unsigned from, bitmap_t w)
+{
+#if defined(__AVX2__)
+	if (from == 0 && cnt >= 4) {
+		__m256i x = _mm256_set1_epi64x(w);
+		for (unsigned i = 0; i < cnt; i += 4) {
+			__m256i v = _mm256_cmpeq_epi64(
+				_mm256_loadu_si256((__m256i const*)(b + i)), x);
+			unsigned m = ~_mm256_movemask_pd(_mm256_castsi256_pd(v)) & 0xf;
+			if (m != 0)
+				return i + __builtin_ctz(m);
+		}
+		return cnt;
+	}
+#endif
+	unsigned i;
+	for (i = from; i < cnt && b[i] == w; i++);
+	return i;
+}
+
+// wordsNext - The first bit == 'value' at or above bit 'from', or -1
+static inline int wordsNext(
+	bitmap_t const* b, unsigned cnt, unsigned from, int value)
+{
+	unsigned i = from >> BM_BITS;
+	bitmap_t w = (value ? b[i] : ~b[i]) & (BM_MAX << (from & BM_MASK));
+	if (w == 0) {
+		i = wordsFirst(b, cnt, i + 1, value ? 0 : BM_MAX);
+		if (i == cnt)
+			return -1;
+		w = value ? b[i] : ~b[i];
+	}
+	return (i << BM_BITS) + __builtin_ctzll(w);
+}
+
+// wordsMaxFree - leafMaxFree() for 'cnt' words. Free blocks larger
+// than a word are aligned runs of zero words.
+static inline unsigned wordsMaxFree(bitmap_t const* b, unsigned cnt)
 {
-	struct bmtitem* n = CALLOC(sizeof(struct bmtitem));
+	unsigned max = 0, k;
+	bitmap_t z = 0;				/* The zero words */
+	for (unsigned i = 0; i < cnt; i++) {
+		if (b[i] == 0) {
+			z |= 1ULL << i;
+		} else {
+			unsigned f = leafMaxFree(b[i]);
+			if (f > max)
+				max = f;
+		}
+	}
+	if (z == 0)
+		return max;
+	for (k = 0; (1u << k) < cnt; k++) {
+		bitmap_t next = z & (z >> (1 << k)) & alignedMask[k];
+		if (next == 0)
+			break;
+		z = next;
+	}
+	return BM_BITS + k + 1;
+}
+
+// wordsFirstFree - The offset of the first free aligned block of 2^k
+// bits in words that have one
+static inline unsigned wordsFirstFree(
+	bitmap_t const* b, unsigned cnt, unsigned k)
+{
+	unsigned i;
+	if (k < BM_BITS) {
+		for (i = 0; leafMaxFree(b[i]) <= k; i++);
+		return (i << BM_BITS) + leafFirstFree(b[i], k);
+	}
+	bitmap_t z = 0;
+	for (i = 0; i < cnt; i++)
+		z |= (bitmap_t)(b[i] == 0) << i;
+	for (i = 0; i < k - BM_BITS; i++)
+		z &= (z >> (1 << i)) & alignedMask[i];
+	return __builtin_ctzll(z) << BM_BITS;
+}
+
+// wordsSetRange - Set the bits [first,last] to 'value'
+static inline void wordsSetRange(
+	bitmap_t* b, unsigned first, unsigned last, int value)
+{
+	for (unsigned i = first >> BM_BITS; i <= last >> BM_BITS; i++) {
+		bitmap_t m = BM_MAX;
+		if (i == first >> BM_BITS)
+			m &= BM_MAX << (first & BM_MASK);
+		if (i == last >> BM_BITS)
+			m &= BM_MAX >> (63 - (last & BM_MASK));
+		if (value)
+			b[i] |= m;
+		else
+			b[i] &= ~m;
+	}
+}
+
+// itemMaxFree - The largest free aligned block in a subtree (log2 + 1)
+static inline unsigned itemMaxFree(struct bmtitem const* n, unsigned level)
+{
+	if (n == NULL)
+		return level + 7;
+	if (n == FULL)
+		return 0;
+	if (level == 0)
+		return leafMaxFree(bitmapWord(n));
+	if (n->skip > 0)
+		return n->fill ? n->maxfree[0] : level + 6;
+	return n->maxfree[0] > n->maxfree[1] ? n->maxfree[0] : n->maxfree[1];
+}
+
+struct bmtitem* poolGrow(struct bmtpool* p, struct bmtslabs* s);
+struct bmtitem* itemShare(
+	struct bmtpool* p, struct bmtitem* n, unsigned level);
+void freeTree(struct bmtpool* p, struct bmtitem* n, unsigned level);
+void epochRelease(struct BitmapTree* bmt);
+struct bmtitem* branchClone(
+	struct BitmapTree* bmt, uint64_t offset, unsigned wantedLevel,
+	struct bmtpool* p);
+void branchGraft(
+	struct BitmapTree* bmt, uint64_t offset, unsigned wantedLevel,
+	struct bmtitem* n);
+struct bmtitem* itemNormalize(struct bmtpool* p, struct bmtitem* n);
+struct bmtitem* chainNormalize(struct bmtpool* p, struct bmtitem* n);
+struct bmtitem* nodeNormalize(struct bmtpool* p, struct bmtitem* n);
+void poolInit(struct bmtpool* p, struct bmtAllocator const* allocator);
+void poolRelease(struct bmtpool* p);
+void poolMerge(struct bmtpool* p, struct bmtpool* from);
+
+// Containers (containers.c);
+void containerReserve(struct bmtpool* p, struct bmtitem* n, uint32_t size);
+void containerRelease(struct bmtpool* p, struct bmtitem* n);
+void containersRelease(struct bmtpool* p);
+struct bmtitem* containerCopy(struct bmtpool* p, struct bmtitem const* n);
+struct bmtitem* containerExpand(struct bmtpool* p, struct bmtitem const* n);
+struct bmtitem* containerNormalize(struct bmtpool* p, struct bmtitem* n);
+struct bmtitem* chunkCompact(struct bmtpool* p, struct bmtitem* n);
+void containerUpdate(struct bmtitem* n);
+int containerCheck(struct bmtitem* n);
+int containerSetBit(
+	struct bmtpool* p, struct bmtitem* n, unsigned x, int value);
+int containerBit(struct bmtitem const* n, unsigned x);
+int containerNext(struct bmtitem const* n, unsigned from, int value);
+unsigned containerRank(struct bmtitem const* n, unsigned x);
+unsigned containerSelect(struct bmtitem const* n, unsigned k, int value);
+size_t containerBytes(struct bmtitem const* n);
+uint16_t* chunkRuns(
+	struct bmtitem const* n, unsigned level, unsigned leafLevel,
+	uint32_t* cnt);
+
+// 16-way nodes (node16.c);
+void node16Release(struct bmtpool* p, struct bmtitem* n);
+struct bmtitem* node16Copy(struct bmtpool* p, struct bmtitem const* n);
+struct bmtitem* node16New(
+	struct bmtpool* p, unsigned level, struct bmtitem* const* leg);
+struct bmtitem* node16Expand(struct bmtpool* p, struct bmtitem const* n);
+struct bmtitem* node16Check(struct bmtpool* p, struct bmtitem* n);
+struct bmtitem* node16Normalize(struct bmtpool* p, struct bmtitem* n);
+void node16Update(struct bmtitem* n);
+void node16MaxFree(struct bmtitem* n);
+
+static inline struct bmtitem* itemAlloc(struct bmtpool* p, unsigned level)
+{
+	struct bmtslabs* s = &p->items;
+	struct bmtitem* n = s->freeList;
+	if (n != NULL) {
+		s->freeList = n->nextFree;
+	} else if (s->cursor < s->end) {
+		n = s->cursor;
+		s->cursor = (struct bmtitem*)((char*)n + s->itemSize);
+	} else {
+		n = poolGrow(p, s);
+	}
+	memset(n, 0, s->itemSize);
 	n->level = level;
-	if (level > 0)
+	p->count.items[level]++;
+	return n;
+}
+static inline void itemFree(struct bmtpool* p, struct bmtitem* n)
+{
+	if (isContainer(n))
+		containerRelease(p, n);
+	else if (n->kind == KIND_NODE16)
+		node16Release(p, n);
+	p->count.items[n->level]--;
+	if (n->skip > 0) {
+		p->count.chains--;
+		p->count.pathBytes -= (n->skip + 7) / 8;
+	}
+	STATS(p, frees++);
+	struct bmtslabs* s = &p->items;
+	n->nextFree = s->freeList;
+	s->freeList = n;
+}
+
+// chainSkip - Set the skip of an item (0 = not a chain)
+static inline void chainSkip(
+	struct bmtpool* p, struct bmtitem* n, unsigned skip)
+{
+	p->count.chains -= n->skip > 0;
+	p->count.pathBytes -= (n->skip + 7) / 8;
+	p->count.chains += skip > 0;
+	p->count.pathBytes += (skip + 7) / 8;
+	n->skip = skip;
+}
+
+static inline struct bmtitem* expandItem(
+	struct bmtpool* p, unsigned level, void* value)
+{
+	struct bmtitem* n = itemAlloc(p, level);
+	STATS(p, expansions++);
+	if (level > p->leafLevel) {
 		n->zero = n->one = value;
-	else if (value == FULL)
-		n->bits = UINT64_MAX;
+		n->maxfree[0] = n->maxfree[1] = itemMaxFree(value, level - 1);
+		if (value == FULL)
+			n->ones = span(level);
+	} else {
+		// A wide leaf (bitmaps are not items)
+		n->maxfree[0] = n->maxfree[1] = itemMaxFree(value, level);
+		if (value == FULL) {
+			memset(n->word, 0xff, sizeof(bitmap_t) << level);
+			n->ones = span(level);
+		}
+	}
+	return n;
+}
+
+// bitmapSet - Store a bitmap word in the slot 's'. The pool counts the
+// bitmaps that are not NULL or FULL.
+static inline void bitmapSet(
+	struct bmtpool* p, struct bmtitem** s, bitmap_t w)
+{
+	struct bmtitem* n = (struct bmtitem*)(uintptr_t)w;
+	p->count.items[0] += (n != NULL && n != FULL) - (*s != NULL && *s != FULL);
+	*s = n;
+}
+
+// leafWords - The words of a leaf. The word of a bitmap is copied to 'w'
+static inline bitmap_t const* leafWords(
+	struct bmtitem const* n, unsigned level, bitmap_t* w)
+{
+	if (level > 0)
+		return n->word;
+	*w = bitmapWord(n);
+	return w;
+}
+
+// leafUpdate - Update 'ones' and 'maxfree' of a wide leaf
+static inline void leafUpdate(struct bmtitem* n, unsigned level)
+{
+	n->ones = wordsPopcount(n->word, 1 << level);
+	n->maxfree[0] = n->maxfree[1] = wordsMaxFree(n->word, 1 << level);
+}
+
+// leafNormalize - Called when the bits of a wide leaf may have
+// changed. A leaf with all bits equal is replaced by NULL or FULL.
+static inline struct bmtitem* leafNormalize(
+	struct bmtpool* p, struct bmtitem* n)
+{
+	leafUpdate(n, p->leafLevel);
+	if (n->ones != 0 && n->ones != span(p->leafLevel))
+		return n;
+	void* value = n->ones == 0 ? NULL : FULL;
+	itemFree(p, n);
+	return value;
+}
+
+// leafNew - A leaf with the words 'w', or NULL/FULL if all bits are equal
+static inline struct bmtitem* leafNew(
+	struct bmtpool* p, unsigned level, bitmap_t const* w)
+{
+	struct bmtitem* n = NULL;
+	if (level == 0) {
+		bitmapSet(p, &n, w[0]);
+		return n;
+	}
+	n = itemAlloc(p, level);
+	memcpy(n->word, w, sizeof(bitmap_t) << level);
+	return leafNormalize(p, n);
+}
+
+// chunkCheck - Called when a subtree has been normalized. A chunk that
+// is within the container limits of the pool is made a container.
+static inline struct bmtitem* chunkCheck(struct bmtpool* p, struct bmtitem* n)
+{
+	if (n == NULL || n == FULL || n->level != CHUNK_LEVEL || isContainer(n))
+		return n;
+	if (n->ones <= p->arrayMax || span(CHUNK_LEVEL) - n->ones < p->runsMax)
+		return chunkCompact(p, n);
 	return n;
 }
 
+static inline struct bmtitem* chainFill(struct bmtitem const* n)
+{
+	return n->fill ? FULL : NULL;
+}
+
+// chainMask - The offset bits covered by a chain. (level - skip + 6)
+// is 64 for skip == 0 at the top of a 2^64 tree
+static inline uint64_t chainMask(unsigned level, unsigned skip)
+{
+	if (skip == 0)
+		return 0;
+	return ((1ULL << skip) - 1) << (level - skip + 6);
+}
+
+// chainOnes - Count the '1's of a chain from 'next' and the fill
+static inline uint64_t chainOnes(struct bmtitem const* n)
+{
+	unsigned bottom = n->level - n->skip;
+	uint64_t ones = itemOnes(n->next, bottom);
+	if (n->fill)
+		ones += span(n->level) - span(bottom);
+	return ones;
+}
+
+/*
+  A position in the tree. Inside a chain 'level' is below n->level and
+  the position is the rest of the chain from that level. This allows a
+  chain to be traversed one level at the time as normal nodes. Inside
+  a Node16 'path' has the (n->level - level) bits of the legs taken
+  from the top, as for the binary nodes it replaces.
+ */
+struct bmtpos {
+	struct bmtitem* n;
+	unsigned level;
+	unsigned path;
+};
+
+// posLegs - Get the legs of a position that is not NULL/FULL or a bitmap
+static inline void posLegs(
+	struct bmtpos p, struct bmtpos* zero, struct bmtpos* one)
+{
+	struct bmtitem* n = p.n;
+	zero->level = one->level = p.level - 1;
+	zero->path = one->path = 0;
+	if (n->kind == KIND_NODE16) {
+		unsigned path = p.path << 1;
+		if (p.level - 1 == n->level - 4) {
+			zero->n = n->node16->leg[path];
+			one->n = n->node16->leg[path | 1];
+		} else {
+			zero->n = one->n = n;
+			zero->path = path;
+			one->path = path | 1;
+		}
+		return;
+	}
+	if (n->skip == 0) {
+		zero->n = n->zero;
+		one->n = n->one;
+		return;
+	}
+	struct bmtpos rest = {n, p.level - 1};
+	if (rest.level == n->level - n->skip)
+		rest.n = n->next;
+	struct bmtpos fill = {chainFill(n), p.level - 1};
+	if (n->prefix & (1ULL << (p.level + 5))) {
+		*zero = fill;
+		*one = rest;
+	} else {
+		*zero = rest;
+		*one = fill;
+	}
+}
+
+// posHas - Return != 0 if the position has any bit == 'value'
+static inline int posHas(struct bmtpos p, int value)
+{
+	if (p.n == NULL || p.n == FULL)
+		return (p.n == FULL) == value;
+	if (p.level > 0 && p.n->skip > 0 && p.level < p.n->level) {
+		// Inside a chain there are fill legs below
+		if (p.n->fill == value)
+			return 1;
+		return p.n->next != (value ? NULL : FULL);
+	}
+	return 1;					/* Not NULL/FULL, so both */
+}
+
+// posMaxFree - itemMaxFree() for a position
+static inline unsigned posMaxFree(struct bmtpos p)
+{
+	if (p.n == NULL || p.n == FULL || p.level == 0 || p.level == p.n->level)
+		return itemMaxFree(p.n, p.level);
+	if (p.n->kind == KIND_NODE16) {
+		// The largest of the legs below the position
+		unsigned k = p.level - (p.n->level - 4), max = 0;
+		uint8_t const* m = p.n->node16->maxfree + (p.path << k);
+		for (unsigned i = 0; i < (1u << k); i++) {
+			if (m[i] > max)
+				max = m[i];
+		}
+		return max;
+	}
+	return p.n->fill ? p.n->maxfree[0] : p.level + 6;
+}
+
 // Rounded up, so ulog2(7) == 3 and ulog2(UINT_MAX) == 64
 static inline unsigned ulog2(uint64_t x)
 {
@@ -0,0 +1,138 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  Epoch-based reclamation. A reader announces the global epoch before
+  it loads the published top and the writer increments the epoch after
+  a new top is published. A tree retired in epoch 't' may still be
+  used by readers that announced an epoch <= t, so it is released when
+  all active readers have announced a later epoch. All loads and
+  stores of shared variables are sequentially consistent so a reader
+  that is missed by the writer's scan will see the new top.
+ */
+
+int bmtConcurrent(struct BitmapTree* bmt)
+{
+	if (bmt->epoch != NULL)
+		return 0;
+	struct bmtepoch* e = CALLOC(sizeof(struct bmtepoch));
+	if (pthread_mutex_init(&e->lock, NULL) != 0) {
+		free(e);
+		return -1;
+	}
+	e->epoch = 1;
+	e->published = itemShare(bmt->pool, bmt->top, bmt->levels);
+	bmt->epoch = e;
+	return 0;
+}
+
+// reclaim - Release retired trees that no reader can use
+static void reclaim(struct bmtepoch* e, struct BitmapTree* bmt)
+{
+	uint64_t min = UINT64_MAX;
+	pthread_mutex_lock(&e->lock);
+	for (struct bmtReader* r = e->readers; r != NULL; r = r->next) {
+		uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < min)
+			min = epoch;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	struct bmtretired** pr = &e->retired;
+	while (*pr != NULL) {
+		struct bmtretired* r = *pr;
+		if (r->epoch < min) {
+			*pr = r->next;
+			freeTree(bmt->pool, r->top, bmt->levels);
+			free(r);
+		} else {
+			pr = &r->next;
+		}
+	}
+}
+
+int bmtPublish(struct BitmapTree* bmt)
+{
+	struct bmtepoch* e = bmt->epoch;
+	if (e == NULL)
+		return -1;
+	struct bmtitem* old = e->published;
+	if (old != bmt->top) {
+		struct bmtretired* r = CALLOC(sizeof(struct bmtretired));
+		__atomic_store_n(
+			&e->published, itemShare(bmt->pool, bmt->top, bmt->levels),
+			__ATOMIC_SEQ_CST);
+		r->top = old;
+		r->epoch = __atomic_fetch_add(&e->epoch, 1, __ATOMIC_SEQ_CST);
+		r->next = e->retired;
+		e->retired = r;
+	}
+	reclaim(e, bmt);
+	return 0;
+}
+
+// epochRelease - Called from bmtDelete(). All readers must be deleted.
+void epochRelease(struct BitmapTree* bmt)
+{
+	struct bmtepoch* e = bmt->epoch;
+	while (e->retired != NULL) {
+		struct bmtretired* r = e->retired;
+		e->retired = r->next;
+		freeTree(bmt->pool, r->top, bmt->levels);
+		free(r);
+	}
+	freeTree(bmt->pool, e->published, bmt->levels);
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+	bmt->epoch = NULL;
+}
+
+struct bmtReader* bmtReaderCreate(struct BitmapTree* bmt)
+{
+	struct bmtepoch* e = bmt->epoch;
+	if (e == NULL)
+		return NULL;
+	struct bmtReader* r = CALLOC(sizeof(struct bmtReader));
+	r->view = *bmt;
+	r->view.epoch = NULL;
+	r->view.top = NULL;
+	r->e = e;
+	__atomic_fetch_add(&bmt->pool->readers, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&e->lock);
+	r->next = e->readers;
+	e->readers = r;
+	pthread_mutex_unlock(&e->lock);
+	return r;
+}
+
+void bmtReaderDelete(struct bmtReader* r)
+{
+	if (r == NULL)
+		return;
+	struct bmtepoch* e = r->e;
+	pthread_mutex_lock(&e->lock);
+	struct bmtReader** pr = &e->readers;
+	while (*pr != r)
+		pr = &(*pr)->next;
+	*pr = r->next;
+	pthread_mutex_unlock(&e->lock);
+	__atomic_fetch_sub(&r->view.pool->readers, 1, __ATOMIC_RELAXED);
+	free(r);
+}
+
+struct BitmapTree* bmtReadBegin(struct bmtReader* r)
+{
+	uint64_t epoch = __atomic_load_n(&r->e->epoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->epoch, epoch, __ATOMIC_SEQ_CST);
+	r->view.top = __atomic_load_n(&r->e->published, __ATOMIC_SEQ_CST);
+	return &r->view;
+}
+
+void bmtReadEnd(struct bmtReader* r)
+{
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,573 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  Containers, as in Roaring bitmaps. A chunk (2^16 bits) with few '1's
+  is stored as a sorted array of their offsets, and a chunk with few
+  '0's as a sorted list of runs of '1's, instead of nodes.
+
+  A chunk of nodes becomes an array when it has at most 'arrayMax' '1's
+  and runs when it has less than 'runsMax' '0's (so at most 'runsMax'
+  runs). An array with more than 'arrayMax' values becomes runs, and
+  runs that are more than 'runsMax' become an array, if they fit,
+  otherwise the container is expanded to nodes.
+
+  The values are allocated with the allocator of the pool. Array
+  values are never adjacent runs, so both kinds are handled as runs
+  where first == last for an array.
+ */
+
+#define CHUNK_BITS 65536
+
+static inline unsigned runFirst(struct bmtitem const* n, uint32_t i)
+{
+	return n->kind == KIND_RUNS ? n->vals[2 * i] : n->vals[i];
+}
+static inline unsigned runLast(struct bmtitem const* n, uint32_t i)
+{
+	return n->kind == KIND_RUNS ? n->vals[2 * i + 1] : n->vals[i];
+}
+
+// lowerRun - The first run in [i,j) with last >= x
+static uint32_t lowerRun(
+	struct bmtitem const* n, uint32_t i, uint32_t j, unsigned x)
+{
+	while (i < j) {
+		uint32_t m = i + (j - i) / 2;
+		if (runLast(n, m) < x)
+			i = m + 1;
+		else
+			j = m;
+	}
+	return i;
+}
+
+// upperRun - The first run in [i,j) with first >= x
+static uint32_t upperRun(
+	struct bmtitem const* n, uint32_t i, uint32_t j, unsigned x)
+{
+	while (i < j) {
+		uint32_t m = i + (j - i) / 2;
+		if (runFirst(n, m) < x)
+			i = m + 1;
+		else
+			j = m;
+	}
+	return i;
+}
+
+// ----------------------------------------------------------------------
+// Allocation;
+
+// containerReserve - Make room for 'size' values
+void containerReserve(struct bmtpool* p, struct bmtitem* n, uint32_t size)
+{
+	if (size <= n->cap)
+		return;
+	uint32_t cap = n->cap < 4 ? 4 : n->cap;
+	while (cap < size)
+		cap *= 2;
+	uint16_t* v = p->allocator.alloc(p->allocator.userRef, cap * sizeof(uint16_t));
+	if (v == NULL)
+		die("Out of mem");
+	STATS(p, allocBytes += cap * sizeof(uint16_t));
+	p->count.valueBytes += (cap - n->cap) * sizeof(uint16_t);
+	if (n->cap == 0)
+		p->count.containers++;
+	if (n->vals != NULL) {
+		memcpy(v, n->vals, n->cap * sizeof(uint16_t));
+		STATS(p, freeBytes += n->cap * sizeof(uint16_t));
+		p->allocator.free(p->allocator.userRef, n->vals, n->cap * sizeof(uint16_t));
+	}
+	n->vals = v;
+	n->cap = cap;
+}
+
+static struct bmtitem* containerNew(
+	struct bmtpool* p, unsigned kind, uint32_t size)
+{
+	struct bmtitem* n = itemAlloc(p, CHUNK_LEVEL);
+	n->kind = kind;
+	containerReserve(p, n, size);
+	return n;
+}
+
+void containerRelease(struct bmtpool* p, struct bmtitem* n)
+{
+	p->count.containers--;
+	p->count.valueBytes -= n->cap * sizeof(uint16_t);
+	STATS(p, freeBytes += n->cap * sizeof(uint16_t));
+	p->allocator.free(p->allocator.userRef, n->vals, n->cap * sizeof(uint16_t));
+	n->vals = NULL;
+	n->kind = KIND_NODE;
+}
+
+// containersRelease - Release the values of all containers, and the
+// legs of 16-way nodes, in a pool. Free items are neither.
+void containersRelease(struct bmtpool* p)
+{
+	if (p->arrayMax == 0 && p->runsMax == 0 && p->count.node16s == 0)
+		return;
+	struct bmtslabs* c = &p->items;
+	for (struct bmtslab* s = c->slabs; s != NULL; s = s->next) {
+		char* end = s == c->slabs ? (char*)c->cursor : (char*)s + s->size;
+		for (char* i = (char*)s->items; i + c->itemSize <= end;
+			 i += c->itemSize) {
+			struct bmtitem* n = (struct bmtitem*)i;
+			if (isContainer(n))
+				containerRelease(p, n);
+			else if (n->kind == KIND_NODE16)
+				node16Release(p, n);
+		}
+	}
+}
+
+struct bmtitem* containerCopy(struct bmtpool* p, struct bmtitem const* n)
+{
+	uint32_t size = n->kind == KIND_RUNS ? 2 * n->cnt : n->cnt;
+	struct bmtitem* m = containerNew(p, n->kind, size);
+	memcpy(m->vals, n->vals, size * sizeof(uint16_t));
+	m->cnt = n->cnt;
+	m->ones = n->ones;
+	m->maxfree[0] = m->maxfree[1] = n->maxfree[0];
+	return m;
+}
+
+size_t containerBytes(struct bmtitem const* n)
+{
+	return n->cap * sizeof(uint16_t);
+}
+
+// ----------------------------------------------------------------------
+// Conversions;
+
+// gapFree - The largest free aligned block in [a,b] (log2 + 1). A gap
+// of length L always holds a block of 2^(log2(L) - 1).
+static unsigned gapFree(unsigned a, unsigned b)
+{
+	unsigned k = 31 - __builtin_clz(b - a + 1);
+	unsigned m = (1u << k) - 1;
+	if (((a + m) & ~m) + m > b)
+		k--;
+	return k + 1;
+}
+
+// containerCheck - Check that the values of a container (read from
+// outside) are sorted and the runs are separated, and compute 'ones'
+// and 'maxfree'. return: 0 - OK
+int containerCheck(struct bmtitem* n)
+{
+	uint64_t ones = 0;
+	for (uint32_t i = 0; i < n->cnt; i++) {
+		unsigned f = runFirst(n, i), l = runLast(n, i);
+		if (f > l)
+			return -1;
+		if (i > 0 && f <= runLast(n, i - 1) + (n->kind == KIND_RUNS))
+			return -1;
+		ones += l - f + 1;
+	}
+	n->ones = ones;
+	containerUpdate(n);
+	return 0;
+}
+
+// containerUpdate - Update 'maxfree' from the gaps between the runs
+void containerUpdate(struct bmtitem* n)
+{
+	unsigned f = 0, next = 0;
+	for (uint32_t i = 0; i < n->cnt; i++) {
+		unsigned a = runFirst(n, i);
+		if (a > next) {
+			unsigned g = gapFree(next, a - 1);
+			if (g > f)
+				f = g;
+		}
+		next = runLast(n, i) + 1;
+	}
+	if (next < CHUNK_BITS) {
+		unsigned g = gapFree(next, CHUNK_BITS - 1);
+		if (g > f)
+			f = g;
+	}
+	n->maxfree[0] = n->maxfree[1] = f;
+}
+
+// gapUpdate - Update 'maxfree' when 'x' in the gap [a,b] is set or
+// cleared. A cleared bit can only make the gap larger. A set bit
+// splits the gap, and the runs are scanned only if it was the largest
+// and both parts are smaller.
+static void gapUpdate(
+	struct bmtitem* n, unsigned a, unsigned b, unsigned x, int value)
+{
+	unsigned g = gapFree(a, b);
+	if (!value) {
+		if (g > n->maxfree[0])
+			n->maxfree[0] = n->maxfree[1] = g;
+		return;
+	}
+	if (g < n->maxfree[0])
+		return;
+	unsigned l = x > a ? gapFree(a, x - 1) : 0;
+	unsigned r = x < b ? gapFree(x + 1, b) : 0;
+	if (l < g && r < g)
+		containerUpdate(n);
+}
+
+// runsTree - Build nodes for the runs [i,j) in the subtree at 'base'.
+// The runs may start before and end after the subtree. 16-way nodes
+// are formed below the chunk, the chunk itself is left as nodes.
+static struct bmtitem* runsTree(
+	struct bmtpool* p, struct bmtitem const* n, uint32_t i, uint32_t j,
+	unsigned level, unsigned base)
+{
+	if (i == j)
+		return NULL;
+	unsigned end = base + (1u << (level + BM_BITS)) - 1;
+	if (j - i == 1 && runFirst(n, i) <= base && runLast(n, i) >= end)
+		return FULL;
+	if (level == p->leafLevel) {
+		bitmap_t w[8] = {0};	/* (leafLevel <= 3) */
+		for (; i < j; i++) {
+			unsigned f = runFirst(n, i), l = runLast(n, i);
+			wordsSetRange(
+				w, f > base ? f - base : 0, (l < end ? l : end) - base, 1);
+		}
+		return leafNew(p, level, w);
+	}
+	struct bmtitem* m = itemAlloc(p, level);
+	unsigned mid = base + (1u << (level + 5));
+	m->zero = runsTree(p, n, i, upperRun(n, i, j, mid), level - 1, base);
+	m->one = runsTree(p, n, lowerRun(n, i, j, mid), j, level - 1, mid);
+	m = nodeNormalize(p, m);
+	return level < CHUNK_LEVEL ? node16Check(p, m) : m;
+}
+
+// containerExpand - Nodes for a container. The container is unchanged.
+struct bmtitem* containerExpand(struct bmtpool* p, struct bmtitem const* n)
+{
+	return runsTree(p, n, 0, n->cnt, CHUNK_LEVEL, 0);
+}
+
+struct runbuf {
+	uint16_t* v;				/* (first, last) pairs */
+	uint32_t cnt;
+	uint32_t cap;
+};
+static void runAppend(struct runbuf* r, unsigned f, unsigned l)
+{
+	if (r->cnt > 0 && r->v[2 * r->cnt - 1] + 1 == f) {
+		r->v[2 * r->cnt - 1] = l;
+		return;
+	}
+	if (2 * r->cnt + 2 > r->cap) {
+		r->cap = r->cap == 0 ? 64 : 2 * r->cap;
+		r->v = realloc(r->v, r->cap * sizeof(uint16_t));
+		if (r->v == NULL)
+			die("Out of mem");
+	}
+	r->v[2 * r->cnt] = f;
+	r->v[2 * r->cnt + 1] = l;
+	r->cnt++;
+}
+
+// treeRuns - Append the runs of the subtree at 'base'. In a chain the
+// 'level' may be below the chain top (a position in the chain).
+static void treeRuns(
+	struct bmtitem const* n, unsigned level, unsigned leafLevel,
+	unsigned base, struct runbuf* r)
+{
+	if (n == NULL)
+		return;
+	unsigned end = base + (1u << (level + BM_BITS)) - 1;
+	if (n == FULL) {
+		runAppend(r, base, end);
+		return;
+	}
+	if (level == leafLevel) {
+		bitmap_t lw;
+		bitmap_t const* words = leafWords(n, level, &lw);
+		for (unsigned i = 0; i < (1u << leafLevel); i++) {
+			bitmap_t w = words[i];
+			unsigned b = 0, o = base + (i << BM_BITS);
+			while (w != 0) {
+				unsigned z = __builtin_ctzll(w);
+				w >>= z;
+				b += z;
+				unsigned len = ~w == 0 ? 64 - b : __builtin_ctzll(~w);
+				runAppend(r, o + b, o + b + len - 1);
+				if (b + len == 64)
+					break;
+				w >>= len;
+				b += len;
+			}
+		}
+		return;
+	}
+	if (isContainer(n)) {
+		for (uint32_t i = 0; i < n->cnt; i++)
+			runAppend(r, base + runFirst(n, i), base + runLast(n, i));
+		return;
+	}
+	if (n->kind == KIND_NODE16) {
+		for (unsigned i = 0; i < 16; i++)
+			treeRuns(n->node16->leg[i], level - 4, leafLevel,
+					 base + (i << (level + 2)), r);
+		return;
+	}
+	if (n->skip > 0) {
+		unsigned bottom = n->level - n->skip;
+		unsigned start = base + (n->prefix & chainMask(level, level - bottom));
+		unsigned stop = start + (1u << (bottom + BM_BITS)) - 1;
+		if (n->fill && start > base)
+			runAppend(r, base, start - 1);
+		treeRuns(n->next, bottom, leafLevel, start, r);
+		if (n->fill && stop < end)
+			runAppend(r, stop + 1, end);
+		return;
+	}
+	treeRuns(n->zero, level - 1, leafLevel, base, r);
+	treeRuns(n->one, level - 1, leafLevel, base + (1u << (level + 5)), r);
+}
+
+// chunkRuns - The (first, last) pairs of the runs of the chunk at a
+// position. The returned buffer must be freed.
+uint16_t* chunkRuns(
+	struct bmtitem const* n, unsigned level, unsigned leafLevel,
+	uint32_t* cnt)
+{
+	struct runbuf r = {0};
+	treeRuns(n, level, leafLevel, 0, &r);
+	*cnt = r.cnt;
+	return r.v;
+}
+
+// chunkCompact - Make a chunk of nodes within the limits a container
+struct bmtitem* chunkCompact(struct bmtpool* p, struct bmtitem* n)
+{
+	struct runbuf r = {0};
+	struct bmtitem* c;
+	treeRuns(n, CHUNK_LEVEL, p->leafLevel, 0, &r);
+	if (n->ones <= p->arrayMax) {
+		c = containerNew(p, KIND_ARRAY, n->ones);
+		for (uint32_t i = 0; i < r.cnt; i++) {
+			for (unsigned x = r.v[2 * i]; x <= r.v[2 * i + 1]; x++)
+				c->vals[c->cnt++] = x;
+		}
+	} else {
+		c = containerNew(p, KIND_RUNS, 2 * r.cnt);
+		memcpy(c->vals, r.v, 2 * r.cnt * sizeof(uint16_t));
+		c->cnt = r.cnt;
+	}
+	c->ones = n->ones;
+	containerUpdate(c);
+	free(r.v);
+	freeTree(p, n, CHUNK_LEVEL);
+	return c;
+}
+
+// containerConvert - Change the kind of a container in place
+static void containerConvert(struct bmtpool* p, struct bmtitem* n)
+{
+	struct bmtitem tmp = *n;
+	n->vals = NULL;
+	n->cap = n->cnt = 0;
+	if (tmp.kind == KIND_ARRAY) {
+		// The runs are not more than the values
+		n->kind = KIND_RUNS;
+		containerReserve(p, n, 2 * tmp.cnt);
+		struct runbuf r = {n->vals, 0, n->cap};
+		for (uint32_t i = 0; i < tmp.cnt; i++)
+			runAppend(&r, tmp.vals[i], tmp.vals[i]);
+		n->cnt = r.cnt;
+	} else {
+		n->kind = KIND_ARRAY;
+		containerReserve(p, n, n->ones);
+		for (uint32_t i = 0; i < tmp.cnt; i++) {
+			for (unsigned x = runFirst(&tmp, i); x <= runLast(&tmp, i); x++)
+				n->vals[n->cnt++] = x;
+		}
+	}
+	containerRelease(p, &tmp);
+}
+
+// arrayRuns - The number of runs in an array
+static uint32_t arrayRuns(struct bmtitem const* n)
+{
+	uint32_t runs = 1;
+	for (uint32_t i = 1; i < n->cnt; i++)
+		runs += n->vals[i] != n->vals[i - 1] + 1;
+	return runs;
+}
+
+// containerNormalize - Called when a container has been modified. An
+// empty or full container is replaced by NULL/FULL, and a container
+// beyond the limit is converted.
+struct bmtitem* containerNormalize(struct bmtpool* p, struct bmtitem* n)
+{
+	struct bmtitem* m;
+	if (n->ones == 0 || n->ones == CHUNK_BITS) {
+		m = n->ones == 0 ? NULL : FULL;
+	} else if (n->kind == KIND_ARRAY && n->cnt > p->arrayMax) {
+		if (arrayRuns(n) <= p->runsMax) {
+			containerConvert(p, n);
+			return n;
+		}
+		m = node16Check(p, containerExpand(p, n));
+	} else if (n->kind == KIND_RUNS && n->cnt > p->runsMax) {
+		if (n->ones <= p->arrayMax) {
+			containerConvert(p, n);
+			return n;
+		}
+		m = node16Check(p, containerExpand(p, n));
+	} else {
+		return n;
+	}
+	itemFree(p, n);
+	return m;
+}
+
+// ----------------------------------------------------------------------
+// Operations; 'x' is the offset in the chunk.
+
+int containerBit(struct bmtitem const* n, unsigned x)
+{
+	uint32_t i = lowerRun(n, 0, n->cnt, x);
+	return i < n->cnt && runFirst(n, i) <= x;
+}
+
+// containerSetBit - Set a bit in a private container. The container
+// must be normalized afterwards.
+// return: The change of the '1' count
+int containerSetBit(
+	struct bmtpool* p, struct bmtitem* n, unsigned x, int value)
+{
+	uint32_t i = lowerRun(n, 0, n->cnt, x);
+	int has = i < n->cnt && runFirst(n, i) <= x;
+	if (has == value)
+		return 0;
+	// The gap [a,b] that 'x' is in before it is set, or after it is
+	// cleared. Only that gap changes 'maxfree'
+	unsigned a = x, b = x;
+	if (!has || x == runFirst(n, i))
+		a = i > 0 ? runLast(n, i - 1) + 1 : 0;
+	if (!has || x == runLast(n, i)) {
+		uint32_t j = has ? i + 1 : i;
+		b = j < n->cnt ? runFirst(n, j) - 1 : CHUNK_BITS - 1;
+	}
+	uint16_t* v;
+	if (n->kind == KIND_ARRAY) {
+		if (value) {
+			containerReserve(p, n, n->cnt + 1);
+			v = n->vals;
+			memmove(v + i + 1, v + i, (n->cnt - i) * sizeof(uint16_t));
+			v[i] = x;
+			n->cnt++;
+		} else {
+			v = n->vals;
+			memmove(v + i, v + i + 1, (n->cnt - i - 1) * sizeof(uint16_t));
+			n->cnt--;
+		}
+	} else {
+		// Runs. Set joins or extends runs, clear shrinks or splits a run
+		int join = -1;			/* Run to remove, or insert if > cnt */
+		unsigned f = x, l = x;
+		v = n->vals;
+		if (value) {
+			int left = i > 0 && v[2 * i - 1] + 1 == x;
+			int right = i < n->cnt && v[2 * i] == x + 1;
+			if (left && right) {
+				v[2 * i - 1] = v[2 * i + 1];
+				join = i;
+			} else if (left) {
+				v[2 * i - 1] = x;
+			} else if (right) {
+				v[2 * i] = x;
+			} else {
+				join = n->cnt + 1;
+			}
+		} else if (v[2 * i] == v[2 * i + 1]) {
+			join = i;
+		} else if (x == v[2 * i]) {
+			v[2 * i] = x + 1;
+		} else if (x == v[2 * i + 1]) {
+			v[2 * i + 1] = x - 1;
+		} else {
+			f = x + 1;
+			l = v[2 * i + 1];
+			v[2 * i + 1] = x - 1;
+			i++;
+			join = n->cnt + 1;
+		}
+		if (join > (int)n->cnt) {
+			containerReserve(p, n, 2 * n->cnt + 2);
+			v = n->vals;
+			memmove(v + 2 * i + 2, v + 2 * i, (n->cnt - i) * 2 * sizeof(uint16_t));
+			v[2 * i] = f;
+			v[2 * i + 1] = l;
+			n->cnt++;
+		} else if (join >= 0) {
+			memmove(v + 2 * join, v + 2 * join + 2,
+					(n->cnt - join - 1) * 2 * sizeof(uint16_t));
+			n->cnt--;
+		}
+	}
+	n->ones += value ? 1 : -1;
+	gapUpdate(n, a, b, x, value);
+	return value ? 1 : -1;
+}
+
+// containerNext - The first bit == 'value' at or above 'from', or -1
+int containerNext(struct bmtitem const* n, unsigned from, int value)
+{
+	uint32_t i = lowerRun(n, 0, n->cnt, from);
+	if (value) {
+		if (i == n->cnt)
+			return -1;
+		unsigned f = runFirst(n, i);
+		return f > from ? f : from;
+	}
+	unsigned x = from;
+	while (i < n->cnt && runFirst(n, i) <= x)
+		x = runLast(n, i++) + 1;
+	return x < CHUNK_BITS ? (int)x : -1;
+}
+
+// containerRank - The number of '1's below 'x'
+unsigned containerRank(struct bmtitem const* n, unsigned x)
+{
+	uint32_t i = lowerRun(n, 0, n->cnt, x);
+	if (n->kind == KIND_ARRAY)
+		return i;
+	unsigned rank = 0;
+	for (uint32_t j = 0; j < i; j++)
+		rank += runLast(n, j) - runFirst(n, j) + 1;
+	if (i < n->cnt && runFirst(n, i) < x)
+		rank += x - runFirst(n, i);
+	return rank;
+}
+
+// containerSelect - The offset of the k'th bit == 'value' (that exists)
+unsigned containerSelect(struct bmtitem const* n, unsigned k, int value)
+{
+	if (value && n->kind == KIND_ARRAY)
+		return n->vals[k];
+	unsigned next = 0;
+	for (uint32_t i = 0; i < n->cnt; i++) {
+		unsigned f = runFirst(n, i), l = runLast(n, i);
+		if (value) {
+			if (k <= l - f)
+				return f + k;
+			k -= l - f + 1;
+		} else {
+			if (k < f - next)
+				return next + k;
+			k -= f - next;
+			next = l + 1;
+		}
+	}
+	return next + k;
+}
@@ -0,0 +1,894 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  An image is a flat, pointer-free copy of a tree that is used in
+  place, e.g. mmap'ed from a file. Items refer to each other with byte
+  offsets in the image and are written in post-order, so the sub-trees
+  of an item are before it and the top item is last. All fields are in
+  native byte order and 8-byte aligned;
+
+    Header;
+      uint32_t magic ("BMTI" as a little-endian uint32_t)
+      uint8_t version (1)
+      uint8_t flags; 0x01 - Containers are used, 0x02 - 16-way nodes
+      uint8_t leafLevel
+      uint8_t ulog2(size). 0 interpreted as 64
+      uint64_t top
+      uint64_t ones
+      uint64_t len - The image size in bytes
+    Items;
+      Leaf; The words of the bitmap (no header)
+      Node, Chain, Container, Node16;
+        uint8_t type, fill, skip, (pad)
+        uint32_t cnt - Container values or runs, or for a Node16 a mask
+                       of the FULL legs << 16 | a mask of the item legs
+        uint64_t ones
+        Node; uint64_t zero, one
+        Chain; uint64_t prefix, next
+        Container; The values (uint16_t), padded to 8 bytes
+        Node16; uint64_t legs[][2] - The references and '1' counts of
+                the item legs in offset order
+
+  A "Node16" replaces a node and the three levels of nodes below it,
+  and is used when those are all nodes (no chains, containers or
+  leaves). It has the 16 legs at level - 4, but only stores the legs
+  that are not NULL or FULL. A bit lookup in the dense top of a tree
+  takes one item per four levels, and the rank doesn't have to read the
+  legs. Promote makes binary nodes again.
+
+  A reference is an offset in the image, or 0 for NULL and 1 for FULL.
+  Queries check that an item is inside the image but not more, so a
+  corrupt image gives wrong results but never a crash. The whole image
+  is checked when it is promoted to a tree.
+ */
+
+#define IMG_MAGIC 0x49544d42
+#define BUF_SIZE 32768
+#define STACK_DEPTH 64
+
+struct imgHeader {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t flags;
+	uint8_t leafLevel;
+	uint8_t logsize;
+	uint64_t top;
+	uint64_t ones;
+	uint64_t len;
+};
+
+// Reference values and item types share the numbers, IMG_LEAF is
+// implied by the level
+enum {
+	IMG_NULL, IMG_FULL, IMG_NODE, IMG_CHAIN, IMG_ARRAY, IMG_RUNS, IMG_LEAF,
+	IMG_NODE16
+};
+struct imgItem {
+	uint8_t type;
+	uint8_t fill;
+	uint8_t skip;
+	uint8_t pad;
+	uint32_t cnt;
+	uint64_t ones;
+	uint64_t leg[2];			/* zero/one, prefix/next or values */
+};
+#define VALUES_OFFSET offsetof(struct imgItem, leg)
+
+struct bmtImage {
+	uint8_t const* data;
+	size_t len;
+	uint64_t size;
+	unsigned levels;
+	unsigned leafLevel;
+	int containers;
+	uint64_t top;
+	uint64_t ones;
+};
+
+static inline size_t containerValues(unsigned type, uint32_t cnt)
+{
+	return type == IMG_RUNS ? 2 * (size_t)cnt : cnt;
+}
+
+// ----------------------------------------------------------------------
+// Write;
+
+struct iwbuf {
+	bmtWriteFn_t writeFn;
+	void* userRef;
+	uint64_t offset;			/* In the image */
+	size_t len;
+	uint8_t data[BUF_SIZE];
+};
+
+static void iflush(struct iwbuf* w)
+{
+	if (w->len > 0)
+		w->writeFn(w->userRef, w->data, w->len);
+	w->len = 0;
+}
+
+static void iput(struct iwbuf* w, void const* data, size_t len)
+{
+	uint8_t const* d = data;
+	w->offset += len;
+	while (len > 0) {
+		size_t n = sizeof(w->data) - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->data + w->len, d, n);
+		w->len += n;
+		d += n;
+		len -= n;
+		if (w->len == sizeof(w->data))
+			iflush(w);
+	}
+}
+
+// node16Legs - Get the 16 legs at level - 4 if a node and the nodes in
+// the three levels below it are all nodes. return; 0 if not
+static int node16Legs(
+	struct bmtitem* n, unsigned level, unsigned levels, unsigned leafLevel,
+	struct bmtitem** leg)
+{
+	if (n == NULL || n == FULL || levels == 0) {
+		for (unsigned i = 0; i < (1u << levels); i++)
+			leg[i] = n;
+		return 1;
+	}
+	if (level < leafLevel + levels || n->kind != KIND_NODE || n->skip > 0)
+		return 0;
+	unsigned half = 1 << (levels - 1);
+	return node16Legs(n->zero, level - 1, levels - 1, leafLevel, leg) &&
+		node16Legs(n->one, level - 1, levels - 1, leafLevel, leg + half);
+}
+
+// itemLegs - Get the sub-trees of an item at 'level' as it is written
+// to the image, and the level of the sub-trees. return the number of legs
+#define LEGS_MAX 16
+static unsigned itemLegs(
+	struct bmtpos p, unsigned leafLevel, struct bmtitem** leg,
+	unsigned* legLevel)
+{
+	struct bmtitem* n = p.n;
+	if (p.level == leafLevel || isContainer(n))
+		return 0;
+	if (n->skip > 0) {
+		leg[0] = n->next;
+		*legLevel = p.level - n->skip;
+		return 1;
+	}
+	if (n->kind == KIND_NODE16) {
+		memcpy(leg, n->node16->leg, sizeof(n->node16->leg));
+		*legLevel = p.level - 4;
+		return 16;
+	}
+	if (node16Legs(n, p.level, 4, leafLevel, leg)) {
+		*legLevel = p.level - 4;
+		return 16;
+	}
+	leg[0] = n->zero;
+	leg[1] = n->one;
+	*legLevel = p.level - 1;
+	return 2;
+}
+
+static size_t itemBytes(
+	struct bmtpos p, unsigned leafLevel, unsigned legs,
+	struct bmtitem* const* leg)
+{
+	struct bmtitem const* n = p.n;
+	if (p.level == leafLevel)
+		return sizeof(bitmap_t) << leafLevel;
+	if (isContainer(n)) {
+		size_t len = containerValues(
+			n->kind == KIND_RUNS ? IMG_RUNS : IMG_ARRAY, n->cnt);
+		return VALUES_OFFSET + ((len * sizeof(uint16_t) + 7) & ~7);
+	}
+	if (legs == 16) {
+		size_t len = VALUES_OFFSET;
+		for (unsigned i = 0; i < 16; i++) {
+			if (leg[i] != NULL && leg[i] != FULL)
+				len += 2 * sizeof(uint64_t);
+		}
+		return len;
+	}
+	return sizeof(struct imgItem);
+}
+
+// imageBytes - The size of the items in an image. The size of the top
+// item is stored in 'topBytes', and 0x02 is set in 'flags' if there
+// are 16-way nodes
+static uint64_t imageBytes(
+	struct bmtpos top, unsigned leafLevel, size_t* topBytes,
+	uint8_t* flags)
+{
+	struct bmtpos stack[LEGS_MAX * STACK_DEPTH];
+	unsigned depth = 0;
+	uint64_t len = 0;
+	stack[depth++] = top;
+	*topBytes = 0;
+	while (depth > 0) {
+		struct bmtpos p = stack[--depth];
+		struct bmtitem* leg[LEGS_MAX];
+		unsigned legLevel;
+		unsigned legs = itemLegs(p, leafLevel, leg, &legLevel);
+		size_t bytes = itemBytes(p, leafLevel, legs, leg);
+		if (p.level == top.level)
+			*topBytes = bytes;
+		if (legs == 16)
+			*flags |= 0x02;
+		len += bytes;
+		for (unsigned i = legs; i-- > 0;) {
+			if (leg[i] != NULL && leg[i] != FULL)
+				stack[depth++] = (struct bmtpos){leg[i], legLevel};
+		}
+	}
+	return len;
+}
+
+// writeItem - Write an item when the references of the legs are known.
+// return; The reference to the item
+static uint64_t writeItem(
+	struct iwbuf* w, struct bmtpos p, unsigned leafLevel,
+	unsigned legs, struct bmtitem* const* leg, uint64_t const* ref)
+{
+	static const uint8_t pad[8];
+	struct bmtitem const* n = p.n;
+	uint64_t offset = w->offset;
+	struct imgItem it = {0};
+	if (p.level == leafLevel) {
+		bitmap_t lw;
+		iput(w, leafWords(n, p.level, &lw), sizeof(bitmap_t) << leafLevel);
+	} else if (isContainer(n)) {
+		it.type = n->kind == KIND_RUNS ? IMG_RUNS : IMG_ARRAY;
+		it.cnt = n->cnt;
+		it.ones = n->ones;
+		size_t len = containerValues(it.type, n->cnt) * sizeof(uint16_t);
+		iput(w, &it, VALUES_OFFSET);
+		iput(w, n->vals, len);
+		iput(w, pad, (8 - (len & 7)) & 7);
+	} else if (n->skip > 0) {
+		it.type = IMG_CHAIN;
+		it.fill = n->fill;
+		it.skip = n->skip;
+		it.ones = chainOnes(n);
+		it.leg[0] = n->prefix;
+		it.leg[1] = ref[0];
+		iput(w, &it, sizeof(it));
+	} else if (legs == 16) {
+		uint64_t items[16][2];
+		unsigned cnt = 0;
+		it.type = IMG_NODE16;
+		it.ones = n->ones;
+		for (unsigned i = 0; i < 16; i++) {
+			if (ref[i] == IMG_FULL) {
+				it.cnt |= 1u << (i + 16);
+			} else if (ref[i] != IMG_NULL) {
+				it.cnt |= 1u << i;
+				items[cnt][0] = ref[i];
+				items[cnt][1] = itemOnes(leg[i], p.level - 4);
+				cnt++;
+			}
+		}
+		iput(w, &it, VALUES_OFFSET);
+		iput(w, items, cnt * sizeof(items[0]));
+	} else {
+		it.type = IMG_NODE;
+		it.ones = n->ones;
+		it.leg[0] = ref[0];
+		it.leg[1] = ref[1];
+		iput(w, &it, sizeof(it));
+	}
+	return offset;
+}
+
+// writeItems - Write the items in post-order. A sub-tree is pushed on
+// the stack until the references of its legs are known.
+struct wstate {
+	struct bmtpos p;
+	unsigned state;				/* The next leg */
+	unsigned legs;
+	unsigned legLevel;
+	struct bmtitem* leg[LEGS_MAX];
+	uint64_t ref[LEGS_MAX];
+};
+static uint64_t writeItems(
+	struct bmtpos top, unsigned leafLevel, struct iwbuf* w)
+{
+	struct wstate* stack = malloc(STACK_DEPTH * sizeof(struct wstate));
+	if (stack == NULL)
+		die("Out of mem");
+	unsigned depth = 0;
+	struct bmtpos next = top;	/* The sub-tree to push, or NULL */
+	for (;;) {
+		struct wstate* f;
+		if (next.n != NULL) {
+			f = &stack[depth++];
+			f->p = next;
+			f->state = 0;
+			f->legs = itemLegs(next, leafLevel, f->leg, &f->legLevel);
+			next.n = NULL;
+		}
+		f = &stack[depth - 1];
+		struct bmtitem** leg = f->leg;
+		while (f->state < f->legs &&
+			   (leg[f->state] == NULL || leg[f->state] == FULL)) {
+			f->ref[f->state] = leg[f->state] == FULL ? IMG_FULL : IMG_NULL;
+			f->state++;
+		}
+		if (f->state < f->legs) {
+			next = (struct bmtpos){leg[f->state], f->legLevel};
+			continue;
+		}
+		uint64_t ref = writeItem(w, f->p, leafLevel, f->legs, f->leg, f->ref);
+		if (--depth == 0) {
+			free(stack);
+			return ref;
+		}
+		f = &stack[depth - 1];
+		f->ref[f->state++] = ref;
+	}
+}
+
+void bmtImageWrite(
+	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef)
+{
+	unsigned leafLevel = bmt->pool->leafLevel;
+	struct imgHeader h = {0};
+	h.magic = IMG_MAGIC;
+	h.version = 1;
+	if (bmt->pool->arrayMax > 0 || bmt->pool->runsMax > 0)
+		h.flags |= 0x01;
+	h.leafLevel = leafLevel;
+	h.logsize = ulog2(bmt->size);
+	h.ones = bmtOnes(bmt);
+	h.len = sizeof(h);
+	if (bmt->top == NULL || bmt->top == FULL) {
+		h.top = bmt->top == FULL ? IMG_FULL : IMG_NULL;
+		writeFn(userRef, &h, sizeof(h));
+		return;
+	}
+	// The top item is last
+	size_t topBytes;
+	struct bmtpos top = {bmt->top, bmt->levels};
+	h.len += imageBytes(top, leafLevel, &topBytes, &h.flags);
+	h.top = h.len - topBytes;
+	struct iwbuf* w = malloc(sizeof(struct iwbuf));
+	if (w == NULL)
+		die("Out of mem");
+	w->writeFn = writeFn;
+	w->userRef = userRef;
+	w->offset = 0;
+	w->len = 0;
+	iput(w, &h, sizeof(h));
+	writeItems(top, leafLevel, w);
+	iflush(w);
+	free(w);
+}
+
+// ----------------------------------------------------------------------
+// Open;
+
+struct bmtImage* bmtImageOpen(void const* data, size_t len)
+{
+	struct imgHeader const* h = data;
+	if (h == NULL || ((uintptr_t)h & 7) != 0 || len < sizeof(*h))
+		return NULL;
+	if (h->magic != IMG_MAGIC || h->version != 1 || h->len > len ||
+		h->len < sizeof(*h) || (h->flags & ~0x03) != 0)
+		return NULL;
+	unsigned logsize = h->logsize == 0 ? 64 : h->logsize;
+	if (logsize < BM_BITS + h->leafLevel || logsize > 64 || h->leafLevel > 3)
+		return NULL;
+	if (h->top != IMG_NULL && h->top != IMG_FULL && h->top >= h->len)
+		return NULL;
+	if (h->flags & 0x01 && logsize < 16)
+		return NULL;
+	struct bmtImage* img = CALLOC(sizeof(struct bmtImage));
+	img->data = data;
+	img->len = h->len;
+	img->size = logsize == 64 ? 0 : 1ULL << logsize;
+	img->levels = logsize - BM_BITS;
+	img->leafLevel = h->leafLevel;
+	img->containers = h->flags & 0x01;
+	img->top = h->top;
+	img->ones = h->ones;
+	return img;
+}
+
+void bmtImageClose(struct bmtImage* img)
+{
+	free(img);
+}
+
+// ----------------------------------------------------------------------
+// Queries;
+
+/*
+  A position in the image. As a bmtpos, a position may be inside a
+  chain that starts at level 'top'. A position may also be inside a
+  Node16 at level 'top', and then 'path' has the (top - level) bits of
+  the legs taken from the top.
+ */
+struct imgpos {
+	uint64_t ref;
+	unsigned level;
+	unsigned top;
+	unsigned path;
+};
+
+// imgLookup - Get the item at a position. Invalid references are
+// taken as NULL. return; IMG_NULL, IMG_FULL, IMG_LEAF or the item type
+static unsigned imgLookup(
+	struct bmtImage const* img, struct imgpos p, void const** item)
+{
+	if (p.ref == IMG_NULL || p.ref == IMG_FULL)
+		return p.ref;
+	if ((p.ref & 7) != 0 || p.ref < sizeof(struct imgHeader) ||
+		p.ref >= img->len)
+		return IMG_NULL;
+	size_t room = img->len - p.ref;
+	*item = img->data + p.ref;
+	if (p.level == img->leafLevel)
+		return room >= sizeof(bitmap_t) << img->leafLevel ? IMG_LEAF : IMG_NULL;
+	struct imgItem const* it = *item;
+	if (room < VALUES_OFFSET)
+		return IMG_NULL;
+	switch (it->type) {
+	case IMG_NODE:
+		return room >= sizeof(*it) ? IMG_NODE : IMG_NULL;
+	case IMG_CHAIN:
+		if (room < sizeof(*it) || it->skip == 0 ||
+			it->skip > p.top - img->leafLevel || p.level <= p.top - it->skip)
+			return IMG_NULL;
+		return IMG_CHAIN;
+	case IMG_ARRAY:
+	case IMG_RUNS:
+		if (p.level != CHUNK_LEVEL || !img->containers || it->cnt == 0 ||
+			(room - VALUES_OFFSET) / sizeof(uint16_t) <
+			containerValues(it->type, it->cnt))
+			return IMG_NULL;
+		return it->type;
+	case IMG_NODE16:
+		if (p.top < img->leafLevel + 4 || p.level <= p.top - 4 ||
+			(it->cnt & (it->cnt >> 16)) != 0 ||
+			(room - VALUES_OFFSET) / (2 * sizeof(uint64_t)) <
+			(size_t)__builtin_popcount(it->cnt & 0xffff))
+			return IMG_NULL;
+		return IMG_NODE16;
+	}
+	return IMG_NULL;
+}
+
+// node16Leg - The position of leg 'i' of a Node16. The legs are at
+// 'level' (the Node16 level - 4)
+static struct imgpos node16Leg(
+	struct imgItem const* it, unsigned i, unsigned level)
+{
+	uint64_t const* leg = it->leg;
+	uint32_t items = it->cnt & 0xffff;
+	uint64_t ref = IMG_NULL;
+	if (it->cnt & (1u << (i + 16)))
+		ref = IMG_FULL;
+	else if (items & (1u << i))
+		ref = leg[2 * __builtin_popcount(items & ((1u << i) - 1))];
+	return (struct imgpos){ref, level, level};
+}
+
+// node16Ones - The number of '1's in the legs of a Node16 in 'mask'.
+// The legs are at 'level'
+static uint64_t node16Ones(
+	struct imgItem const* it, uint32_t mask, unsigned level)
+{
+	uint64_t const* leg = it->leg;
+	uint32_t before = (mask & -mask) - 1;
+	unsigned k = __builtin_popcount(it->cnt & 0xffff & before);
+	uint64_t ones = __builtin_popcount((it->cnt >> 16) & mask) * span(level);
+	for (uint32_t items = it->cnt & mask; items != 0; items &= items - 1)
+		ones += leg[2 * k++ + 1];
+	return ones;
+}
+
+// node16Mask - The legs of a Node16 below a position inside it
+static uint32_t node16Mask(struct imgpos p)
+{
+	unsigned taken = p.top - p.level;
+	return ((1u << (16 >> taken)) - 1) << (p.path << (4 - taken));
+}
+
+// imgContainer - A container item that uses the values in the image,
+// for the container functions
+static struct bmtitem imgContainer(struct imgItem const* it)
+{
+	struct bmtitem n = {0};
+	n.level = CHUNK_LEVEL;
+	n.kind = it->type == IMG_RUNS ? KIND_RUNS : KIND_ARRAY;
+	n.ones = it->ones;
+	n.vals = (uint16_t*)it->leg;
+	n.cnt = it->cnt;
+	return n;
+}
+
+// imgLegs - As posLegs(); get the legs of a node or chain position
+static void imgLegs(
+	struct imgpos p, struct imgItem const* it, struct imgpos* zero,
+	struct imgpos* one)
+{
+	unsigned level = p.level - 1;
+	if (it->type == IMG_NODE) {
+		*zero = (struct imgpos){it->leg[0], level, level};
+		*one = (struct imgpos){it->leg[1], level, level};
+		return;
+	}
+	if (it->type == IMG_NODE16) {
+		unsigned path = p.path << 1;
+		if (level == p.top - 4) {
+			*zero = node16Leg(it, path, level);
+			*one = node16Leg(it, path | 1, level);
+		} else {
+			*zero = (struct imgpos){p.ref, level, p.top, path};
+			*one = (struct imgpos){p.ref, level, p.top, path | 1};
+		}
+		return;
+	}
+	struct imgpos rest = {p.ref, level, p.top};
+	if (level == p.top - it->skip)
+		rest = (struct imgpos){it->leg[1], level, level};
+	struct imgpos fill = {it->fill ? IMG_FULL : IMG_NULL, level, level};
+	if (it->leg[0] & (1ULL << (p.level + 5))) {
+		*zero = fill;
+		*one = rest;
+	} else {
+		*zero = rest;
+		*one = fill;
+	}
+}
+
+// imgHas - As posHas()
+static int imgHas(struct bmtImage const* img, struct imgpos p, int value)
+{
+	void const* item;
+	unsigned k = imgLookup(img, p, &item);
+	if (k == IMG_NULL || k == IMG_FULL)
+		return (k == IMG_FULL) == value;
+	struct imgItem const* it = item;
+	if (k == IMG_CHAIN && p.level < p.top) {
+		if (it->fill == value)
+			return 1;
+		return it->leg[1] != (value ? IMG_NULL : IMG_FULL);
+	}
+	if (k == IMG_NODE16 && p.level < p.top) {
+		// Item legs have both values
+		uint32_t mask = node16Mask(p);
+		if (value)
+			return ((it->cnt | it->cnt >> 16) & mask) != 0;
+		return (~(it->cnt >> 16) & mask) != 0;
+	}
+	return 1;
+}
+
+// imgOnes - The number of '1's at a position
+static uint64_t imgOnes(struct bmtImage const* img, struct imgpos p)
+{
+	void const* item;
+	switch (imgLookup(img, p, &item)) {
+	case IMG_NULL:
+		return 0;
+	case IMG_FULL:
+		return span(p.level);
+	case IMG_LEAF:
+		return wordsPopcount(item, 1 << img->leafLevel);
+	}
+	struct imgItem const* it = item;
+	if (p.level == p.top)
+		return it->ones;
+	if (it->type == IMG_NODE16)
+		return node16Ones(it, node16Mask(p), p.top - 4);
+	// The rest of a chain
+	unsigned bottom = p.top - it->skip;
+	uint64_t ones = imgOnes(img, (struct imgpos){it->leg[1], bottom, bottom});
+	if (it->fill)
+		ones += span(p.level) - span(bottom);
+	return ones;
+}
+
+static inline struct imgpos imgTop(struct bmtImage const* img)
+{
+	return (struct imgpos){img->top, img->levels, img->levels};
+}
+
+int bmtImageBit(struct bmtImage* img, uint64_t offset)
+{
+	if (img->size > 0 && offset >= img->size)
+		return 0;
+	struct imgpos p = imgTop(img);
+	for (;;) {
+		void const* item;
+		unsigned k = imgLookup(img, p, &item);
+		struct imgItem const* it = item;
+		switch (k) {
+		case IMG_NULL:
+		case IMG_FULL:
+			return k == IMG_FULL;
+		case IMG_LEAF: {
+			bitmap_t const* b = item;
+			bitmap_t w = b[(offset >> BM_BITS) & ((1 << p.level) - 1)];
+			return (w >> (offset & BM_MASK)) & 1;
+		}
+		case IMG_ARRAY:
+		case IMG_RUNS: {
+			struct bmtitem n = imgContainer(it);
+			return containerBit(&n, offset & (span(CHUNK_LEVEL) - 1));
+		}
+		case IMG_CHAIN:
+			if ((offset ^ it->leg[0]) & chainMask(p.level, it->skip))
+				return it->fill;
+			p.level -= it->skip;
+			p = (struct imgpos){it->leg[1], p.level, p.level};
+			break;
+		case IMG_NODE16:
+			p.level -= 4;
+			p = node16Leg(it, (offset >> (p.level + 6)) & 15, p.level);
+			break;
+		default:
+			p.level--;
+			p = (struct imgpos){
+				it->leg[(offset >> (p.level + 6)) & 1], p.level, p.level};
+		}
+	}
+}
+
+uint64_t bmtImageOnes(struct bmtImage* img)
+{
+	return img->ones;
+}
+
+uint64_t bmtImageRank(struct bmtImage* img, uint64_t offset)
+{
+	if (img->size > 0 && offset >= img->size)
+		return img->ones;
+	struct imgpos p = imgTop(img), zero, one;
+	uint64_t rank = 0;
+	for (;;) {
+		void const* item;
+		unsigned k = imgLookup(img, p, &item);
+		switch (k) {
+		case IMG_NULL:
+			return rank;
+		case IMG_FULL:
+			return rank + (offset & (span(p.level) - 1));
+		case IMG_LEAF: {
+			bitmap_t const* b = item;
+			unsigned i = (offset >> BM_BITS) & ((1 << p.level) - 1);
+			return rank + wordsPopcount(b, i) + __builtin_popcountll(
+				b[i] & ((1ULL << (offset & BM_MASK)) - 1));
+		}
+		case IMG_ARRAY:
+		case IMG_RUNS: {
+			struct bmtitem n = imgContainer(item);
+			return rank + containerRank(&n, offset & (span(CHUNK_LEVEL) - 1));
+		}
+		case IMG_NODE16: {
+			// (positions inside a Node16 are only used by imgNext())
+			unsigned level = p.level - 4;
+			unsigned x = (offset >> (level + 6)) & 15;
+			if (x > 0)
+				rank += node16Ones(item, (1u << x) - 1, level);
+			p = node16Leg(item, x, level);
+			continue;
+		}
+		}
+		imgLegs(p, item, &zero, &one);
+		if (offset & (1ULL << (p.level + 5))) {
+			rank += imgOnes(img, zero);
+			p = one;
+		} else {
+			p = zero;
+		}
+	}
+}
+
+// imgFirst - The first bit == 'value' at a position that has one
+static uint64_t imgFirst(
+	struct bmtImage const* img, struct imgpos p, uint64_t base, int value)
+{
+	struct imgpos zero, one;
+	for (;;) {
+		void const* item;
+		switch (imgLookup(img, p, &item)) {
+		case IMG_NULL:
+		case IMG_FULL:
+			return base;
+		case IMG_LEAF:
+			return base + wordsNext(item, 1 << p.level, 0, value);
+		case IMG_ARRAY:
+		case IMG_RUNS: {
+			struct bmtitem n = imgContainer(item);
+			return base + containerNext(&n, 0, value);
+		}
+		}
+		imgLegs(p, item, &zero, &one);
+		if (imgHas(img, zero, value)) {
+			p = zero;
+		} else {
+			base |= 1ULL << (p.level + 5);
+			p = one;
+		}
+	}
+}
+
+// imgNext - As nextBit() in bitmaptree.c
+static int imgNext(
+	struct bmtImage const* img, uint64_t from, int value, uint64_t* offset)
+{
+	if (img->size > 0 && from >= img->size)
+		return -1;
+	struct imgpos p = imgTop(img), zero, one, cand;
+	uint64_t candBase = 0;
+	int haveCand = 0;
+	for (;;) {
+		void const* item;
+		unsigned k = imgLookup(img, p, &item);
+		if (k == IMG_NULL || k == IMG_FULL) {
+			if ((k == IMG_FULL) == value) {
+				*offset = from;
+				return 0;
+			}
+			break;
+		}
+		if (k == IMG_ARRAY || k == IMG_RUNS) {
+			struct bmtitem n = imgContainer(item);
+			uint64_t mask = span(CHUNK_LEVEL) - 1;
+			int x = containerNext(&n, from & mask, value);
+			if (x >= 0) {
+				*offset = (from & ~mask) + x;
+				return 0;
+			}
+			break;
+		}
+		if (k == IMG_LEAF) {
+			uint64_t mask = span(p.level) - 1;
+			int x = wordsNext(item, 1 << p.level, from & mask, value);
+			if (x >= 0) {
+				*offset = (from & ~mask) + x;
+				return 0;
+			}
+			break;
+		}
+		imgLegs(p, item, &zero, &one);
+		uint64_t bit = 1ULL << (p.level + 5);
+		if (from & bit) {
+			p = one;
+		} else {
+			if (imgHas(img, one, value)) {
+				cand = one;
+				candBase = (from & ~(bit - 1)) | bit;
+				haveCand = 1;
+			}
+			p = zero;
+		}
+	}
+	if (!haveCand)
+		return -1;
+	*offset = imgFirst(img, cand, candBase, value);
+	return 0;
+}
+
+int bmtImageNextSet(struct bmtImage* img, uint64_t from, uint64_t* offset)
+{
+	return imgNext(img, from, 1, offset);
+}
+int bmtImageNextClear(struct bmtImage* img, uint64_t from, uint64_t* offset)
+{
+	return imgNext(img, from, 0, offset);
+}
+
+// ----------------------------------------------------------------------
+// Promote;
+
+/*
+  The items are copied to a new tree as in readNodes() in tree-store.c.
+  Every item is checked and normalized. On error the partially copied
+  tree is released with the pool.
+ */
+enum { READ_NEXT, READ_ZERO, READ_ONE };
+struct pstate {
+	struct bmtitem* n;
+	struct imgpos one;			/* For READ_ONE */
+	uint8_t state;
+};
+static int promoteItems(
+	struct bmtImage const* img, struct bmtpool* p, struct bmtitem** top)
+{
+	struct pstate stack[STACK_DEPTH];
+	unsigned depth = 0;
+	struct imgpos pos = imgTop(img);
+	struct bmtitem* v;			/* The last complete subtree */
+	for (;;) {
+		void const* item;
+		unsigned k = imgLookup(img, pos, &item);
+		struct imgItem const* it = item;
+		if (k == IMG_NULL || k == IMG_FULL) {
+			if (pos.ref != k)
+				goto errquit;	/* Invalid reference */
+			v = k == IMG_FULL ? FULL : NULL;
+		} else if (k == IMG_LEAF) {
+			v = leafNew(p, pos.level, item);
+		} else {
+			struct bmtitem* n = itemAlloc(p, pos.level);
+			if (k == IMG_ARRAY || k == IMG_RUNS) {
+				size_t len = containerValues(k, it->cnt);
+				containerReserve(p, n, len);
+				n->kind = k == IMG_RUNS ? KIND_RUNS : KIND_ARRAY;
+				n->cnt = it->cnt;
+				memcpy(n->vals, it->leg, len * sizeof(uint16_t));
+				if (containerCheck(n) != 0)
+					goto errquit;
+				v = containerNormalize(p, n);
+			} else if (k == IMG_CHAIN) {
+				chainSkip(p, n, it->skip);
+				n->fill = it->fill != 0;
+				n->prefix = it->leg[0] & chainMask(pos.level, it->skip);
+				stack[depth++] = (struct pstate){n, {0}, READ_NEXT};
+				pos.level -= it->skip;
+				pos = (struct imgpos){it->leg[1], pos.level, pos.level};
+				continue;
+			} else {
+				// A node, or a position in a Node16
+				struct imgpos zero, one;
+				imgLegs(pos, it, &zero, &one);
+				stack[depth++] = (struct pstate){n, one, READ_ZERO};
+				pos = zero;
+				continue;
+			}
+		}
+
+		// Store complete subtrees until a node has a leg to read
+		while (depth > 0) {
+			struct pstate* f = &stack[depth - 1];
+			if (f->state == READ_NEXT) {
+				f->n->next = v;
+				v = chainNormalize(p, f->n);
+			} else if (f->state == READ_ZERO) {
+				f->n->zero = v;
+				f->state = READ_ONE;
+				break;
+			} else {
+				f->n->one = v;
+				v = itemNormalize(p, f->n);
+			}
+			depth--;
+		}
+		if (depth == 0) {
+			*top = v;
+			return 0;
+		}
+		pos = stack[depth - 1].one;
+	}
+
+errquit:
+	return -1;
+}
+
+struct BitmapTree* bmtImagePromote(struct bmtImage* img)
+{
+	struct BitmapTree* bmt = bmtCreateWithLeaves(
+		img->size, 64 << img->leafLevel, NULL);
+	if (bmt == NULL)
+		return NULL;
+	if (img->containers && bmtSetContainers(bmt, 4096, 2048) != 0)
+		goto errquit;
+	if (promoteItems(img, bmt->pool, &bmt->top) == 0)
+		return bmt;
+	bmt->top = NULL;
+
+errquit:
+	bmtDelete(bmt);
+	return NULL;
+}
@@ -0,0 +1,250 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  Records are collected in a buffer and appended to the log as a commit
+  when 'batch' records are collected, the buffer is full, or on
+  bmtJournalFlush(). A commit is;
+
+    uint32_t len, uint32_t check (FNV-1a of the records), records
+
+  A record is an op byte followed by one or two varints (LEB128). The
+  offset is a zigzag coded delta from the offset of the previous record
+  in the commit, so reservations in sequence take 2 bytes;
+
+    1 - Set bit; offset
+    2 - Clear bit; offset
+    3 - Set branch; offset, size
+    4 - Clear branch; offset, size
+    5 - Set range; first, last - first
+    6 - Clear range; first, last - first
+
+  Commits are independent and applied whole or not at all. An
+  incomplete or damaged commit at the end of the log (a crash during an
+  append) ends the replay.
+ */
+
+#define COMMIT_SIZE 32768
+#define COMMIT_HDR (2 * sizeof(uint32_t))
+#define RECORD_MAX 21			/* op + 2 * 10 byte varint */
+
+struct bmtjournal {
+	struct bmtJournal j;
+	unsigned records;
+	uint64_t last;				/* Offset of the last record */
+	size_t len;					/* Including the commit header */
+	uint8_t data[COMMIT_HDR + COMMIT_SIZE];
+};
+
+static uint32_t fnv1a(uint8_t const* d, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ d[i]) * 16777619u;
+	return h;
+}
+
+static inline uint8_t* putVarint(uint8_t* d, uint64_t v)
+{
+	while (v >= 0x80) {
+		*d++ = v | 0x80;
+		v >>= 7;
+	}
+	*d++ = v;
+	return d;
+}
+
+static void journalReset(struct bmtjournal* j)
+{
+	j->records = 0;
+	j->last = 0;
+	j->len = COMMIT_HDR;
+}
+
+static void journalCommit(struct bmtjournal* j)
+{
+	if (j->records == 0)
+		return;
+	uint32_t hdr[2];
+	hdr[0] = j->len - COMMIT_HDR;
+	hdr[1] = fnv1a(j->data + COMMIT_HDR, hdr[0]);
+	memcpy(j->data, hdr, sizeof(hdr));
+	j->j.append(j->j.userRef, j->data, j->len);
+	journalReset(j);
+}
+
+void journalRecord(
+	struct bmtjournal* j, unsigned op, uint64_t offset, uint64_t arg)
+{
+	uint8_t* d = j->data + j->len;
+	uint64_t delta = offset - j->last;
+	*d++ = op;
+	d = putVarint(d, (delta << 1) ^ (uint64_t)((int64_t)delta >> 63));
+	if (op >= JOURNAL_SET_BRANCH)
+		d = putVarint(d, arg);
+	j->last = offset;
+	j->len = d - j->data;
+	j->records++;
+	if (j->records >= j->j.batch || j->len + RECORD_MAX > sizeof(j->data))
+		journalCommit(j);
+}
+
+int bmtJournalStart(struct BitmapTree* bmt, struct bmtJournal const* journal)
+{
+	if (bmt->journal != NULL || journal->append == NULL ||
+		journal->image == NULL)
+		return -1;
+	struct bmtjournal* j = malloc(sizeof(struct bmtjournal));
+	if (j == NULL)
+		die("Out of mem");
+	j->j = *journal;
+	if (j->j.batch == 0)
+		j->j.batch = 1;
+	journalReset(j);
+	bmt->journal = j;
+	return bmtCheckpoint(bmt);
+}
+
+int bmtJournalFlush(struct BitmapTree* bmt)
+{
+	if (bmt->journal == NULL)
+		return -1;
+	journalCommit(bmt->journal);
+	return 0;
+}
+
+void journalStop(struct BitmapTree* bmt)
+{
+	journalCommit(bmt->journal);
+	free(bmt->journal);
+	bmt->journal = NULL;
+}
+
+int bmtJournalStop(struct BitmapTree* bmt)
+{
+	if (bmt->journal == NULL)
+		return -1;
+	journalStop(bmt);
+	return 0;
+}
+
+// The records not yet committed are in the image
+int bmtCheckpoint(struct BitmapTree* bmt)
+{
+	struct bmtjournal* j = bmt->journal;
+	if (j == NULL)
+		return -1;
+	journalReset(j);
+	bmtWrite(bmt, j->j.image, j->j.userRef);
+	if (j->j.truncate != NULL)
+		j->j.truncate(j->j.userRef);
+	return 0;
+}
+
+// ----------------------------------------------------------------------
+// Replay;
+
+static uint8_t const* getVarint(
+	uint8_t const* d, uint8_t const* end, uint64_t* v)
+{
+	*v = 0;
+	for (unsigned shift = 0; d < end && shift < 64; shift += 7) {
+		uint8_t b = *d++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return d;
+	}
+	return NULL;
+}
+
+// getRecord - Decode the record at 'd'. return the next record, or
+// NULL if invalid
+static uint8_t const* getRecord(
+	uint8_t const* d, uint8_t const* end, unsigned* op, uint64_t* last,
+	uint64_t* arg)
+{
+	uint64_t delta;
+	*op = *d++;
+	if (*op < JOURNAL_SET || *op > JOURNAL_CLEAR_RANGE)
+		return NULL;
+	d = getVarint(d, end, &delta);
+	if (d != NULL && *op >= JOURNAL_SET_BRANCH)
+		d = getVarint(d, end, arg);
+	*last += (delta >> 1) ^ -(delta & 1);
+	return d;
+}
+
+// replayCommit - return the number of records, or -1 if invalid. All
+// records are decoded before any is applied, so an invalid commit
+// leaves the tree as it was.
+static int replayCommit(
+	struct BitmapTree* bmt, uint8_t const* d, uint8_t const* end)
+{
+	uint64_t last = 0, arg = 0;
+	unsigned op;
+	for (uint8_t const* r = d; r < end;) {
+		r = getRecord(r, end, &op, &last, &arg);
+		if (r == NULL)
+			return -1;
+	}
+	int records = 0;
+	last = 0;
+	while (d < end) {
+		d = getRecord(d, end, &op, &last, &arg);
+		switch (op) {
+		case JOURNAL_SET:
+			bmtSetBit(bmt, last);
+			break;
+		case JOURNAL_CLEAR:
+			bmtClearBit(bmt, last);
+			break;
+		case JOURNAL_SET_BRANCH:
+			bmtSetBranch(bmt, last, arg);
+			break;
+		case JOURNAL_CLEAR_BRANCH:
+			bmtClearBranch(bmt, last, arg);
+			break;
+		case JOURNAL_SET_RANGE:
+			bmtSetRange(bmt, last, last + arg);
+			break;
+		default:
+			bmtClearRange(bmt, last, last + arg);
+		}
+		records++;
+	}
+	return records;
+}
+
+int64_t bmtJournalReplay(
+	struct BitmapTree* bmt, bmtReadFn_t readFn, void* userRef)
+{
+	uint8_t* data = malloc(COMMIT_SIZE);
+	if (data == NULL)
+		die("Out of mem");
+	// Replayed records are not journaled again
+	struct bmtjournal* j = bmt->journal;
+	bmt->journal = NULL;
+	int64_t records = 0;
+	uint32_t hdr[2];
+	while (readFn(userRef, hdr, sizeof(hdr)) == sizeof(hdr)) {
+		if (hdr[0] == 0 || hdr[0] > COMMIT_SIZE)
+			break;
+		if (readFn(userRef, data, hdr[0]) != hdr[0])
+			break;
+		if (fnv1a(data, hdr[0]) != hdr[1])
+			break;
+		int rc = replayCommit(bmt, data, data + hdr[0]);
+		if (rc < 0) {
+			records = -1;
+			break;
+		}
+		records += rc;
+	}
+	bmt->journal = j;
+	free(data);
+	return records;
+}
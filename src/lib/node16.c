@@ -0,0 +1,237 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  16-way nodes. Binary nodes make a dense tree deep; a lookup in a
+  dense 2^20 top passes 14 nodes. A Node16 replaces a node and the
+  three levels of nodes below it, so a lookup passes one item per 4
+  levels and a rank adds the '1' counts of the legs before the offset
+  instead of reading them.
+
+  A node becomes a Node16 when it is normalized (itemNormalize()) at a
+  level (leafLevel + 4k) and the nodes in the three levels below it are
+  all plain nodes (not chains, containers or Node16), so all 16 legs
+  are items. A Node16 is never above and below the chunk level, so a
+  chunk is always a whole item. This keeps the tree unique for a
+  bitarray. A Node16 where a leg becomes NULL/FULL is made binary nodes
+  again.
+
+  The hot paths (bmtBit(), bmtRank(), bmtSelect(), setbit, reserve)
+  take a leg directly. Other modifications expand the Node16 to binary
+  nodes (see itemOwnNode()) and it is formed again when they are
+  normalized. Positions (bmtpos) inside a Node16 are the binary nodes
+  it replaces, so the serializers write binary nodes and the stored
+  formats are not affected.
+
+  The legs are allocated with the allocator of the pool, as the values
+  of containers.
+ */
+
+// node16Level - A Node16 can be used at 'level'
+static inline int node16Level(struct bmtpool const* p, unsigned level)
+{
+	return p->node16 && level >= p->leafLevel + 4 &&
+		(level - p->leafLevel) % 4 == 0 &&
+		!(level - 4 < CHUNK_LEVEL && CHUNK_LEVEL < level);
+}
+
+static struct bmtnode16* node16Alloc(struct bmtpool* p)
+{
+	struct bmtnode16* a = p->allocator.alloc(
+		p->allocator.userRef, sizeof(struct bmtnode16));
+	if (a == NULL)
+		die("Out of mem");
+	STATS(p, allocBytes += sizeof(struct bmtnode16));
+	p->count.node16s++;
+	return a;
+}
+
+// node16Release - Release the legs array. The legs are not freed
+void node16Release(struct bmtpool* p, struct bmtitem* n)
+{
+	p->count.node16s--;
+	STATS(p, freeBytes += sizeof(struct bmtnode16));
+	p->allocator.free(p->allocator.userRef, n->node16, sizeof(struct bmtnode16));
+	n->node16 = NULL;
+	n->kind = KIND_NODE;
+}
+
+// node16MaxFree - Update 'maxfree' of the item from the legs
+void node16MaxFree(struct bmtitem* n)
+{
+	unsigned max = 0;
+	for (unsigned i = 0; i < 16; i++) {
+		if (n->node16->maxfree[i] > max)
+			max = n->node16->maxfree[i];
+	}
+	n->maxfree[0] = n->maxfree[1] = max;
+}
+
+// node16Update - Update the counts and 'maxfree' from the legs
+void node16Update(struct bmtitem* n)
+{
+	struct bmtnode16* a = n->node16;
+	n->ones = 0;
+	for (unsigned i = 0; i < 16; i++) {
+		a->ones[i] = itemOnes(a->leg[i], n->level - 4);
+		a->maxfree[i] = itemMaxFree(a->leg[i], n->level - 4);
+		n->ones += a->ones[i];
+	}
+	node16MaxFree(n);
+}
+
+// node16Copy - A private copy of a Node16. The legs are shared.
+struct bmtitem* node16Copy(struct bmtpool* p, struct bmtitem const* n)
+{
+	struct bmtitem* m = itemAlloc(p, n->level);
+	m->kind = KIND_NODE16;
+	m->ones = n->ones;
+	m->maxfree[0] = n->maxfree[0];
+	m->maxfree[1] = n->maxfree[1];
+	m->node16 = node16Alloc(p);
+	*m->node16 = *n->node16;
+	for (unsigned i = 0; i < 16; i++)
+		m->node16->leg[i] = itemShare(p, n->node16->leg[i], n->level - 4);
+	return m;
+}
+
+// node16Tree - Normalized binary nodes for 2^k legs at 'level'
+static struct bmtitem* node16Tree(
+	struct bmtpool* p, struct bmtitem* const* leg, unsigned level,
+	unsigned k)
+{
+	if (k == 0)
+		return leg[0];
+	struct bmtitem* m = itemAlloc(p, level + k);
+	m->zero = node16Tree(p, leg, level, k - 1);
+	m->one = node16Tree(p, leg + (1u << (k - 1)), level, k - 1);
+	return nodeNormalize(p, m);
+}
+
+// node16New - A subtree for 16 legs (that are items) at level - 4. A
+// Node16 if the pool uses them at 'level', otherwise binary nodes
+struct bmtitem* node16New(
+	struct bmtpool* p, unsigned level, struct bmtitem* const* leg)
+{
+	if (!node16Level(p, level))
+		return node16Tree(p, leg, level - 4, 4);
+	struct bmtitem* n = itemAlloc(p, level);
+	n->kind = KIND_NODE16;
+	n->node16 = node16Alloc(p);
+	memcpy(n->node16->leg, leg, sizeof(n->node16->leg));
+	node16Update(n);
+	return n;
+}
+
+// node16Expand - Binary nodes that take over the legs of a Node16. The
+// Node16 must be freed (which does not free the legs).
+struct bmtitem* node16Expand(struct bmtpool* p, struct bmtitem const* n)
+{
+	return node16Tree(p, n->node16->leg, n->level - 4, 4);
+}
+
+// node16Plain - The 'k' levels of nodes from 'n' are all plain nodes
+static int node16Plain(struct bmtitem const* n, unsigned k)
+{
+	if (k == 0)
+		return n != NULL && n != FULL;
+	if (n == NULL || n == FULL || n->kind != KIND_NODE || n->skip > 0)
+		return 0;
+	return node16Plain(n->zero, k - 1) && node16Plain(n->one, k - 1);
+}
+
+// node16Take - Move the 2^k legs at 'level' below a node to 'leg' and
+// free the nodes. Legs of a shared node are shared instead.
+static void node16Take(
+	struct bmtpool* p, struct bmtitem* n, unsigned level, unsigned k,
+	int shared, struct bmtitem** leg)
+{
+	if (k == 0) {
+		*leg = shared ? itemShare(p, n, level) : n;
+		return;
+	}
+	int s = shared || n->refs > 0;
+	node16Take(p, n->zero, level, k - 1, s, leg);
+	node16Take(p, n->one, level, k - 1, s, leg + (1u << (k - 1)));
+	if (shared)
+		return;
+	if (n->refs > 0)
+		n->refs--;
+	else
+		itemFree(p, n);
+}
+
+// node16Check - Called when a node has been normalized. A node that
+// can be a Node16 is made one in place.
+struct bmtitem* node16Check(struct bmtpool* p, struct bmtitem* n)
+{
+	if (n == NULL || n == FULL || n->kind != KIND_NODE || n->skip > 0 ||
+		!node16Level(p, n->level) || !node16Plain(n, 4))
+		return n;
+	struct bmtitem* leg[16];
+	node16Take(p, n->zero, n->level - 4, 3, 0, leg);
+	node16Take(p, n->one, n->level - 4, 3, 0, leg + 8);
+	n->kind = KIND_NODE16;
+	n->node16 = node16Alloc(p);
+	memcpy(n->node16->leg, leg, sizeof(leg));
+	node16Update(n);
+	return n;
+}
+
+// node16Normalize - Called when the legs of a private Node16 may have
+// changed. A Node16 with a NULL/FULL leg becomes binary nodes.
+struct bmtitem* node16Normalize(struct bmtpool* p, struct bmtitem* n)
+{
+	for (unsigned i = 0; i < 16; i++) {
+		struct bmtitem* leg = n->node16->leg[i];
+		if (leg == NULL || leg == FULL) {
+			struct bmtitem* m = node16Expand(p, n);
+			itemFree(p, n);
+			return chunkCheck(p, m);
+		}
+	}
+	node16Update(n);
+	return chunkCheck(p, n);
+}
+
+// node16Convert - Form (or expand if not used) the 16-way nodes in a
+// subtree that is not shared
+static void node16Convert(
+	struct bmtpool* p, struct bmtitem** s, unsigned level)
+{
+	struct bmtitem* n = *s;
+	if (n == NULL || n == FULL || level <= p->leafLevel || isContainer(n))
+		return;
+	if (n->kind == KIND_NODE16) {
+		if (node16Level(p, level)) {
+			for (unsigned i = 0; i < 16; i++)
+				node16Convert(p, &n->node16->leg[i], level - 4);
+			return;
+		}
+		*s = node16Expand(p, n);
+		itemFree(p, n);
+		n = *s;
+	}
+	if (n->skip > 0) {
+		node16Convert(p, &n->next, level - n->skip);
+		return;
+	}
+	node16Convert(p, &n->zero, level - 1);
+	node16Convert(p, &n->one, level - 1);
+	*s = node16Check(p, n);
+}
+
+int bmtSetNode16(struct BitmapTree* bmt, int on)
+{
+	struct bmtpool* p = bmt->pool;
+	if (p->trees > 1 || bmt->epoch != NULL ||
+		__atomic_load_n(&p->readers, __ATOMIC_RELAXED) != 0)
+		return -1;
+	p->node16 = on != 0;
+	node16Convert(p, &bmt->top, bmt->levels);
+	return 0;
+}
@@ -0,0 +1,570 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  A compact alternative to "tree-store". The tree is stored as;
+
+    uint8_t 0bvvvvCww0
+      vvvv - version (1)
+      C - Containers are used
+      ww - Leaf size. 00 = 64-bit, 01 = 128-bit, 10 = 256-bit, 11 = 512-bit
+    uint8_t 0bEzxxxxxx
+      E - set to '1' if the tree is empty or full
+      z - If the tree is empty or full; 0=empty, 1=full
+      xxxxxx - ulog2(size). 0 interpreted as 64
+    (frames...)
+
+  Frames hold a bit-stream (least significant bit first) with the
+  items in pre-order;
+
+    varint len, (len bytes, at most 32768)
+
+  A normalized node always has two sub-trees (a node with a NULL or
+  FULL leg is a chain) so legs are not stored. Items above the leaf
+  level start with a 2-bit code;
+
+    00 - Node. The "zero" and the "one" items follow
+    01 - Chain with fill NULL, 10 - Chain with fill FULL;
+      1 bit - 1 if the "next" item follows, 0 if next is the inverse
+        of the fill
+      skip-1 - ulog2(level - leafLevel) bits
+      path - skip bits
+    11 - Container (only for a 2^16 bit chunk);
+      1 bit - 0=array, 1=runs
+      cnt-1 - 16 bits
+      array - cnt Rice coded deltas, k = log2(65536/cnt)
+      runs - 5 bits kgap, 5 bits klen, then cnt pairs of Rice coded
+        (gap, length-1)
+
+  Leaves start with a 2-bit mode;
+
+    00 - Raw. The bits of the leaf
+    01 - The offsets of the '1's, 10 - The offsets of the '0's;
+      cnt-1 - log2(leaf bits) bits
+      cnt Rice coded deltas, k = log2(leaf bits/cnt)
+
+  Rice coding of 'd' with parameter 'k' is (d >> k) '1's, a '0' and the
+  k low bits of 'd'. A delta is the distance from the previous offset
+  + 1, so the first delta is the offset itself.
+ */
+#define FRAME_SIZE 32768
+#define FRAME_HDR 3				/* Max varint len of FRAME_SIZE */
+#define STACK_DEPTH 64
+
+enum { CODE_NODE, CODE_CHAIN, CODE_CHAIN_FULL, CODE_CONTAINER };
+enum { LEAF_RAW, LEAF_ONES, LEAF_ZEROS };
+
+// riceK - The Rice parameter for 'cnt' values spread over 'span'
+static inline unsigned riceK(unsigned span, unsigned cnt)
+{
+	unsigned avg = span / cnt;
+	return avg > 1 ? 31 - __builtin_clz(avg) : 0;
+}
+
+// ----------------------------------------------------------------------
+// Write;
+
+struct pwbuf {
+	bmtWriteFn_t writeFn;
+	void* userRef;
+	uint64_t acc;				/* Bits not yet in the buffer */
+	unsigned nbits;
+	size_t len;					/* Including room for the frame header */
+	uint8_t data[FRAME_HDR + FRAME_SIZE];
+};
+
+static void wflush(struct pwbuf* w)
+{
+	size_t len = w->len - FRAME_HDR;
+	if (len == 0)
+		return;
+	unsigned h = len < 0x80 ? 1 : len < 0x4000 ? 2 : 3;
+	uint8_t* d = w->data + FRAME_HDR - h;
+	for (unsigned i = 0; i < h; i++, len >>= 7)
+		d[i] = (len & 0x7f) | (i + 1 < h ? 0x80 : 0);
+	w->writeFn(w->userRef, d, w->len - (FRAME_HDR - h));
+	w->len = FRAME_HDR;
+}
+
+// putBits - Write the 'n' (at most 32) low bits of 'v'
+static inline void putBits(struct pwbuf* w, uint64_t v, unsigned n)
+{
+	w->acc |= (v & ((1ULL << n) - 1)) << w->nbits;
+	w->nbits += n;
+	while (w->nbits >= 8) {
+		w->data[w->len++] = w->acc;
+		if (w->len == sizeof(w->data))
+			wflush(w);
+		w->acc >>= 8;
+		w->nbits -= 8;
+	}
+}
+static void putLong(struct pwbuf* w, uint64_t v, unsigned n)
+{
+	for (; n > 32; n -= 32, v >>= 32)
+		putBits(w, v, 32);
+	putBits(w, v, n);
+}
+static inline void putRice(struct pwbuf* w, unsigned d, unsigned k)
+{
+	unsigned q = d >> k;
+	for (; q >= 32; q -= 32)
+		putBits(w, UINT32_MAX, 32);
+	putBits(w, (1ULL << q) - 1, q + 1);
+	putBits(w, d, k);
+}
+static inline unsigned riceBits(unsigned d, unsigned k)
+{
+	return (d >> k) + 1 + k;
+}
+
+// leafOffsets - Write, or count the bits for, the offsets of 'value'
+static unsigned leafOffsets(
+	struct pwbuf* w, bitmap_t const* b, unsigned words, int value,
+	unsigned k)
+{
+	unsigned bits = 0, next = 0;
+	for (unsigned i = 0; i < words; i++) {
+		bitmap_t x = value ? b[i] : ~b[i];
+		while (x != 0) {
+			unsigned pos = (i << BM_BITS) + __builtin_ctzll(x);
+			if (w != NULL)
+				putRice(w, pos - next, k);
+			else
+				bits += riceBits(pos - next, k);
+			next = pos + 1;
+			x &= x - 1;
+		}
+	}
+	return bits;
+}
+
+// writeLeaf - Write the offsets of the least common value if that is
+// smaller than the raw bits
+static void writeLeaf(struct pwbuf* w, bitmap_t const* b, unsigned leafLevel)
+{
+	unsigned words = 1 << leafLevel;
+	unsigned bits = words << BM_BITS;
+	unsigned ones = wordsPopcount(b, words);
+	int value = ones <= bits / 2;
+	unsigned cnt = value ? ones : bits - ones;
+	unsigned k = riceK(bits, cnt);
+	if (BM_BITS + leafLevel + leafOffsets(NULL, b, words, value, k) < bits) {
+		putBits(w, value ? LEAF_ONES : LEAF_ZEROS, 2);
+		putBits(w, cnt - 1, BM_BITS + leafLevel);
+		leafOffsets(w, b, words, value, k);
+		return;
+	}
+	putBits(w, LEAF_RAW, 2);
+	for (unsigned i = 0; i < words; i++)
+		putLong(w, b[i], 64);
+}
+
+static void writeContainer(struct pwbuf* w, struct bmtitem const* n)
+{
+	putBits(w, CODE_CONTAINER, 2);
+	putBits(w, n->kind == KIND_RUNS, 1);
+	putBits(w, n->cnt - 1, 16);
+	unsigned next = 0;
+	if (n->kind == KIND_ARRAY) {
+		unsigned k = riceK(65536, n->cnt);
+		for (uint32_t i = 0; i < n->cnt; i++) {
+			putRice(w, n->vals[i] - next, k);
+			next = n->vals[i] + 1;
+		}
+		return;
+	}
+	unsigned kgap = riceK(65536 - n->ones, n->cnt);
+	unsigned klen = riceK(n->ones, n->cnt);
+	putBits(w, kgap, 5);
+	putBits(w, klen, 5);
+	for (uint32_t i = 0; i < n->cnt; i++) {
+		uint16_t const* r = n->vals + 2 * i;
+		putRice(w, r[0] - next, kgap);
+		putRice(w, r[1] - r[0], klen);
+		next = r[1] + 1;
+	}
+}
+
+// writeItems - Write the items in pre-order ("zero" before "one")
+static void writeItems(
+	struct bmtpos top, unsigned leafLevel, struct pwbuf* w)
+{
+	struct bmtpos stack[2 * STACK_DEPTH];
+	unsigned depth = 0;
+	stack[depth++] = top;
+	while (depth > 0) {
+		struct bmtpos p = stack[--depth];
+		struct bmtitem* n = p.n;
+		if (p.level == leafLevel) {
+			bitmap_t lw;
+			writeLeaf(w, leafWords(n, p.level, &lw), leafLevel);
+		} else if (isContainer(n)) {
+			writeContainer(w, n);
+		} else if (n->skip > 0) {
+			putBits(w, n->fill ? CODE_CHAIN_FULL : CODE_CHAIN, 2);
+			int more = n->next != NULL && n->next != FULL;
+			putBits(w, more, 1);
+			putBits(w, n->skip - 1, ulog2(p.level - leafLevel));
+			putLong(w, n->prefix >> (p.level - n->skip + 6), n->skip);
+			if (more)
+				stack[depth++] = (struct bmtpos){n->next, p.level - n->skip};
+		} else {
+			// A node, or a position in a Node16
+			struct bmtpos zero, one;
+			putBits(w, CODE_NODE, 2);
+			posLegs(p, &zero, &one);
+			// The "one" leg is popped after the "zero" sub-tree
+			__builtin_prefetch(one.n);
+			stack[depth++] = one;
+			stack[depth++] = zero;
+		}
+	}
+}
+
+static void packedWrite(
+	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef)
+{
+	uint8_t hdr[2];
+	hdr[0] = (1 << 4) | (bmt->pool->leafLevel << 1);
+	if (bmt->pool->arrayMax > 0 || bmt->pool->runsMax > 0)
+		hdr[0] |= 0x08;
+	hdr[1] = ulog2(bmt->size);
+	if (bmt->top == NULL || bmt->top == FULL) {
+		hdr[1] |= 0x80;			/* Set the empty-bit */
+		if (bmt->top == FULL)
+			hdr[1] |= 0x40;
+		writeFn(userRef, hdr, sizeof(hdr));
+		return;
+	}
+	writeFn(userRef, hdr, sizeof(hdr));
+	struct pwbuf* w = malloc(sizeof(struct pwbuf));
+	if (w == NULL)
+		die("Out of mem");
+	w->writeFn = writeFn;
+	w->userRef = userRef;
+	w->acc = 0;
+	w->nbits = 0;
+	w->len = FRAME_HDR;
+	writeItems(
+		(struct bmtpos){bmt->top, bmt->levels}, bmt->pool->leafLevel, w);
+	putBits(w, 0, 7);			/* Flush the last bits */
+	wflush(w);
+	free(w);
+}
+
+// ----------------------------------------------------------------------
+// Read;
+
+/*
+  The reader never reads a frame before its bits are needed, so it
+  stops at the end of the stream. Errors are recorded in 'err' and
+  checked once per item.
+ */
+struct prbuf {
+	bmtReadFn_t readFn;
+	void* userRef;
+	uint64_t acc;
+	unsigned nbits;
+	int err;
+	size_t pos;
+	size_t len;
+	uint8_t data[FRAME_SIZE];
+};
+
+static int rframe(struct prbuf* r)
+{
+	uint32_t len = 0;
+	for (unsigned i = 0; i < FRAME_HDR; i++) {
+		uint8_t b;
+		if (r->readFn(r->userRef, &b, sizeof(b)) != sizeof(b))
+			return -1;
+		len |= (uint32_t)(b & 0x7f) << (7 * i);
+		if ((b & 0x80) == 0)
+			break;
+	}
+	if (len == 0 || len > FRAME_SIZE)
+		return -1;
+	if (r->readFn(r->userRef, r->data, len) != len)
+		return -1;
+	r->pos = 0;
+	r->len = len;
+	return 0;
+}
+
+// rfill - Make sure that at least 'n' (at most 32) bits are available.
+// At most 63 bits are buffered, so the masks below are defined
+static int rfill(struct prbuf* r, unsigned n)
+{
+	while (r->nbits < n) {
+		if (r->pos == r->len && rframe(r) != 0) {
+			r->err = 1;
+			return -1;
+		}
+		while (r->nbits < 56 && r->pos < r->len) {
+			r->acc |= (uint64_t)r->data[r->pos++] << r->nbits;
+			r->nbits += 8;
+		}
+	}
+	return 0;
+}
+
+static inline uint32_t getBits(struct prbuf* r, unsigned n)
+{
+	if (r->nbits < n && rfill(r, n) != 0)
+		return 0;
+	uint32_t v = r->acc & ((1ULL << n) - 1);
+	r->acc >>= n;
+	r->nbits -= n;
+	return v;
+}
+static uint64_t getLong(struct prbuf* r, unsigned n)
+{
+	uint64_t v = 0;
+	for (unsigned i = 0; i < n; i += 32)
+		v |= (uint64_t)getBits(r, n - i < 32 ? n - i : 32) << i;
+	return v;
+}
+
+// getRice - Read a Rice coded value. Values > 'max' are errors
+static unsigned getRice(struct prbuf* r, unsigned k, unsigned max)
+{
+	unsigned q = 0;
+	for (;;) {
+		if (r->nbits == 0 && rfill(r, 1) != 0)
+			return 0;
+		uint64_t z = ~r->acc & ((1ULL << r->nbits) - 1);
+		if (z != 0) {
+			unsigned t = __builtin_ctzll(z);
+			q += t;
+			r->acc >>= t + 1;
+			r->nbits -= t + 1;
+			break;
+		}
+		q += r->nbits;
+		r->acc = 0;
+		r->nbits = 0;
+		if (q > (max >> k))
+			break;
+	}
+	if (q > (max >> k)) {
+		r->err = 1;
+		return 0;
+	}
+	unsigned d = (q << k) | getBits(r, k);
+	if (d > max)
+		r->err = 1;
+	return d;
+}
+
+static void readLeaf(struct prbuf* r, bitmap_t* b, unsigned leafLevel)
+{
+	unsigned words = 1 << leafLevel;
+	unsigned bits = words << BM_BITS;
+	unsigned mode = getBits(r, 2);
+	if (mode == LEAF_RAW) {
+		for (unsigned i = 0; i < words; i++)
+			b[i] = getLong(r, 64);
+		return;
+	}
+	if (mode != LEAF_ONES && mode != LEAF_ZEROS) {
+		r->err = 1;
+		return;
+	}
+	unsigned cnt = getBits(r, BM_BITS + leafLevel) + 1;
+	unsigned k = riceK(bits, cnt);
+	unsigned next = 0;
+	for (unsigned i = 0; i < cnt && !r->err; i++) {
+		unsigned pos = next + getRice(r, k, bits - 1 - next);
+		if (pos >= bits)
+			break;
+		b[pos >> BM_BITS] |= (bitmap_t)1 << (pos & BM_MASK);
+		next = pos + 1;
+		if (next == bits && i + 1 < cnt)
+			r->err = 1;
+	}
+	if (mode == LEAF_ZEROS) {
+		for (unsigned i = 0; i < words; i++)
+			b[i] = ~b[i];
+	}
+}
+
+static int readContainer(
+	struct bmtpool* p, struct bmtitem* n, struct prbuf* r)
+{
+	unsigned kind = getBits(r, 1) ? KIND_RUNS : KIND_ARRAY;
+	uint32_t cnt = getBits(r, 16) + 1;
+	if (r->err)
+		return -1;
+	containerReserve(p, n, kind == KIND_RUNS ? 2 * cnt : cnt);
+	n->kind = kind;
+	n->cnt = cnt;
+	unsigned next = 0;
+	if (kind == KIND_ARRAY) {
+		unsigned k = riceK(65536, cnt);
+		for (uint32_t i = 0; i < cnt && !r->err; i++) {
+			if (next > 65535)
+				return -1;
+			n->vals[i] = next + getRice(r, k, 65535 - next);
+			next = n->vals[i] + 1;
+		}
+	} else {
+		unsigned kgap = getBits(r, 5);
+		unsigned klen = getBits(r, 5);
+		if (kgap > 16 || klen > 16)
+			return -1;
+		for (uint32_t i = 0; i < cnt && !r->err; i++) {
+			uint16_t* v = n->vals + 2 * i;
+			if (next > 65535)
+				return -1;
+			v[0] = next + getRice(r, kgap, 65535 - next);
+			v[1] = v[0] + getRice(r, klen, 65535 - v[0]);
+			next = v[1] + 1;
+		}
+	}
+	if (r->err)
+		return -1;
+	return containerCheck(n);
+}
+
+// As readNodes() in tree-store.c
+enum { READ_NEXT, READ_ZERO, READ_ONE };
+struct rstate {
+	struct bmtitem* n;
+	uint8_t state;
+};
+static int readItems(
+	struct bmtpool* p, unsigned level, struct prbuf* r, struct bmtitem** top)
+{
+	struct rstate stack[STACK_DEPTH];
+	unsigned depth = 0;
+	struct bmtitem* v;			/* The last complete subtree */
+	for (;;) {
+		if (level == p->leafLevel) {
+			bitmap_t w[8] = {0};	/* (leafLevel <= 3) */
+			readLeaf(r, w, level);
+			if (r->err)
+				goto errquit;
+			v = leafNew(p, level, w);
+		} else {
+			struct bmtitem* n = itemAlloc(p, level);
+			unsigned code = getBits(r, 2);
+			if (r->err)
+				goto errquit;
+			if (code == CODE_CONTAINER) {
+				if (level != CHUNK_LEVEL ||
+					(p->arrayMax == 0 && p->runsMax == 0))
+					goto errquit;
+				if (readContainer(p, n, r) != 0)
+					goto errquit;
+				v = containerNormalize(p, n);
+			} else if (code != CODE_NODE) {
+				n->fill = code == CODE_CHAIN_FULL;
+				int more = getBits(r, 1);
+				unsigned skip = getBits(r, ulog2(level - p->leafLevel)) + 1;
+				chainSkip(p, n, skip);
+				uint64_t path = getLong(r, n->skip);
+				if (r->err || n->skip > level - p->leafLevel)
+					goto errquit;
+				n->prefix = (path << (level - n->skip + 6)) &
+					chainMask(level, n->skip);
+				if (more) {
+					stack[depth++] = (struct rstate){n, READ_NEXT};
+					level -= n->skip;
+					continue;
+				}
+				n->next = n->fill ? NULL : FULL;
+				v = chainNormalize(p, n);
+			} else {
+				stack[depth++] = (struct rstate){n, READ_ZERO};
+				level--;
+				continue;
+			}
+		}
+
+		// Store complete subtrees until a node has a leg to read
+		while (depth > 0) {
+			struct rstate* f = &stack[depth - 1];
+			if (f->state == READ_NEXT) {
+				f->n->next = v;
+				v = chainNormalize(p, f->n);
+			} else if (f->state == READ_ZERO) {
+				f->n->zero = v;
+				f->state = READ_ONE;
+				break;
+			} else {
+				f->n->one = v;
+				v = itemNormalize(p, f->n);
+			}
+			depth--;
+		}
+		if (depth == 0) {
+			*top = v;
+			return 0;
+		}
+		level = stack[depth - 1].n->level - 1;
+	}
+
+errquit:
+	return -1;
+}
+
+static struct BitmapTree* packedRead(bmtReadFn_t readFn, void* userRef)
+{
+	struct BitmapTree* bmt = NULL;
+	uint8_t hdr[2];
+
+	if (readFn(userRef, hdr, sizeof(hdr)) != sizeof(hdr))
+		return NULL;
+	if ((hdr[0] >> 4) != 1 || (hdr[0] & 0x01) != 0) {
+		Dx(printf("Invalid version; %u\n", hdr[0]));
+		return NULL;
+	}
+	unsigned logsize = (hdr[1] & 0x3f) == 0 ? 64 : hdr[1] & 0x3f;
+	unsigned leafLevel = (hdr[0] >> 1) & 3;
+	if (logsize < BM_BITS + leafLevel || logsize > 64) {
+		Dx(printf("Invalid size; %u\n", logsize));
+		return NULL;
+	}
+	bmt = bmtCreateWithLeaves(
+		logsize < 64 ? 1ULL << logsize : 0, 64 << leafLevel, NULL);
+	if (bmt == NULL)
+		return NULL;
+	if ((hdr[0] & 0x08) && bmtSetContainers(bmt, 4096, 2048) != 0)
+		goto errquit;
+
+	if (hdr[1] & 0x80) {
+		// Empty or full
+		if (hdr[1] & 0x40)
+			bmt->top = FULL;
+		return bmt;
+	}
+
+	struct prbuf* r = malloc(sizeof(struct prbuf));
+	if (r == NULL)
+		die("Out of mem");
+	r->readFn = readFn;
+	r->userRef = userRef;
+	r->acc = 0;
+	r->nbits = 0;
+	r->err = 0;
+	r->pos = r->len = 0;
+	int rc = readItems(bmt->pool, bmt->levels, r, &bmt->top);
+	free(r);
+	if (rc == 0)
+		return bmt;
+	bmt->top = NULL;
+
+errquit:
+	bmtDelete(bmt);
+	return NULL;
+}
+
+
+__attribute__ ((__constructor__)) static void registerMethod(void) {
+	bmtSerializeMethodRegister("packed-tree", packedRead, packedWrite, 0);
+}
@@ -0,0 +1,170 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+
+/*
+  The bit range is split in 2^n aligned parts (shards) and each shard
+  is a tree of its own. Threads reserve in their "home" shard and only
+  take the lock of another shard when the home shard is full, so
+  threads with different homes don't contend. Subtrees are cloned
+  between the shards and a whole tree, so the serialization format is
+  the same as for a single tree.
+ */
+
+static inline struct bmtshard* shardOf(struct bmtShards* s, uint64_t offset)
+{
+	return &s->shard[s->count > 1 ? offset >> s->shift : 0];
+}
+
+static inline int inRange(struct bmtShards* s, uint64_t offset)
+{
+	return s->size == 0 || offset < s->size;
+}
+
+struct bmtShards* bmtShardsCreate(struct BitmapTree* bmt, unsigned count)
+{
+	if (count == 0 || (count & (count - 1)) != 0)
+		return NULL;
+	unsigned shift = bmt->levels + BM_BITS - ulog2(count);
+	if (shift < BM_BITS + bmt->pool->leafLevel)
+		return NULL;
+	struct bmtShards* s = CALLOC(sizeof(struct bmtShards));
+	s->size = bmt->size;
+	s->levels = bmt->levels;
+	s->count = count;
+	s->shift = shift;
+	s->arrayMax = bmt->pool->arrayMax;
+	s->runsMax = bmt->pool->runsMax;
+	s->shard = CALLOC(count * sizeof(struct bmtshard));
+	for (unsigned i = 0; i < count; i++) {
+		struct bmtshard* sh = &s->shard[i];
+		if (pthread_mutex_init(&sh->lock, NULL) != 0)
+			die("pthread_mutex_init");
+		sh->base = (uint64_t)i << (shift & 63);
+		sh->bmt = bmtCreateWithLeaves(
+			span(shift - BM_BITS), bmtLeafBits(bmt), &bmt->pool->allocator);
+		// (fails for shards smaller than a container chunk)
+		bmtSetContainers(sh->bmt, s->arrayMax, s->runsMax);
+		sh->bmt->top = branchClone(bmt, sh->base, shift, sh->bmt->pool);
+		sh->full = sh->bmt->top == FULL;
+	}
+	return s;
+}
+
+void bmtShardsDelete(struct bmtShards* s)
+{
+	if (s == NULL)
+		return;
+	for (unsigned i = 0; i < s->count; i++) {
+		bmtDelete(s->shard[i].bmt);
+		pthread_mutex_destroy(&s->shard[i].lock);
+	}
+	free(s->shard);
+	free(s);
+}
+
+// reserve - Reserve a bit in a shard, return != 0 if the shard is full
+static int reserve(struct bmtshard* sh, uint64_t* offset)
+{
+	int rc = -1;
+	pthread_mutex_lock(&sh->lock);
+	if (bmtReserveBit(sh->bmt, offset) == 0) {
+		*offset += sh->base;
+		rc = 0;
+	}
+	__atomic_store_n(&sh->full, sh->bmt->top == FULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sh->lock);
+	return rc;
+}
+
+int bmtShardsReserveBit(struct bmtShards* s, unsigned home, uint64_t* offset)
+{
+	home &= s->count - 1;
+	if (reserve(&s->shard[home], offset) == 0)
+		return 0;
+	// Steal from the other shards. Shards that seem full are skipped
+	for (unsigned i = 1; i < s->count; i++) {
+		struct bmtshard* sh = &s->shard[(home + i) & (s->count - 1)];
+		if (__atomic_load_n(&sh->full, __ATOMIC_RELAXED))
+			continue;
+		if (reserve(sh, offset) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static void setbit(struct bmtShards* s, uint64_t offset, int value)
+{
+	if (!inRange(s, offset))
+		return;
+	struct bmtshard* sh = shardOf(s, offset);
+	pthread_mutex_lock(&sh->lock);
+	if (value)
+		bmtSetBit(sh->bmt, offset - sh->base);
+	else
+		bmtClearBit(sh->bmt, offset - sh->base);
+	__atomic_store_n(&sh->full, sh->bmt->top == FULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void bmtShardsSetBit(struct bmtShards* s, uint64_t offset)
+{
+	setbit(s, offset, 1);
+}
+void bmtShardsClearBit(struct bmtShards* s, uint64_t offset)
+{
+	setbit(s, offset, 0);
+}
+
+int bmtShardsBit(struct bmtShards* s, uint64_t offset)
+{
+	if (!inRange(s, offset))
+		return 0;
+	struct bmtshard* sh = shardOf(s, offset);
+	pthread_mutex_lock(&sh->lock);
+	int bit = bmtBit(sh->bmt, offset - sh->base);
+	pthread_mutex_unlock(&sh->lock);
+	return bit;
+}
+
+// The shards are cloned (O(1)) with all locks taken, so the tree is a
+// consistent image. The clones are copied into the tree without locks
+// since the owner of a shard copies shared nodes before modification.
+struct BitmapTree* bmtShardsTree(struct bmtShards* s)
+{
+	struct BitmapTree* snap[s->count];
+	for (unsigned i = 0; i < s->count; i++)
+		pthread_mutex_lock(&s->shard[i].lock);
+	for (unsigned i = 0; i < s->count; i++)
+		snap[i] = bmtClone(s->shard[i].bmt);
+	for (unsigned i = 0; i < s->count; i++)
+		pthread_mutex_unlock(&s->shard[i].lock);
+
+	struct BitmapTree* bmt = bmtCreateWithLeaves(
+		s->size, bmtLeafBits(s->shard[0].bmt),
+		&s->shard[0].bmt->pool->allocator);
+	bmtSetContainers(bmt, s->arrayMax, s->runsMax);
+	for (unsigned i = 0; i < s->count; i++) {
+		struct bmtshard* sh = &s->shard[i];
+		branchGraft(
+			bmt, sh->base, s->shift, branchClone(snap[i], 0, s->shift, bmt->pool));
+		pthread_mutex_lock(&sh->lock);
+		bmtDelete(snap[i]);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	return bmt;
+}
+
+uint64_t bmtShardsOnes(struct bmtShards* s)
+{
+	uint64_t ones = 0;
+	for (unsigned i = 0; i < s->count; i++) {
+		pthread_mutex_lock(&s->shard[i].lock);
+		ones += bmtOnes(s->shard[i].bmt);
+		pthread_mutex_unlock(&s->shard[i].lock);
+	}
+	return ones;
+}
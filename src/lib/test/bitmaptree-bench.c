@@ -0,0 +1,514 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <time.h>
+
+/*
+  Usage: bitmaptree-bench [json-file]
+
+  Results are printed and, if a file is given, written as a JSON array
+  of objects for regression tracking;
+
+    {"name": "set", "impl": "bmt", "ns_per_op": 113.7}
+    {"name": "set", "impl": "bmt", "ones": 644353, "nodes": 32768,
+     "bytes": 1048720, "bytes_per_bit": 1.63, "serialized": 163870}
+
+  "impl" is "bmt" or "flat", a plain bitarray doing the same work as a
+  baseline.
+ */
+
+#define OPS 1000000
+
+static volatile unsigned sink;	/* Keeps lookups from being optimized away */
+static FILE* json;
+
+static uint64_t rnd(void)
+{
+	// xorshift64, reproducible between runs
+	static uint64_t x = 88172645463325252ULL;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+static int cmpOffset(void const* a, void const* b)
+{
+	uint64_t x = *(uint64_t const*)a, y = *(uint64_t const*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t nsNow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void jsonEntry(char const* fmt, ...)
+{
+	static unsigned entries;
+	if (json == NULL)
+		return;
+	fputs(entries++ == 0 ? "[\n  " : ",\n  ", json);
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(json, fmt, ap);
+	va_end(ap);
+}
+
+static void reportImpl(
+	char const* name, char const* impl, uint64_t start, unsigned ops)
+{
+	double ns = (double)(nsNow() - start) / ops;
+	printf("%-24s %-4s %10.1f ns/op\n", name, impl, ns);
+	jsonEntry(
+		"{\"name\": \"%s\", \"impl\": \"%s\", \"ns_per_op\": %.1f}",
+		name, impl, ns);
+}
+static void report(char const* name, uint64_t start, unsigned ops)
+{
+	reportImpl(name, "bmt", start, ops);
+}
+static void reportFlat(char const* name, uint64_t start, unsigned ops)
+{
+	reportImpl(name, "flat", start, ops);
+}
+
+static void countBytes(void* ref, void const* data, size_t len)
+{
+	*(uint64_t*)ref += len;
+}
+
+// reportSize - Report the memory and serialized size of a tree
+static void reportSize(char const* name, struct BitmapTree* bmt)
+{
+	uint64_t ones = bmtOnes(bmt), bytes = bmtAllocated(bmt), serialized = 0;
+	bmtWrite(bmt, countBytes, &serialized);
+	double perBit = ones > 0 ? (double)bytes / ones : 0;
+	printf("%-24s %-4s %10lu nodes %8.2f bytes/bit %10lu serialized\n",
+		   name, "bmt", bmtNodes(bmt), perBit, serialized);
+	jsonEntry(
+		"{\"name\": \"%s\", \"impl\": \"bmt\", \"ones\": %lu, "
+		"\"nodes\": %lu, \"bytes\": %lu, \"bytes_per_bit\": %.2f, "
+		"\"serialized\": %lu}", name, ones, bmtNodes(bmt), bytes, perBit,
+		serialized);
+}
+
+/*
+  The baseline; a flat bitarray. Pages are allocated on first use
+  (calloc) so only the used part of a large array costs memory.
+ */
+struct flat {
+	uint64_t* words;
+	uint64_t size;				/* In bits */
+};
+static struct flat flatCreate(uint64_t size)
+{
+	return (struct flat){CALLOC(size / 8), size};
+}
+static void flatSet(struct flat* f, uint64_t x)
+{
+	f->words[x / 64] |= 1ULL << (x % 64);
+}
+static void flatClear(struct flat* f, uint64_t x)
+{
+	f->words[x / 64] &= ~(1ULL << (x % 64));
+}
+static int flatBit(struct flat* f, uint64_t x)
+{
+	return (f->words[x / 64] >> (x % 64)) & 1;
+}
+// flatRange - Set or clear [first, last] word-wise
+static void flatRange(struct flat* f, uint64_t first, uint64_t last, int v)
+{
+	uint64_t fw = first / 64, lw = last / 64;
+	uint64_t fm = ~0ULL << (first % 64), lm = ~0ULL >> (63 - last % 64);
+	if (fw == lw)
+		fm &= lm;
+	f->words[fw] = v ? f->words[fw] | fm : f->words[fw] & ~fm;
+	if (fw == lw)
+		return;
+	memset(f->words + fw + 1, v ? 0xff : 0, (lw - fw - 1) * 8);
+	f->words[lw] = v ? f->words[lw] | lm : f->words[lw] & ~lm;
+}
+// flatReserve - Set the first '0' from 'from'
+static int flatReserve(struct flat* f, uint64_t from, uint64_t* offset)
+{
+	for (uint64_t i = from / 64; i < f->size / 64; i++) {
+		if (f->words[i] != ~0ULL) {
+			*offset = i * 64 + __builtin_ctzll(~f->words[i]);
+			f->words[i] |= 1ULL << (*offset % 64);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+struct buff {
+	uint8_t* data;
+	size_t len;
+	size_t pos;
+};
+static void buffWrite(void* ref, void const* data, size_t len)
+{
+	struct buff* b = ref;
+	b->data = realloc(b->data, b->len + len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+static size_t buffRead(void* ref, void* data, size_t len)
+{
+	struct buff* b = ref;
+	if (b->pos + len > b->len)
+		return -1;
+	memcpy(data, b->data + b->pos, len);
+	b->pos += len;
+	return len;
+}
+
+int main(int argc, char* argv[])
+{
+	struct BitmapTree* bmt;
+	struct flat f;
+	struct buff buf;
+	struct bmtImage* img;
+	uint64_t offset;
+	uint64_t start;
+	unsigned x = 0;
+	static uint64_t offsets[OPS];
+	static uint64_t sorted[OPS];
+
+	if (argc > 1) {
+		json = fopen(argv[1], "w");
+		if (json == NULL)
+			die("Can't open %s", argv[1]);
+	}
+
+	// Random set/clear in the low 2^20 of an ipv4 sized tree
+	for (unsigned i = 0; i < OPS; i++)
+		offsets[i] = rnd() & 0xfffff;
+	bmt = bmtCreate(1ULL << 32);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		bmtSetBit(bmt, offsets[i]);
+	report("set", start, OPS);
+	reportSize("set", bmt);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		bmtClearBit(bmt, offsets[i]);
+	report("clear", start, OPS);
+	bmtDelete(bmt);
+	f = flatCreate(1ULL << 32);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		flatSet(&f, offsets[i]);
+	reportFlat("set", start, OPS);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		flatClear(&f, offsets[i]);
+	reportFlat("clear", start, OPS);
+	free(f.words);
+
+	// The same bits with the bulk functions (sorted, as a lease table)
+	memcpy(sorted, offsets, sizeof(sorted));
+	qsort(sorted, OPS, sizeof(uint64_t), cmpOffset);
+	bmt = bmtCreate(1ULL << 32);
+	start = nsNow();
+	bmtSetBits(bmt, sorted, OPS);
+	report("set-bulk", start, OPS);
+	start = nsNow();
+	x += bmtTestBits(bmt, sorted, OPS, NULL);
+	report("bit-bulk", start, OPS);
+	start = nsNow();
+	bmtClearBits(bmt, sorted, OPS);
+	report("clear-bulk", start, OPS);
+	bmtDelete(bmt);
+
+	// Unaligned ranges of up to 1024 addresses in an ipv4 map
+	bmt = bmtCreate(1ULL << 32);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++) {
+		uint64_t first = rnd() & 0xffffffff;
+		uint64_t last = first + (rnd() & 0x3ff);
+		if (last > 0xffffffff)
+			last = 0xffffffff;
+		if (i % 2)
+			bmtSetRange(bmt, first, last);
+		else
+			bmtClearRange(bmt, first, last);
+	}
+	report("set-clear-range", start, OPS);
+	bmtDelete(bmt);
+
+	// Random lookups in a small tree that fits in the cache
+	bmt = bmtCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 64; i++)
+		bmtSetBit(bmt, offsets[i] & 0xffff);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtBit(bmt, offsets[i] & 0xffff);
+	report("bit-cached", start, OPS);
+	bmtDelete(bmt);
+
+	// Random lookups in a half full 2^20 region
+	bmt = bmtCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 2; i++)
+		bmtSetBit(bmt, offsets[i]);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtBit(bmt, offsets[(i * 7) % OPS]);
+	report("bit", start, OPS);
+	bmtDelete(bmt);
+	f = flatCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 2; i++)
+		flatSet(&f, offsets[i]);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += flatBit(&f, offsets[(i * 7) % OPS]);
+	reportFlat("bit", start, OPS);
+	free(f.words);
+
+	// Bulk set/clear of random /24 branches in an ipv4 map
+	bmt = bmtCreate(1ULL << 32);
+	f = flatCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 10; i++)
+		offsets[i] = rnd() & 0xffff00;
+	start = nsNow();
+	for (unsigned i = 0; i < OPS / 10; i++) {
+		if (i % 3 == 2)
+			bmtClearBranch(bmt, offsets[i], 0x100);
+		else
+			bmtSetBranch(bmt, offsets[i], 0x100);
+	}
+	report("set-clear-branch", start, OPS / 10);
+	reportSize("set-clear-branch", bmt);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS / 10; i++)
+		flatRange(&f, offsets[i], offsets[i] + 0xff, i % 3 != 2);
+	reportFlat("set-clear-branch", start, OPS / 10);
+	bmtDelete(bmt);
+	free(f.words);
+
+	// Sparse bits in a full size tree
+	for (unsigned i = 0; i < OPS; i++)
+		offsets[i] = rnd();
+	bmt = bmtCreate(0);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		bmtSetBit(bmt, offsets[i]);
+	report("set-sparse", start, OPS);
+	reportSize("set-sparse", bmt);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		bmtClearBit(bmt, offsets[i]);
+	report("clear-sparse", start, OPS);
+	for (unsigned i = 0; i < OPS / 2; i++)
+		bmtSetBit(bmt, offsets[i]);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtBit(bmt, offsets[(i * 7) % OPS]);
+	report("bit-sparse", start, OPS);
+	buf = (struct buff){0};
+	bmtImageWrite(bmt, buffWrite, &buf);
+	img = bmtImageOpen(buf.data, buf.len);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtImageBit(img, offsets[(i * 7) % OPS]);
+	report("image-bit-sparse", start, OPS);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtImageRank(img, offsets[(i * 7) % OPS]) & 1;
+	report("image-rank-sparse", start, OPS);
+	bmtImageClose(img);
+	free(buf.data);
+	bmtDelete(bmt);
+
+	// IPAM churn; reserve half a /12, then release/reserve at random
+	bmt = bmtCreate(1ULL << 32);
+	bmtSetBranch(bmt, 0, 0);
+	bmtClearBranch(bmt, 0x0a000000, 0x100000);
+	for (unsigned i = 0; i < 0x80000; i++)
+		bmtReserveBit(bmt, &offset);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++) {
+		bmtClearBit(bmt, 0x0a000000 + (rnd() & 0xfffff));
+		bmtReserveBit(bmt, &offset);
+	}
+	report("reserve-churn", start, OPS);
+	reportSize("reserve-churn", bmt);
+	bmtDelete(bmt);
+	f = flatCreate(1ULL << 32);
+	flatRange(&f, 0, 0xffffffff, 1);
+	flatRange(&f, 0x0a000000, 0x0a0fffff, 0);
+	for (unsigned i = 0; i < 0x80000; i++)
+		flatReserve(&f, 0x0a000000, &offset);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++) {
+		flatClear(&f, 0x0a000000 + (rnd() & 0xfffff));
+		flatReserve(&f, 0x0a000000, &offset);
+	}
+	reportFlat("reserve-churn", start, OPS);
+	free(f.words);
+
+	// The same churn with next-fit
+	bmt = bmtCreate(1ULL << 32);
+	bmtSetBranch(bmt, 0, 0);
+	bmtClearBranch(bmt, 0x0a000000, 0x100000);
+	for (unsigned i = 0; i < 0x80000; i++)
+		bmtReserveNextFit(bmt, &offset);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++) {
+		bmtClearBit(bmt, 0x0a000000 + (rnd() & 0xfffff));
+		bmtReserveNextFit(bmt, &offset);
+	}
+	report("reserve-nextfit", start, OPS);
+	bmtDelete(bmt);
+
+	// Subnet allocation; reserve /24s in a fragmented 10.0.0.0/8
+	bmt = bmtCreate(1ULL << 32);
+	bmtSetBranch(bmt, 0, 0);
+	bmtClearBranch(bmt, 0x0a000000, 0x1000000);
+	for (unsigned i = 0; i < OPS / 10; i++)
+		bmtSetBit(bmt, 0x0a000000 + (rnd() & 0xffffff));
+	for (unsigned i = 0; i < 0x8000; i++)
+		bmtClearBranch(bmt, 0x0a000000 + (rnd() & 0xffff00), 0x100);
+	start = nsNow();
+	unsigned subnets = 0;
+	while (bmtReserveBranch(bmt, 0x100, &offset) == 0)
+		subnets++;
+	report("reserve-subnet", start, subnets);
+	bmtDelete(bmt);
+
+	// Enumerate the free ranges of a mostly full ipv4 map
+	bmt = bmtCreate(1ULL << 32);
+	bmtSetBranch(bmt, 0, 0);
+	for (unsigned i = 0; i < OPS / 10; i++)
+		bmtClearBit(bmt, rnd() & 0xffffffff);
+	struct bmtCursor c;
+	uint64_t length;
+	unsigned runs = 0;
+	start = nsNow();
+	for (unsigned i = 0; i < 10; i++) {
+		bmtCursorInit(&c, bmt, 0, 0);
+		while (bmtCursorNext(&c, &offset, &length) == 0)
+			runs++;
+	}
+	report("free-runs", start, runs);
+	bmtDelete(bmt);
+
+	// Set algebra with a large (A) and a small (B) ipv4 map
+	struct BitmapTree* a = bmtCreate(1ULL << 32);
+	struct BitmapTree* b = bmtCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 10; i++)
+		bmtSetBit(a, rnd() & 0xffffffff);
+	for (unsigned i = 0; i < 100; i++)
+		bmtSetBranch(b, rnd() & 0xffffff00, 0x100);
+	start = nsNow();
+	for (unsigned i = 0; i < 1000; i++) {
+		bmt = bmtIntersectNew(a, b);
+		x += bmtOnes(bmt);
+		bmtDelete(bmt);
+	}
+	report("intersect-small", start, 1000);
+	start = nsNow();
+	for (unsigned i = 0; i < 1000; i++) {
+		bmtDifference(a, b);
+		bmtUnion(a, b);
+	}
+	report("difference-union", start, 2000);
+	bmtDelete(b);
+	bmtDelete(a);
+
+	// Snapshot, change and roll back a transaction in a large map
+	bmt = bmtCreate(1ULL << 32);
+	for (unsigned i = 0; i < OPS / 10; i++)
+		bmtSetBit(bmt, rnd() & 0xffffffff);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS / 100; i++) {
+		struct BitmapTree* snap = bmtClone(bmt);
+		for (unsigned j = 0; j < 10; j++)
+			bmtReserveBit(bmt, &offset);
+		bmtRestore(bmt, snap);
+		bmtDelete(snap);
+	}
+	report("snapshot-rollback", start, OPS / 100);
+	bmtDelete(bmt);
+
+	// Clone, compare, write and read a 2^30 map with random bits
+	bmt = bmtCreate(1ULL << 30);
+	f = flatCreate(1ULL << 30);
+	for (unsigned i = 0; i < OPS; i++) {
+		uint64_t o = rnd() & 0x3fffffff;
+		bmtSetBit(bmt, o);
+		flatSet(&f, o);
+	}
+	reportSize("large-map", bmt);
+	start = nsNow();
+	for (unsigned i = 0; i < 100; i++) {
+		struct BitmapTree* t = bmtClone(bmt);
+		bmtSetBit(t, rnd() & 0x3fffffff);
+		bmtDelete(t);
+	}
+	report("clone", start, 100);
+	struct flat f2 = flatCreate(1ULL << 30);
+	start = nsNow();
+	for (unsigned i = 0; i < 10; i++)
+		memcpy(f2.words, f.words, f.size / 8);
+	reportFlat("clone", start, 10);
+	buf = (struct buff){0};
+	bmtImageWrite(bmt, buffWrite, &buf);
+	img = bmtImageOpen(buf.data, buf.len);
+	start = nsNow();
+	for (unsigned i = 0; i < OPS; i++)
+		x += bmtImageBit(img, offsets[(i * 7) % OPS] & 0x3fffffff);
+	report("image-bit", start, OPS);
+	bmtImageClose(img);
+	free(buf.data);
+	buf = (struct buff){0};
+	start = nsNow();
+	bmtWrite(bmt, buffWrite, &buf);
+	report("write", start, 1);
+	start = nsNow();
+	struct BitmapTree* t = bmtRead(buffRead, &buf);
+	report("read", start, 1);
+	free(buf.data);
+	start = nsNow();
+	x += bmtCompare(bmt, t);
+	report("compare", start, 1);
+	bmtDelete(t);
+	buf = (struct buff){0};
+	start = nsNow();
+	buffWrite(&buf, f.words, f.size / 8);
+	reportFlat("write", start, 1);
+	start = nsNow();
+	buffRead(&buf, f2.words, f.size / 8);
+	reportFlat("read", start, 1);
+	free(buf.data);
+	start = nsNow();
+	x += memcmp(f.words, f2.words, f.size / 8) != 0;
+	reportFlat("compare", start, 1);
+	free(f2.words);
+	free(f.words);
+	bmtDelete(bmt);
+
+	// Create and delete many small trees
+	start = nsNow();
+	for (unsigned i = 0; i < OPS / 100; i++) {
+		bmt = bmtCreate(1ULL << 32);
+		for (unsigned j = 0; j < 100; j++)
+			bmtSetBit(bmt, offsets[(i * 100 + j) % OPS] & 0xffffffff);
+		bmtDelete(bmt);
+	}
+	report("create-set-delete", start, OPS);
+
+	sink = x;
+	if (json != NULL) {
+		fputs("\n]\n", json);
+		fclose(json);
+	}
+	return 0;
+}
@@ -5,6 +5,7 @@
 
 #include "bmt.h"
 #include <assert.h>
+#include <string.h>
 
 static void setbits(
 	struct BitmapTree* bmt, uint64_t offset, unsigned cnt, int value)
@@ -18,6 +19,464 @@ static void setbits(
 	}
 }
 
+// Random operations on a window of a BitmapTree compared with a plain
+// bitarray. The structure is compared with a tree built from scratch
+// to verify that it is always normalized.
+#define WINDOW 4096
+static unsigned rndr(void)
+{
+	static uint64_t x = 88172645463325252ULL;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+static unsigned leafLevel;		/* The random tests are run for all leaf sizes */
+static unsigned arrayMax, runsMax;	/* and with and without containers */
+static int node16;				/* and 16-way nodes */
+static struct BitmapTree* createFilled(uint64_t size, int fill)
+{
+	struct BitmapTree* bmt = bmtCreateWithLeaves(size, 64 << leafLevel, NULL);
+	bmtSetContainers(bmt, arrayMax, runsMax); /* (fails if size < 2^16) */
+	bmtSetNode16(bmt, node16);
+	if (fill)
+		bmtSetBranch(bmt, 0, 0);
+	return bmt;
+}
+// checkMaxFree - Verify the free block annotations and return the
+// largest free block (log2 + 1) in the subtree
+static unsigned checkMaxFree(struct bmtitem const* n, unsigned level)
+{
+	if (n == NULL || n == FULL || level == 0)
+		return itemMaxFree(n, level);
+	if (n->kind == KIND_NODE16) {
+		unsigned f = 0;
+		uint64_t ones = 0;
+		assert(level == n->level && level >= leafLevel + 4);
+		for (unsigned i = 0; i < 16; i++) {
+			struct bmtitem const* leg = n->node16->leg[i];
+			assert(leg != NULL && leg != FULL);
+			assert(n->node16->ones[i] == itemOnes(leg, level - 4));
+			assert(n->node16->maxfree[i] == checkMaxFree(leg, level - 4));
+			if (n->node16->maxfree[i] > f)
+				f = n->node16->maxfree[i];
+			ones += n->node16->ones[i];
+		}
+		assert(n->ones == ones);
+		assert(n->maxfree[0] == f && n->maxfree[1] == f);
+		return f;
+	}
+	if (n->kind != KIND_NODE) {
+		// Expand the container to words and check it as a leaf
+		static bitmap_t w[1024];
+		uint64_t ones = 0;
+		unsigned f = 0;
+		assert(level == CHUNK_LEVEL && n->cnt > 0);
+		memset(w, 0, sizeof(w));
+		unsigned first, last, prev = 0;
+		int runs = n->kind == KIND_RUNS;
+		for (uint32_t i = 0; i < n->cnt; i++) {
+			first = runs ? n->vals[2 * i] : n->vals[i];
+			last = runs ? n->vals[2 * i + 1] : first;
+			// Runs are separated, array values only sorted
+			assert(i == 0 || first > prev + runs);
+			assert(first <= last);
+			prev = last;
+			wordsSetRange(w, first, last, 1);
+			ones += last - first + 1;
+		}
+		for (unsigned i = 0; i < 1024; i++) {
+			if (leafMaxFree(w[i]) > f)
+				f = leafMaxFree(w[i]);
+		}
+		for (unsigned j = 1; j <= 10; j++) {
+			for (unsigned i = 0; i < 1024; i += 1 << j) {
+				unsigned k;
+				for (k = 0; k < (1u << j) && w[i + k] == 0; k++);
+				if (k == (1u << j))
+					f = BM_BITS + j + 1;
+			}
+		}
+		assert(n->ones == ones);
+		assert(n->maxfree[0] == f && n->maxfree[1] == f);
+		return f;
+	}
+	if (level == leafLevel) {
+		uint64_t ones = 0;
+		for (unsigned i = 0; i < (1u << level); i++)
+			ones += __builtin_popcountll(n->word[i]);
+		assert(n->ones == ones);
+		assert(n->maxfree[0] == wordsMaxFree(n->word, 1 << level));
+		return itemMaxFree(n, level);
+	}
+	if (n->skip > 0) {
+		assert(n->maxfree[0] == checkMaxFree(n->next, level - n->skip));
+	} else {
+		assert(n->maxfree[0] == checkMaxFree(n->zero, level - 1));
+		assert(n->maxfree[1] == checkMaxFree(n->one, level - 1));
+	}
+	return itemMaxFree(n, level);
+}
+// checkPool - Verify that all nodes are in the tree or in the free
+// list of a pool that is not shared. Bitmaps are kept in the legs.
+static void checkPool(struct BitmapTree* bmt)
+{
+	struct bmtslabs* sl = &bmt->pool->items;
+	uint64_t items = 0, free = 0;
+	for (struct bmtslab* s = sl->slabs; s != NULL; s = s->next)
+		items += (s->size - sizeof(struct bmtslab)) / sl->itemSize;
+	items -= ((char*)sl->end - (char*)sl->cursor) / sl->itemSize;
+	for (struct bmtitem* n = sl->freeList; n != NULL; n = n->nextFree)
+		free++;
+	assert(bmtNodes(bmt) - bmt->pool->count.items[0] + free == items);
+	// The maintained counts must match a walk (a clone shares the pool)
+	struct BitmapTree* c = bmtClone(bmt);
+	assert(bmtNodes(c) == bmtNodes(bmt));
+	assert(bmtLeaves(c) == bmtLeaves(bmt));
+	assert(bmtDepth(c) == bmtDepth(bmt));
+	assert(bmtSerializedSize(c) == bmtSerializedSize(bmt));
+	assert(bmtAllocated(c) == bmtAllocated(bmt));
+	bmtDelete(c);
+}
+// chunk - The item of the 2^16 bit chunk at 'offset'
+static struct bmtitem const* chunk(struct BitmapTree* bmt, uint64_t offset)
+{
+	struct bmtitem const* n = bmt->top;
+	unsigned level = bmt->levels;
+	while (level > CHUNK_LEVEL && n != NULL && n != FULL) {
+		if (n->skip > 0) {
+			if ((offset ^ n->prefix) & chainMask(n->level, n->skip))
+				return chainFill(n);
+			level -= n->skip;
+			n = n->next;
+		} else if (n->kind == KIND_NODE16) {
+			level -= 4;
+			n = n->node16->leg[node16Index(n, offset)];
+		} else {
+			level--;
+			n = n->leg[(offset >> (level + 6)) & 1];
+		}
+	}
+	assert(level == CHUNK_LEVEL);
+	return n;
+}
+// firstFree - The first free aligned block of 'k' bits in 'ref'
+static int firstFree(unsigned char const* ref, unsigned k)
+{
+	for (unsigned o = 0; o < WINDOW; o += k) {
+		if (memchr(ref + o, 1, k) == NULL)
+			return o;
+	}
+	return -1;
+}
+static void randomOps(uint64_t size, uint64_t base, unsigned ops, int fill)
+{
+	static unsigned char ref[WINDOW], snapRef[WINDOW];
+	struct BitmapTree* bmt = createFilled(size, fill);
+	struct BitmapTree* snap = NULL;
+	uint64_t offset, o, cnt;
+	int x;					/* Index in 'ref' */
+	memset(ref, fill, sizeof(ref));
+	for (unsigned i = 0; i < ops; i++) {
+		o = rndr() % WINDOW;
+		unsigned k = 1 << (rndr() % 10);
+		switch (rndr() % 11) {
+		case 0:
+			bmtSetBit(bmt, base + o);
+			ref[o] = 1;
+			break;
+		case 1:
+		case 2:
+			bmtClearBit(bmt, base + o);
+			ref[o] = 0;
+			break;
+		case 3:
+			o -= o % k;
+			assert(bmtSetBranch(bmt, base + o, k) == 0);
+			memset(ref + o, 1, k);
+			break;
+		case 4:
+			o -= o % k;
+			assert(bmtClearBranch(bmt, base + o, k) == 0);
+			memset(ref + o, 0, k);
+			break;
+		case 5:
+			if (bmtReserveBit(bmt, &offset) == 0) {
+				if (offset >= base && offset - base < WINDOW) {
+					assert(ref[offset - base] == 0);
+					ref[offset - base] = 1;
+				} else {
+					assert(!fill && offset < base);
+					bmtClearBit(bmt, offset);
+				}
+			} else {
+				assert(fill && memchr(ref, 0, WINDOW) == NULL);
+			}
+			break;
+		case 6:
+			x = firstFree(ref, k);
+			if (bmtReserveBranch(bmt, k, &offset) == 0) {
+				assert(offset % k == 0);
+				if (offset >= base && offset - base < WINDOW) {
+					assert(offset - base == x);
+					memset(ref + x, 1, k);
+				} else {
+					assert(!fill && offset < base);
+					assert(bmtClearBranch(bmt, offset, k) == 0);
+				}
+			} else {
+				assert(x < 0 && (fill || base == 0));
+			}
+			break;
+		case 8:
+		case 9: {
+			// Bulk set/clear. The offsets may wrap (unsorted) and
+			// have duplicates
+			uint64_t offsets[64];
+			int value = rndr() % 2;
+			for (x = 0; x < 64; x++) {
+				o = (o + rndr() % 64) % WINDOW;
+				offsets[x] = base + o;
+				ref[o] = value;
+			}
+			if (value)
+				bmtSetBits(bmt, offsets, 64);
+			else
+				bmtClearBits(bmt, offsets, 64);
+			break;
+		}
+		case 10: {
+			// Unaligned range
+			uint64_t last = o + rndr() % (WINDOW - o);
+			if (last - o > 600)
+				last = o + rndr() % 600;
+			int value = rndr() % 2;
+			if (value)
+				assert(bmtSetRange(bmt, base + o, base + last) == 0);
+			else
+				assert(bmtClearRange(bmt, base + o, base + last) == 0);
+			memset(ref + o, value, last - o + 1);
+			break;
+		}
+		case 7:
+			if (bmtReserveBitFrom(bmt, base + o, &offset) == 0) {
+				if (offset >= base && offset - base < WINDOW) {
+					x = offset - base;
+					assert(ref[x] == 0);
+					if (x >= o) {
+						assert(memchr(ref + o, 0, x - o) == NULL);
+					} else {
+						assert(memchr(ref + o, 0, WINDOW - o) == NULL);
+						assert(memchr(ref, 0, x) == NULL);
+					}
+					ref[x] = 1;
+				} else {
+					assert(!fill && memchr(ref + o, 0, WINDOW - o) == NULL);
+					bmtClearBit(bmt, offset);
+				}
+			} else {
+				assert(fill && memchr(ref, 0, WINDOW) == NULL);
+			}
+			break;
+		}
+		if (i % 64 != 0)
+			continue;
+		struct BitmapTree* bmt2 = createFilled(size, fill);
+		for (o = 0, cnt = 0; o < WINDOW; o++) {
+			assert(bmtBit(bmt, base + o) == ref[o]);
+			if (ref[o]) {
+				bmtSetBit(bmt2, base + o);
+				cnt++;
+			} else {
+				bmtClearBit(bmt2, base + o);
+			}
+		}
+		if (!fill)
+			assert(bmtOnes(bmt) == cnt);
+		else if (size != 0)
+			assert(bmtOnes(bmt) == size - WINDOW + cnt);
+		assert(bmtCompare(bmt, bmt2) == 0);
+		// Equal bitarrays have equal trees (containers depend on history)
+		assert(arrayMax > 0 || bmtNodes(bmt) == bmtNodes(bmt2));
+		checkMaxFree(bmt->top, bmt->levels);
+		uint64_t offsets[WINDOW / 16];
+		uint8_t values[WINDOW / 16];
+		for (x = 0, cnt = 0; x < WINDOW / 16; x++) {
+			offsets[x] = base + x * 16 + (rndr() % 16);
+			cnt += ref[offsets[x] - base];
+		}
+		assert(bmtTestBits(bmt, offsets, WINDOW / 16, values) == cnt);
+		for (x = 0; x < WINDOW / 16; x++)
+			assert(values[x] == ref[offsets[x] - base]);
+		bmtDelete(bmt2);
+
+		// Snapshots must not be affected by later changes
+		if (snap != NULL) {
+			for (o = 0; o < WINDOW; o++)
+				assert(bmtBit(snap, base + o) == snapRef[o]);
+			checkMaxFree(snap->top, snap->levels);
+			if (rndr() % 2) {
+				assert(bmtRestore(bmt, snap) == 0);
+				memcpy(ref, snapRef, WINDOW);
+			}
+			if (rndr() % 2) {
+				bmtDelete(snap);
+				snap = NULL;
+			}
+		} else if (rndr() % 2) {
+			checkPool(bmt);
+			snap = bmtClone(bmt);
+			memcpy(snapRef, ref, WINDOW);
+		}
+
+		// Rank and select
+		if (i % 512 != 0)
+			continue;
+		uint64_t rank = fill ? base : 0;
+		uint64_t zeros = fill ? 0 : base;
+		for (o = 0; o < WINDOW; o++) {
+			if ((o & 0x3f) == 0)
+				assert(bmtRank(bmt, base + o) == rank);
+			if (ref[o]) {
+				assert(bmtSelect(bmt, rank, &offset) == 0);
+				assert(offset == base + o);
+				rank++;
+			} else {
+				assert(bmtSelectZero(bmt, zeros, &offset) == 0);
+				assert(offset == base + o);
+				zeros++;
+			}
+		}
+		if (base + WINDOW != 0)
+			assert(bmtRank(bmt, base + WINDOW) == rank);
+		if (size == WINDOW) {
+			assert(bmtSelect(bmt, rank, &offset) != 0);
+			assert(bmtSelectZero(bmt, zeros, &offset) != 0);
+		}
+
+		// Next set/clear
+		for (o = 0; o < WINDOW; o += 7) {
+			uint64_t x;
+			for (x = o; x < WINDOW && ref[x] != 1; x++);
+			if (x < WINDOW) {
+				assert(bmtNextSet(bmt, base + o, &offset) == 0);
+				assert(offset == base + x);
+			} else if (!fill && base + WINDOW == 0) {
+				assert(bmtNextSet(bmt, base + o, &offset) != 0);
+			}
+			for (x = o; x < WINDOW && ref[x] != 0; x++);
+			if (x < WINDOW) {
+				assert(bmtNextClear(bmt, base + o, &offset) == 0);
+				assert(offset == base + x);
+			}
+		}
+
+		// Runs of the non-fill value are inside the window
+		struct bmtCursor c;
+		uint64_t length;
+		bmtCursorInit(&c, bmt, 0, !fill);
+		for (o = 0; bmtCursorNext(&c, &offset, &length) == 0;) {
+			assert(offset >= base && offset - base + length <= WINDOW);
+			for (; o < offset - base; o++)
+				assert(ref[o] == fill);
+			for (; o < offset - base + length; o++)
+				assert(ref[o] == !fill);
+		}
+		for (; o < WINDOW; o++)
+			assert(ref[o] == fill);
+	}
+	bmtDelete(snap);
+	bmtDelete(bmt);
+}
+
+// Set algebra on random trees compared with plain bitarrays. Outside
+// the window the trees are all 'fill'.
+static struct BitmapTree* randomTree(
+	uint64_t size, uint64_t base, int fill, unsigned char* ref)
+{
+	struct BitmapTree* bmt = createFilled(size, fill);
+	memset(ref, fill, WINDOW);
+	for (unsigned i = 0; i < 50; i++) {
+		uint64_t o = rndr() % WINDOW;
+		uint64_t last = o + rndr() % (WINDOW - o);
+		if (last - o > 300)
+			last = o + rndr() % (rndr() % 2 ? 300 : 3);
+		int value = rndr() % 2;
+		if (value)
+			assert(bmtSetRange(bmt, base + o, base + last) == 0);
+		else
+			assert(bmtClearRange(bmt, base + o, base + last) == 0);
+		memset(ref + o, value, last - o + 1);
+	}
+	return bmt;
+}
+static int refOp(int op, int a, int b)
+{
+	switch (op) {
+	case 0: return a | b;
+	case 1: return a & b;
+	case 2: return a & !b;
+	default: return a ^ b;
+	}
+}
+static void randomAlgebra(uint64_t size, uint64_t base)
+{
+	static unsigned char refa[WINDOW], refb[WINDOW];
+	int (*inPlace[])(struct BitmapTree*, struct BitmapTree*) = {
+		bmtUnion, bmtIntersect, bmtDifference, bmtXor};
+	struct BitmapTree* (*newTree[])(struct BitmapTree*, struct BitmapTree*) = {
+		bmtUnionNew, bmtIntersectNew, bmtDifferenceNew, bmtXorNew};
+	for (unsigned i = 0; i < 64; i++) {
+		int op = i % 4, filla = rndr() % 2, fillb = rndr() % 2;
+		struct BitmapTree* a = randomTree(size, base, filla, refa);
+		struct BitmapTree* b = randomTree(size, base, fillb, refb);
+		struct BitmapTree* c = newTree[op](a, b);
+		assert(inPlace[op](a, b) == 0);
+		assert(bmtCompare(a, c) == 0);
+		int fill = refOp(op, filla, fillb);
+		struct BitmapTree* ref = createFilled(size, fill);
+		uint64_t cnt = 0;
+		for (uint64_t o = 0; o < WINDOW; o++) {
+			int v = refOp(op, refa[o], refb[o]);
+			assert(bmtBit(a, base + o) == v);
+			if (v)
+				bmtSetBit(ref, base + o);
+			else
+				bmtClearBit(ref, base + o);
+			cnt += v;
+		}
+		assert(bmtCompare(a, ref) == 0);
+		if (size != 0)
+			assert(bmtOnes(a) == (fill ? size - WINDOW : 0) + cnt);
+		checkMaxFree(a->top, a->levels);
+		checkMaxFree(c->top, c->levels);
+		bmtDelete(ref);
+		bmtDelete(c);
+		bmtDelete(b);
+		bmtDelete(a);
+	}
+}
+
+struct allocStats {
+	unsigned allocs;
+	unsigned frees;
+	size_t bytes;
+};
+static void* countingAlloc(void* userRef, size_t size)
+{
+	struct allocStats* s = userRef;
+	s->allocs++;
+	s->bytes += size;
+	return malloc(size);
+}
+static void countingFree(void* userRef, void* mem, size_t size)
+{
+	struct allocStats* s = userRef;
+	s->frees++;
+	s->bytes -= size;
+	free(mem);
+}
+
 int main(int argc, char* argv[])
 {
 	struct BitmapTree* bmt;
@@ -68,8 +527,11 @@ int main(int argc, char* argv[])
 	bmtSetBit(bmt, UINT64_MAX);
 	D(bmtPrint(bmt);printf("---\n"));
 	assert(bmtBit(bmt, UINT64_MAX) == 1);
-	assert(bmtNodes(bmt) == 59);
+	assert(bmtNodes(bmt) == 2);	/* A chain and a bitmap */
+	assert(bmtDepth(bmt) == 59);
 	D(printf("bmtAllocated()=%lu\n", bmtAllocated(bmt)));
+	assert(bmtAllocated(bmt) == sizeof(struct BitmapTree) +
+		   sizeof(struct bmtpool) + sizeof(struct bmtitem));
 	bmtClearBit(bmt, UINT64_MAX);
 	assert(bmtNodes(bmt) == 0);
 	bmtSetBit(bmt, 1024*8);
@@ -83,9 +545,19 @@ int main(int argc, char* argv[])
 	bmtSetBit(bmt, 63);
 	assert(bmtOnes(bmt) == 1);
 	assert(bmtNodes(bmt) == 1);
+	assert(bmtDepth(bmt) == 1);
 	bmtClearBit(bmt, 63);
 	assert(bmtOnes(bmt) == 0);
 	assert(bmtNodes(bmt) == 0);	
+	assert(bmtDepth(bmt) == 0);
+	bmtDelete(bmt);
+	// A smaller size is one bitmap
+	bmt = bmtCreate(16);
+	assert(bmtSize(bmt) == 64);
+	bmtSetBit(bmt, 15);
+	bmtSetBit(bmt, 16);
+	assert(bmtOnes(bmt) == 2);
+	assert(bmtNodes(bmt) == 1);
 	bmtDelete(bmt);
 
 	// Node create/delete;
@@ -94,6 +566,7 @@ int main(int argc, char* argv[])
 	bmtSetBit(bmt, 64);
 	assert(bmtOnes(bmt) == 1);
 	assert(bmtNodes(bmt) == 2);
+	assert(bmtDepth(bmt) == 2);
 	assert(bmtBit(bmt, 64) == 1);
 	setbits(bmt, 64, 64, 1);
 	assert(bmtNodes(bmt) == 1);
@@ -113,7 +586,7 @@ int main(int argc, char* argv[])
 	bmt = bmtCreate(256);
 	setbits(bmt, 0, 64, 1);
 	assert(bmtOnes(bmt) == 64);
-	assert(bmtNodes(bmt) == 2);
+	assert(bmtNodes(bmt) == 1);
 	assert(bmtReserveBit(bmt, &offset) == 0);
 	assert(offset == 64);
 	assert(bmtOnes(bmt) == 65);
@@ -144,7 +617,7 @@ int main(int argc, char* argv[])
 	assert(bmtNodes(bmt) == 3);
 	assert(bmtClearBranch(bmt, 32, 32) == 0);
 	assert(bmtOnes(bmt) == 64);
-	assert(bmtNodes(bmt) == 2);
+	assert(bmtNodes(bmt) == 1);
 	bmtDelete(bmt);
 
 	// Branch set/clear in full array;
@@ -198,6 +671,90 @@ int main(int argc, char* argv[])
 	assert(bmtOnes(bmt) == UINT64_MAX);
 	bmtDelete(bmt);
 
+	// Ranges;
+	bmt = bmtCreate(1ULL << 32);
+	assert(bmtSetRange(bmt, 2, 1) != 0);
+	assert(bmtSetRange(bmt, 0, 1ULL << 32) != 0);
+	assert(bmtSetRange(bmt, 0x0a010211, 0x0a0109c8) == 0);
+	assert(bmtOnes(bmt) == 0x0a0109c8 - 0x0a010211 + 1);
+	assert(bmtNextSet(bmt, 0, &offset) == 0);
+	assert(offset == 0x0a010211);
+	assert(bmtNextClear(bmt, offset, &offset) == 0);
+	assert(offset == 0x0a0109c9);
+	assert(bmtClearRange(bmt, 0x0a010300, 0x0a0108ff) == 0);
+	assert(bmtOnes(bmt) == 0x300 - 0x211 + 0x9c8 - 0x900 + 1);
+	assert(bmtSetRange(bmt, 0, 0xffffffff) == 0);
+	assert(bmtNodes(bmt) == 0);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	assert(bmtSetRange(bmt, 0, UINT64_MAX) == 0);
+	assert(bmtOnes(bmt) == UINT64_MAX);
+	assert(bmtClearRange(bmt, 1, UINT64_MAX - 1) == 0);
+	assert(bmtOnes(bmt) == 2);
+	assert(bmtClearRange(bmt, UINT64_MAX, UINT64_MAX) == 0);
+	assert(bmtOnes(bmt) == 1);
+	bmtDelete(bmt);
+
+	// Reserve from a hint and next-fit;
+	bmt = bmtCreate(256);
+	assert(bmtSetBranch(bmt, 0, 64) == 0);
+	assert(bmtReserveBitFrom(bmt, 10, &offset) == 0);
+	assert(offset == 64);
+	assert(bmtReserveBitFrom(bmt, 200, &offset) == 0);
+	assert(offset == 200);
+	assert(bmtReserveBitFrom(bmt, 1000, &offset) == 0); /* Wraps */
+	assert(offset == 65);
+	for (x = 66; x < 256; x++) {
+		assert(bmtReserveNextFit(bmt, &offset) == 0);
+		assert(offset == (x < 200 ? x : x + 1));
+		if (offset == 255)
+			break;
+	}
+	bmtClearBit(bmt, 100);
+	bmtClearBit(bmt, 5);
+	assert(bmtReserveNextFit(bmt, &offset) == 0);
+	assert(offset == 5);
+	assert(bmtReserveNextFit(bmt, &offset) == 0);
+	assert(offset == 100);
+	assert(bmtReserveNextFit(bmt, &offset) != 0);
+	assert(bmtReserveBitFrom(bmt, 0, &offset) != 0);
+	bmtDelete(bmt);
+
+	// Reserve branch;
+	bmt = bmtCreate(256);
+	assert(bmtReserveBranch(bmt, 3, &offset) != 0);
+	assert(bmtReserveBranch(bmt, 512, &offset) != 0);
+	bmtSetBit(bmt, 1);
+	assert(bmtReserveBranch(bmt, 2, &offset) == 0);
+	assert(offset == 2);
+	assert(bmtReserveBranch(bmt, 1, &offset) == 0);
+	assert(offset == 0);
+	assert(bmtReserveBranch(bmt, 64, &offset) == 0);
+	assert(offset == 64);
+	assert(bmtReserveBranch(bmt, 128, &offset) == 0);
+	assert(offset == 128);
+	assert(bmtReserveBranch(bmt, 64, &offset) != 0);
+	assert(bmtReserveBranch(bmt, 4, &offset) == 0);
+	assert(offset == 4);
+	assert(bmtOnes(bmt) == 8+64+128);
+	assert(bmtClearBranch(bmt, 0, 0) == 0);
+	assert(bmtReserveBranch(bmt, 0, &offset) == 0);
+	assert(offset == 0);
+	assert(bmtReserveBranch(bmt, 0, &offset) != 0);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	bmtSetBit(bmt, 0x0a000001);
+	assert(bmtReserveBranch(bmt, 0x1000000, &offset) == 0);
+	assert(offset == 0);
+	assert(bmtReserveBranch(bmt, 0x1000000, &offset) == 0);
+	assert(offset == 0x1000000);
+	assert(bmtReserveBranch(bmt, 0x8000000000000000ULL, &offset) == 0);
+	assert(offset == 0x8000000000000000ULL);
+	assert(bmtReserveBranch(bmt, 0x8000000000000000ULL, &offset) != 0);
+	assert(bmtReserveBranch(bmt, 0x100, &offset) == 0);
+	assert(offset == 0x2000000);
+	bmtDelete(bmt);
+
 	// Clone and compare;
 	bmt = bmtCreate(1024);
 	assert(bmtSetBranch(bmt, 0, 256) == 0);
@@ -209,9 +766,425 @@ int main(int argc, char* argv[])
 	assert(bmtCompare(bmt, bmt2) == 0);
 	assert(bmtReserveBit(bmt, &offset) == 0);
 	assert(bmtCompare(bmt, bmt2) != 0);
+	assert(bmtOnes(bmt2) == 256+128+2);
+	assert(bmtRestore(bmt, bmt2) == 0); /* Rollback */
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtBit(bmt, offset) == 0);
+	bmtDelete(bmt2);
+	bmt2 = bmtCreate(1024);
+	assert(bmtRestore(bmt, bmt2) != 0);
 	bmtDelete(bmt2);
 	bmtDelete(bmt);
 
+	// Set algebra;
+	for (leafLevel = 0; leafLevel < 4; leafLevel++) {
+		randomAlgebra(WINDOW, 0);
+		randomAlgebra(1ULL << 32, 0x0a000000);
+		randomAlgebra(0, 0x5555555555555000ULL);
+	}
+	leafLevel = 0;
+	bmt = bmtCreate(256);
+	bmt2 = bmtCreate(512);
+	assert(bmtUnion(bmt, bmt2) != 0);
+	assert(bmtXorNew(bmt, bmt2) == NULL);
+	bmtDelete(bmt2);
+	assert(bmtSetRange(bmt, 10, 100) == 0);
+	assert(bmtUnion(bmt, bmt) == 0);
+	assert(bmtOnes(bmt) == 91);
+	bmt2 = bmtXorNew(bmt, bmt);
+	assert(bmtOnes(bmt2) == 0);
+	assert(bmtXor(bmt, bmt) == 0);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// Random operations;
+	for (leafLevel = 0; leafLevel < 4; leafLevel++) {
+		for (int fill = 0; fill < 2; fill++) {
+			randomOps(WINDOW, 0, 20000, fill);
+			randomOps(1ULL << 32, 0x0a000000, 20000, fill);
+			randomOps(0, UINT64_MAX - WINDOW + 1, 20000, fill);
+			randomOps(0, 0x5555555555555000ULL, 20000, fill);
+		}
+	}
+	leafLevel = 0;
+	// (default and small container limits)
+	unsigned limits[][2] = {{4096, 2048}, {64, 32}};
+	for (unsigned l = 0; l < 2; l++) {
+		arrayMax = limits[l][0];
+		runsMax = limits[l][1];
+		for (leafLevel = 0; leafLevel < 4; leafLevel += 2) {
+			for (int fill = 0; fill < 2; fill++) {
+				randomOps(1ULL << 32, 0x0a000000, 20000, fill);
+				randomOps(0, 0x5555555555555000ULL, 20000, fill);
+			}
+			randomAlgebra(1ULL << 32, 0x0a000000);
+			randomAlgebra(0, 0x5555555555555000ULL);
+		}
+	}
+	// (16-way nodes, without and with containers)
+	node16 = 1;
+	for (unsigned l = 0; l < 2; l++) {
+		arrayMax = l * 64;
+		runsMax = l * 32;
+		for (leafLevel = 0; leafLevel < 4; leafLevel++) {
+			for (int fill = 0; fill < 2; fill++) {
+				randomOps(WINDOW, 0, 20000, fill);
+				randomOps(1ULL << 32, 0x0a000000, 20000, fill);
+				randomOps(0, 0x5555555555555000ULL, 20000, fill);
+			}
+			randomAlgebra(1ULL << 32, 0x0a000000);
+		}
+	}
+	node16 = 0;
+	leafLevel = arrayMax = runsMax = 0;
+
+	// Rank and select;
+	bmt = bmtCreate(0);
+	assert(bmtRank(bmt, UINT64_MAX) == 0);
+	assert(bmtSelect(bmt, 0, &offset) != 0);
+	assert(bmtSelectZero(bmt, UINT64_MAX, &offset) == 0);
+	assert(offset == UINT64_MAX);
+	assert(bmtSetBranch(bmt, 0, 0) == 0);
+	assert(bmtRank(bmt, UINT64_MAX) == UINT64_MAX);
+	assert(bmtSelect(bmt, 1234, &offset) == 0);
+	assert(offset == 1234);
+	bmtClearBit(bmt, 1000);
+	assert(bmtOnes(bmt) == UINT64_MAX);
+	assert(bmtRank(bmt, UINT64_MAX) == UINT64_MAX - 1);
+	assert(bmtSelect(bmt, 1234, &offset) == 0);
+	assert(offset == 1235);
+	assert(bmtSelectZero(bmt, 0, &offset) == 0);
+	assert(offset == 1000);
+	assert(bmtSelectZero(bmt, 1, &offset) != 0);
+	bmtDelete(bmt);
+	bmt = bmtCreate(1ULL << 32);
+	assert(bmtSetBranch(bmt, 0x80000000, 0x80000000) == 0);
+	bmtSetBit(bmt, 77);
+	assert(bmtOnes(bmt) == 0x80000001);
+	assert(bmtRank(bmt, 78) == 1);
+	assert(bmtRank(bmt, 0x80000010) == 0x11);
+	assert(bmtSelect(bmt, 1, &offset) == 0);
+	assert(offset == 0x80000000);
+	assert(bmtSelectZero(bmt, 77, &offset) == 0);
+	assert(offset == 78);
+	bmtDelete(bmt);
+
+	// Next set/clear and cursor;
+	bmt = bmtCreate(0);
+	assert(bmtNextSet(bmt, 0, &offset) != 0);
+	assert(bmtNextClear(bmt, UINT64_MAX, &offset) == 0);
+	assert(offset == UINT64_MAX);
+	struct bmtCursor c;
+	uint64_t length;
+	bmtCursorInit(&c, bmt, 0, 0);
+	assert(bmtCursorNext(&c, &offset, &length) == 0);
+	assert(offset == 0 && length == 0); /* 2^64 */
+	assert(bmtCursorNext(&c, &offset, &length) != 0);
+	assert(bmtSetBranch(bmt, 0, 0) == 0);
+	assert(bmtClearBranch(bmt, 0x1000, 0x1000) == 0);
+	bmtClearBit(bmt, UINT64_MAX);
+	assert(bmtNextClear(bmt, 0, &offset) == 0);
+	assert(offset == 0x1000);
+	assert(bmtNextClear(bmt, 0x2000, &offset) == 0);
+	assert(offset == UINT64_MAX);
+	assert(bmtNextSet(bmt, 0x1000, &offset) == 0);
+	assert(offset == 0x2000);
+	assert(bmtNextSet(bmt, UINT64_MAX, &offset) != 0);
+	bmtCursorInit(&c, bmt, 0x1800, 0);
+	assert(bmtCursorNext(&c, &offset, &length) == 0);
+	assert(offset == 0x1800 && length == 0x800);
+	assert(bmtCursorNext(&c, &offset, &length) == 0);
+	assert(offset == UINT64_MAX && length == 1);
+	assert(bmtCursorNext(&c, &offset, &length) != 0);
+	bmtCursorInit(&c, bmt, 0, 1);
+	assert(bmtCursorNext(&c, &offset, &length) == 0);
+	assert(offset == 0 && length == 0x1000);
+	assert(bmtCursorNext(&c, &offset, &length) == 0);
+	assert(offset == 0x2000 && length == UINT64_MAX - 0x2000);
+	assert(bmtCursorNext(&c, &offset, &length) != 0);
+	bmtDelete(bmt);
+
+	// Bulk operations;
+	bmt = bmtCreate(256);
+	uint64_t offsets[] = {0, 1, 63, 64, 200, 255, 256, 1000};
+	uint8_t values[8];
+	bmtSetBits(bmt, offsets, 8);	/* (256 and 1000 are ignored) */
+	assert(bmtOnes(bmt) == 6);
+	assert(bmtTestBits(bmt, offsets, 8, values) == 6);
+	assert(memcmp(values, "\1\1\1\1\1\1\0\0", 8) == 0);
+	uint64_t unsorted[] = {255, 0, 64, 2, 1000};
+	bmtClearBits(bmt, unsorted, 5);
+	assert(bmtOnes(bmt) == 3);
+	assert(bmtTestBits(bmt, unsorted, 5, values) == 0);
+	assert(bmtTestBits(bmt, offsets, 8, NULL) == 3);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	bmt2 = bmtCreate(0);
+	uint64_t many[10000];
+	for (x = 0; x < 10000; x++) {
+		many[x] = x * x * 123457;
+		bmtSetBit(bmt2, many[x]);
+	}
+	bmtSetBits(bmt, many, 10000);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt) == 10000);
+	assert(bmtTestBits(bmt, many, 10000, NULL) == 10000);
+	bmtClearBits(bmt, many, 5000);
+	assert(bmtOnes(bmt) == 5000);
+	assert(bmtSetBranch(bmt, 0, 0) == 0);
+	bmtClearBits(bmt, many, 10000);
+	assert(bmtOnes(bmt) == UINT64_MAX - 9999);
+	assert(bmtTestBits(bmt, many, 10000, NULL) == 0);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// Leaf size;
+	assert(bmtCreateWithLeaves(0, 32, NULL) == NULL);
+	assert(bmtCreateWithLeaves(0, 96, NULL) == NULL);
+	assert(bmtCreateWithLeaves(0, 1024, NULL) == NULL);
+	assert(bmtCreateWithLeaves(128, 256, NULL) == NULL);
+	bmt = bmtCreateWithLeaves(1024, 256, NULL);
+	assert(bmtLeafBits(bmt) == 256);
+	bmtSetBit(bmt, 1000);
+	bmtSetRange(bmt, 256, 511);
+	assert(bmtOnes(bmt) == 257);
+	assert(bmtReserveBranch(bmt, 128, &offset) == 0);
+	assert(offset == 0);
+	assert(bmtReserveBranch(bmt, 128, &offset) == 0);
+	assert(offset == 128);
+	assert(bmtNodes(bmt) == 3);
+	assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(offset == 512);
+	assert(bmtNextSet(bmt, 700, &offset) == 0);
+	assert(offset == 1000);
+	bmt2 = bmtCreate(1024);
+	assert(bmtCompare(bmt, bmt2) != 0);
+	assert(bmtUnion(bmt, bmt2) != 0);
+	assert(bmtUnionNew(bmt, bmt2) == NULL);
+	bmtDelete(bmt2);
+	bmt2 = bmtClone(bmt);
+	assert(bmtLeafBits(bmt2) == 256);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	assert(bmtLeafBits(bmt) == 64);
+	bmtDelete(bmt);
+
+	// Containers;
+	bmt = bmtCreate(1024);
+	assert(bmtSetContainers(bmt, 4096, 2048) != 0);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	assert(bmtSetContainers(bmt, 65536, 0) != 0);
+	assert(bmtSetContainers(bmt, 0, 32769) != 0);
+	bmtSetBit(bmt, 5);
+	assert(bmtSetContainers(bmt, 16, 8) != 0); /* Not empty */
+	bmtClearBit(bmt, 5);
+	bmt2 = bmtClone(bmt);
+	assert(bmtSetContainers(bmt, 16, 8) != 0); /* Shared */
+	bmtDelete(bmt2);
+	assert(bmtSetContainers(bmt, 16, 8) == 0);
+	bmt2 = bmtCreate(0);
+	for (x = 0; x < 16; x++) {
+		bmtSetBit(bmt, 0x30000 + x * 100);
+		bmtSetBit(bmt2, 0x30000 + x * 100);
+	}
+	assert(chunk(bmt, 0x30000)->kind == KIND_ARRAY);
+	assert(bmtNodes(bmt) == 2);
+	assert(bmtAllocated(bmt) < bmtAllocated(bmt2));
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtBit(bmt, 0x30000 + 500) == 1);
+	assert(bmtBit(bmt, 0x30000 + 501) == 0);
+	assert(bmtRank(bmt, 0x30000 + 501) == 6);
+	assert(bmtSelect(bmt, 6, &offset) == 0);
+	assert(offset == 0x30000 + 600);
+	assert(bmtSelectZero(bmt, 0x30001, &offset) == 0);
+	assert(offset == 0x30002);
+	assert(bmtNextSet(bmt, 0x30000 + 501, &offset) == 0);
+	assert(offset == 0x30000 + 600);
+	// Too many values and runs for a container
+	bmtSetBit(bmt, 0x30000 + 1234);
+	assert(chunk(bmt, 0x30000)->kind == KIND_NODE);
+	bmtClearBit(bmt, 0x30000 + 1234);
+	assert(chunk(bmt, 0x30000)->kind == KIND_ARRAY);
+	// Few runs
+	assert(bmtSetRange(bmt, 0x40000, 0x4ffff) == 0);
+	assert(chunk(bmt, 0x40000) == FULL);
+	for (x = 1; x < 8; x++)
+		bmtClearBit(bmt, 0x40000 + x * 1000);
+	assert(chunk(bmt, 0x40000)->kind == KIND_RUNS);
+	assert(chunk(bmt, 0x40000)->cnt == 8);
+	assert(bmtNextClear(bmt, 0x40000, &offset) == 0);
+	assert(offset == 0x40000 + 1000);
+	assert(bmtRank(bmt, 0x40000 + 2500) == 16 + 2500 - 2);
+	bmtClearBit(bmt, 0x40000 + 1001);	/* Extends a gap */
+	assert(chunk(bmt, 0x40000)->kind == KIND_RUNS);
+	bmtClearBit(bmt, 0x40000 + 9000);
+	assert(chunk(bmt, 0x40000)->kind == KIND_NODE);
+	bmtSetBit(bmt, 0x40000 + 9000);
+	assert(chunk(bmt, 0x40000)->kind == KIND_NODE); /* 8 '0's */
+	bmtSetBit(bmt, 0x40000 + 1001);
+	assert(chunk(bmt, 0x40000)->kind == KIND_RUNS);
+	assert(bmtReserveBitFrom(bmt, 0x40000, &offset) == 0);
+	assert(offset == 0x40000 + 1000);
+	assert(bmtOnes(bmt) == 16 + 0x10000 - 6);
+	checkMaxFree(bmt->top, bmt->levels);
+	// Operations on a tree without containers
+	struct BitmapTree* bmt3 = bmtUnionNew(bmt, bmt2);
+	assert(chunk(bmt3, 0x40000)->kind == KIND_RUNS);
+	assert(bmtCompare(bmt, bmt3) == 0);
+	bmtDelete(bmt3);
+	assert(bmtUnion(bmt2, bmt) == 0);
+	assert(chunk(bmt2, 0x40000)->kind == KIND_NODE);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtXor(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt) == 0);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+	// A chunk tree
+	bmt = bmtCreate(0x10000);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	assert(bmtSetRange(bmt, 0, 1000) == 0);
+	bmtClearBit(bmt, 500);
+	assert(bmt->top->kind == KIND_ARRAY);
+	assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(offset == 500);
+	assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(offset == 1001);
+	assert(bmtReserveBranch(bmt, 64, &offset) == 0);
+	assert(offset == 1024);
+	assert(bmtOnes(bmt) == 1002 + 64);
+	assert(bmt->top->kind == KIND_ARRAY);
+	bmtDelete(bmt);
+
+	// 16-way nodes;
+	bmt = bmtCreate(1 << 20);
+	bmt2 = bmtCreate(1 << 20);
+	assert(bmtSetNode16(bmt, 1) == 0);
+	for (x = 0; x < (1 << 14); x++) {
+		bmtSetBit(bmt, x * 64 + x % 61);
+		bmtSetBit(bmt2, x * 64 + x % 61);
+	}
+	assert(chunk(bmt, 0)->zero->zero->kind == KIND_NODE16);
+	assert(chunk(bmt2, 0)->zero->zero->kind == KIND_NODE);
+	assert(bmtNodes(bmt) < bmtNodes(bmt2));
+	assert(bmtCompare(bmt, bmt2) == 0);
+	checkMaxFree(bmt->top, bmt->levels);
+	checkPool(bmt);
+	for (unsigned i = 0; i < 2000; i++) {
+		uint64_t o1, o2;
+		x = rndr() & 0xfffff;
+		assert(bmtBit(bmt, x) == bmtBit(bmt2, x));
+		assert(bmtRank(bmt, x) == bmtRank(bmt2, x));
+		assert(bmtSelect(bmt, x & 0x3fff, &o1) == 0);
+		assert(bmtSelect(bmt2, x & 0x3fff, &o2) == 0 && o1 == o2);
+		assert(bmtSelectZero(bmt, x & 0x7ffff, &o1) == 0);
+		assert(bmtSelectZero(bmt2, x & 0x7ffff, &o2) == 0 && o1 == o2);
+		assert(bmtNextSet(bmt, x, &o1) == bmtNextSet(bmt2, x, &o2));
+		assert(o1 == o2);
+	}
+	// A leg that becomes NULL expands the 16-way node
+	bmtClearBit(bmt, 0);
+	assert(chunk(bmt, 0)->zero->zero->kind == KIND_NODE16);
+	assert(chunk(bmt, 0)->zero->zero->node16->leg[0]->kind == KIND_NODE);
+	bmtSetBit(bmt, 0);
+	assert(chunk(bmt, 0)->zero->zero->node16->leg[0]->kind == KIND_NODE16);
+	assert(bmtReserveBranch(bmt, 32, &offset) == 0);
+	assert(bmtReserveBranch(bmt2, 32, &x) == 0 && offset == x);
+	assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(bmtReserveBit(bmt2, &x) == 0 && offset == x);
+	// Not on a shared tree. Turning them on and off converts the tree
+	bmt3 = bmtClone(bmt2);
+	assert(bmtSetNode16(bmt2, 1) != 0);
+	bmtDelete(bmt3);
+	assert(bmtSetNode16(bmt2, 1) == 0);
+	assert(bmtNodes(bmt2) == bmtNodes(bmt));
+	checkMaxFree(bmt2->top, bmt2->levels);
+	checkPool(bmt2);
+	assert(bmtSetNode16(bmt, 0) == 0);
+	assert(bmtSetNode16(bmt2, 0) == 0);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtNodes(bmt) == bmtNodes(bmt2));
+	checkPool(bmt);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// User allocator;
+	struct allocStats stats = {0};
+	struct bmtAllocator allocator = {countingAlloc, countingFree, &stats};
+	bmt = bmtCreateWithAllocator(0, &allocator);
+	assert(stats.allocs == 0);
+	for (x = 0; x < 10000; x++)
+		bmtSetBit(bmt, x * 1000);
+	assert(bmtOnes(bmt) == 10000);
+	assert(stats.allocs > 1);
+	unsigned allocs = stats.allocs;
+	for (x = 0; x < 10000; x++)
+		bmtClearBit(bmt, x * 1000);
+	assert(bmtNodes(bmt) == 0);
+	for (x = 0; x < 10000; x++)
+		bmtSetBit(bmt, x * 1000 + 1);
+	assert(stats.allocs == allocs); /* Freed nodes are re-used */
+	bmt2 = bmtClone(bmt);
+	assert(stats.allocs == allocs); /* The clone shares the nodes */
+	assert(bmtCompare(bmt, bmt2) == 0);
+	for (x = 0; x < 10000; x++)
+		bmtSetBit(bmt2, x * 1000 + 2);
+	assert(stats.allocs > allocs); /* The clone inherits the allocator */
+	assert(bmtOnes(bmt) == 10000);
+	assert(bmtOnes(bmt2) == 20000);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+	assert(stats.frees == stats.allocs);
+	assert(stats.bytes == 0);
+	// Container values are allocated with the allocator
+	bmt = bmtCreateWithAllocator(0, &allocator);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (x = 0; x < 10000; x++)
+		bmtSetBit(bmt, x * 1000);
+	bmt2 = bmtClone(bmt);
+	bmtSetBit(bmt2, 1);
+	bmtDelete(bmt);
+	bmtDelete(bmt2);
+	assert(stats.frees == stats.allocs);
+	assert(stats.bytes == 0);
+
+	// Statistics;
+	{
+		struct bmtStats st;
+		bmt = bmtCreate(1 << 20);
+		if (bmtStats(bmt, &st) == 0) {
+			assert(st.operations == 0 && st.allocBytes == 0);
+			for (unsigned i = 0; i < 1000; i++)
+				bmtSetBit(bmt, i * 64);
+			bmtSetBranch(bmt, 0x10000, 0x100);
+			assert(bmtStats(bmt, &st) == 0);
+			assert(st.operations == 1001);
+			assert(st.expansions > 1000);
+			assert(st.allocBytes > 0 && st.freeBytes == 0);
+			uint64_t hist = 0;
+			for (unsigned i = 0; i < BMT_DEPTH_BUCKETS; i++)
+				hist += st.depth[i];
+			assert(hist == st.operations);
+			assert(st.levels >= st.operations);
+			// Reserved in the existing leaf at 0, then in a new one
+			assert(bmtReserveBit(bmt, &offset) == 0 && offset == 1);
+			assert(bmtReserveBitFrom(bmt, 0x20000, &offset) == 0);
+			assert(bmtStats(bmt, &st) == 0);
+			assert(st.reserves == 2 && st.denseReserves == 1);
+			for (unsigned i = 0; i < 1000; i++)
+				bmtClearBit(bmt, i * 64);
+			assert(bmtStats(bmt, &st) == 0);
+			assert(st.frees >= 1000);
+			bmtStatsReset(bmt);
+			assert(bmtStats(bmt, &st) == 0);
+			assert(st.operations == 0 && st.frees == 0);
+		}
+		bmtDelete(bmt);
+	}
+
 	printf("=== BitmapTree OK\n");
 	return 0;
 }
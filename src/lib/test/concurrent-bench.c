@@ -0,0 +1,156 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <pthread.h>
+#include <time.h>
+
+// Reader throughput with 1..MAX_READERS threads doing lookups while a
+// writer reserves and releases bits and publishes continuously.
+#define MAX_READERS 8
+#define SECTIONS 100000
+#define LOOKUPS 16				/* per read section */
+
+// Reservation throughput with 1..MAX_RESERVERS threads, with one lock
+// for the tree or with sharded reservation.
+#define MAX_RESERVERS 16
+#define SHARDS 16
+#define RESERVES 200000
+#define HELD 64					/* Reserved bits held by a thread */
+
+static struct BitmapTree* bmt;
+static int done;
+static volatile unsigned sink;
+static struct bmtShards* shards;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t rndr(uint64_t* x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static uint64_t nsNow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void* reader(void* arg)
+{
+	struct bmtReader* r = arg;
+	uint64_t x = (uintptr_t)arg | 1;
+	unsigned ones = 0;
+	for (unsigned i = 0; i < SECTIONS; i++) {
+		struct BitmapTree* view = bmtReadBegin(r);
+		for (unsigned j = 0; j < LOOKUPS; j++)
+			ones += bmtBit(view, rndr(&x) & 0xffffffff);
+		bmtReadEnd(r);
+	}
+	sink = ones;
+	return NULL;
+}
+
+static void* writer(void* arg)
+{
+	uint64_t x = 88172645463325252ULL;
+	uint64_t offset;
+	unsigned *publishes = arg;
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		bmtClearBit(bmt, 0x0a000000 + (rndr(&x) & 0xfffff));
+		bmtReserveBitFrom(bmt, 0x0a000000, &offset);
+		bmtPublish(bmt);
+		(*publishes)++;
+	}
+	return NULL;
+}
+
+// reserver - Reserve and release bits, the oldest reserved bit is
+// released. 'arg' is the home shard, or NULL for the locked tree.
+static void* reserver(void* arg)
+{
+	unsigned home = (uintptr_t)arg;
+	uint64_t held[HELD];
+	for (unsigned i = 0; i < RESERVES; i++) {
+		uint64_t* offset = &held[i % HELD];
+		if (shards != NULL) {
+			if (i >= HELD)
+				bmtShardsClearBit(shards, *offset);
+			bmtShardsReserveBit(shards, home, offset);
+		} else {
+			pthread_mutex_lock(&lock);
+			if (i >= HELD)
+				bmtClearBit(bmt, *offset);
+			bmtReserveBit(bmt, offset);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return NULL;
+}
+
+static void reservers(char const* name)
+{
+	for (unsigned n = 1; n <= MAX_RESERVERS; n *= 2) {
+		pthread_t threads[MAX_RESERVERS];
+		uint64_t start = nsNow();
+		for (uintptr_t i = 0; i < n; i++)
+			pthread_create(&threads[i], NULL, reserver, (void*)i);
+		for (unsigned i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t ns = nsNow() - start;
+		double ops = (double)n * RESERVES;
+		printf("%s threads=%-2u %8.1f Mreserve/s\n", name, n, ops * 1000 / ns);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t x = 1;
+	bmt = bmtCreate(1ULL << 32);
+	for (unsigned i = 0; i < 100000; i++)
+		bmtSetBit(bmt, rndr(&x) & 0xffffffff);
+	bmtConcurrent(bmt);
+
+	for (unsigned n = 1; n <= MAX_READERS; n *= 2) {
+		pthread_t w, threads[MAX_READERS];
+		struct bmtReader* readers[MAX_READERS];
+		unsigned publishes = 0;
+		done = 0;
+		for (unsigned i = 0; i < n; i++)
+			readers[i] = bmtReaderCreate(bmt);
+		pthread_create(&w, NULL, writer, &publishes);
+		uint64_t start = nsNow();
+		for (unsigned i = 0; i < n; i++)
+			pthread_create(&threads[i], NULL, reader, readers[i]);
+		for (unsigned i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t ns = nsNow() - start;
+		__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+		pthread_join(w, NULL);
+		for (unsigned i = 0; i < n; i++)
+			bmtReaderDelete(readers[i]);
+		double lookups = (double)n * SECTIONS * LOOKUPS;
+		printf("readers=%-2u %8.1f Mlookups/s %8.1f ns/lookup/thread"
+			   " (%u publishes)\n", n, lookups * 1000 / ns,
+			   (double)ns * n / lookups, publishes);
+	}
+	bmtDelete(bmt);
+
+	// A mostly used ipv4 /12 with random free addresses
+	bmt = bmtCreate(1ULL << 32);
+	bmtSetBranch(bmt, 0, 0);
+	bmtClearBranch(bmt, 0x0a000000, 0x100000);
+	for (unsigned i = 0; i < 0x80000; i++)
+		bmtSetBit(bmt, 0x0a000000 + (rndr(&x) & 0xfffff));
+	reservers("locked ");
+	shards = bmtShardsCreate(bmt, SHARDS);
+	reservers("sharded");
+	bmtShardsDelete(shards);
+	bmtDelete(bmt);
+	return 0;
+}
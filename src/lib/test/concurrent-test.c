@@ -0,0 +1,138 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <assert.h>
+#include <pthread.h>
+
+// The writer sets and clears bits in pairs (2k, 2k+1) and publishes
+// after each change, so a reader must always see equal pairs and an
+// even number of '1's.
+#define PAIRS 1024
+#define WRITES 50000
+#define READERS 4
+
+static struct BitmapTree* shared;
+static int done;
+
+static unsigned rndr(uint64_t* x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static void* reader(void* arg)
+{
+	struct bmtReader* r = arg;
+	uint64_t x = (uintptr_t)arg | 1;
+	unsigned sections = 0;
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE) || sections < 100) {
+		struct BitmapTree* view = bmtReadBegin(r);
+		assert(bmtOnes(view) % 2 == 0);
+		for (unsigned i = 0; i < 16; i++) {
+			uint64_t k = 0x0a000000 + (rndr(&x) % PAIRS) * 2;
+			assert(bmtBit(view, k) == bmtBit(view, k + 1));
+		}
+		uint64_t offset;
+		if (bmtNextSet(view, 0, &offset) == 0) {
+			assert(offset % 2 == 0);
+			assert(bmtBit(view, offset + 1) == 1);
+		}
+		bmtReadEnd(r);
+		sections++;
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct BitmapTree* bmt;
+	struct bmtReader* r;
+	uint64_t offset;
+
+	// Basics;
+	bmt = bmtCreate(1ULL << 32);
+	assert(bmtReaderCreate(bmt) == NULL);
+	assert(bmtPublish(bmt) != 0);
+	bmtSetBit(bmt, 1);
+	assert(bmtConcurrent(bmt) == 0);
+	r = bmtReaderCreate(bmt);
+	assert(r != NULL);
+	struct BitmapTree* view = bmtReadBegin(r);
+	assert(bmtBit(view, 1) == 1);
+	bmtReadEnd(r);
+	bmtSetBit(bmt, 2);
+	bmtClearBit(bmt, 1);
+	view = bmtReadBegin(r);
+	assert(bmtBit(view, 1) == 1);		/* Not published */
+	assert(bmtBit(view, 2) == 0);
+	assert(bmtPublish(bmt) == 0);
+	assert(bmtBit(view, 1) == 1);		/* In the same read section */
+	assert(bmt->epoch->retired != NULL);
+	assert(bmtPublish(bmt) == 0);
+	assert(bmt->epoch->retired != NULL); /* The reader may use it */
+	bmtReadEnd(r);
+	assert(bmtPublish(bmt) == 0);
+	assert(bmt->epoch->retired == NULL);
+	view = bmtReadBegin(r);
+	assert(bmtBit(view, 1) == 0);
+	assert(bmtBit(view, 2) == 1);
+	assert(bmtNextSet(view, 0, &offset) == 0);
+	assert(offset == 2);
+	bmtReadEnd(r);
+	bmtReaderDelete(r);
+	bmtDelete(bmt);
+
+	// Clones and rollback in concurrent mode;
+	bmt = bmtCreate(1ULL << 32);
+	assert(bmtConcurrent(bmt) == 0);
+	r = bmtReaderCreate(bmt);
+	assert(bmtSetRange(bmt, 100, 200) == 0);
+	struct BitmapTree* snap = bmtClone(bmt);
+	assert(bmtPublish(bmt) == 0);
+	assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(offset == 0);
+	assert(bmtRestore(bmt, snap) == 0);
+	assert(bmtPublish(bmt) == 0);
+	view = bmtReadBegin(r);
+	assert(bmtOnes(view) == 101);
+	assert(bmtBit(view, 0) == 0);
+	bmtReadEnd(r);
+	bmtDelete(snap);
+	bmtReaderDelete(r);
+	bmtDelete(bmt);
+
+	// Threads;
+	shared = bmtCreate(1ULL << 32);
+	assert(bmtConcurrent(shared) == 0);
+	pthread_t threads[READERS];
+	struct bmtReader* readers[READERS];
+	for (unsigned i = 0; i < READERS; i++) {
+		readers[i] = bmtReaderCreate(shared);
+		assert(pthread_create(&threads[i], NULL, reader, readers[i]) == 0);
+	}
+	uint64_t x = 88172645463325252ULL;
+	for (unsigned i = 0; i < WRITES; i++) {
+		uint64_t k = 0x0a000000 + (rndr(&x) % PAIRS) * 2;
+		if (rndr(&x) % 2)
+			assert(bmtSetBranch(shared, k, 2) == 0);
+		else
+			assert(bmtClearRange(shared, k, k + 1) == 0);
+		assert(bmtPublish(shared) == 0);
+	}
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (unsigned i = 0; i < READERS; i++) {
+		pthread_join(threads[i], NULL);
+		bmtReaderDelete(readers[i]);
+	}
+	assert(bmtPublish(shared) == 0);
+	assert(shared->epoch->retired == NULL);
+	bmtDelete(shared);
+
+	printf("=== concurrent OK\n");
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct imageBuff {
+	uint64_t* data;				/* uint64_t for the alignment */
+	size_t len;
+	size_t allocated;
+	unsigned calls;
+};
+static void buffWrite(void* ref, void const* data, size_t len)
+{
+	struct imageBuff* b = ref;
+	b->calls++;
+	if (b->len + len > b->allocated) {
+		b->allocated = (b->len + len) * 2;
+		b->data = realloc(b->data, b->allocated);
+	}
+	memcpy((uint8_t*)b->data + b->len, data, len);
+	b->len += len;
+}
+
+// checkOffset - Compare the queries on the image and the tree
+static void checkOffset(
+	struct bmtImage* img, struct BitmapTree* bmt, uint64_t x)
+{
+	uint64_t o1, o2;
+	assert(bmtImageBit(img, x) == bmtBit(bmt, x));
+	assert(bmtImageRank(img, x) == bmtRank(bmt, x));
+	int rc = bmtNextSet(bmt, x, &o1);
+	assert(bmtImageNextSet(img, x, &o2) == rc);
+	assert(rc != 0 || o1 == o2);
+	rc = bmtNextClear(bmt, x, &o1);
+	assert(bmtImageNextClear(img, x, &o2) == rc);
+	assert(rc != 0 || o1 == o2);
+}
+
+// checkImage - Write an image of the tree and compare.
+// return: The header flags
+static unsigned checkImage(struct BitmapTree* bmt)
+{
+	struct imageBuff b = {0};
+	bmtImageWrite(bmt, buffWrite, &b);
+	assert(b.calls <= 1 + b.len / 32768);
+	struct bmtImage* img = bmtImageOpen(b.data, b.len);
+	assert(img != NULL);
+	assert(bmtImageOnes(img) == bmtOnes(bmt));
+	uint64_t mask = bmtSize(bmt) - 1;
+	for (unsigned i = 0; i < 2000; i++) {
+		uint64_t x = (uint64_t)rand() * rand() * 1237;
+		checkOffset(img, bmt, x & mask);
+		checkOffset(img, bmt, rand() & mask);
+	}
+	// Around the '1's
+	struct bmtCursor c;
+	uint64_t offset, length;
+	bmtCursorInit(&c, bmt, 0, 1);
+	for (unsigned i = 0; i < 500 && bmtCursorNext(&c, &offset, &length) == 0;
+		 i++) {
+		checkOffset(img, bmt, offset);
+		checkOffset(img, bmt, offset - 1);
+		checkOffset(img, bmt, offset + length - 1);
+		checkOffset(img, bmt, offset + length);
+	}
+	struct BitmapTree* t = bmtImagePromote(img);
+	assert(t != NULL);
+	assert(bmtCompare(t, bmt) == 0);
+	assert(bmtOnes(t) == bmtOnes(bmt));
+	assert(bmtSetNode16(t, bmt->pool->node16) == 0);
+	assert(bmtNodes(t) == bmtNodes(bmt));
+	bmtDelete(t);
+	bmtImageClose(img);
+	unsigned flags = ((uint8_t*)b.data)[5];
+	free(b.data);
+	return flags;
+}
+
+int main(int argc, char* argv[])
+{
+	struct BitmapTree* bmt;
+	struct bmtImage* img;
+
+	// Empty and full;
+	bmt = bmtCreate(1 << 20);
+	checkImage(bmt);
+	bmtSetBranch(bmt, 0, 0);
+	checkImage(bmt);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	bmtSetBranch(bmt, 0, 0);
+	checkImage(bmt);
+	bmtClearBit(bmt, UINT64_MAX);
+	assert((checkImage(bmt) & 0x02) == 0); /* No 16-way nodes */
+	bmtDelete(bmt);
+
+	// A bitmap in the top;
+	bmt = bmtCreate(64);
+	bmtSetBit(bmt, 1);
+	checkImage(bmt);
+	bmtDelete(bmt);
+
+	// Sparse and chains in a full size tree;
+	bmt = bmtCreate(0);
+	for (unsigned i = 0; i < 1000; i++)
+		bmtSetBit(bmt, (uint64_t)rand() * rand() * 1237);
+	bmtSetBit(bmt, 0x5555555555555555ULL);
+	assert(bmtSetRange(bmt, 1000, 300000) == 0);
+	bmtClearBit(bmt, 2000);
+	bmtSetBit(bmt, UINT64_MAX);
+	checkImage(bmt);
+	bmtDelete(bmt);
+
+	// Dense; 16-way nodes with item, FULL and NULL legs
+	bmt = bmtCreate(1 << 20);
+	for (unsigned i = 0; i < (1 << 14); i++)
+		bmtSetBit(bmt, i * 64 + i % 61);
+	assert(bmtSetRange(bmt, 0x40000, 0x47fff) == 0);
+	assert(bmtClearRange(bmt, 0x80000, 0x87fff) == 0);
+	assert(checkImage(bmt) & 0x02);
+	// (from 16-way nodes in memory)
+	assert(bmtSetNode16(bmt, 1) == 0);
+	assert(checkImage(bmt) & 0x02);
+	bmtDelete(bmt);
+	bmt = bmtCreateWithLeaves(1 << 24, 128, NULL);
+	assert(bmtSetNode16(bmt, 1) == 0);
+	for (unsigned i = 0; i < 400000; i++)
+		bmtSetBit(bmt, rand() & 0xffffff);
+	checkImage(bmt);
+	bmtDelete(bmt);
+
+	// Wide leaves;
+	for (unsigned leafBits = 64; leafBits <= 512; leafBits *= 2) {
+		bmt = bmtCreateWithLeaves(1 << 20, leafBits, NULL);
+		for (unsigned i = 0; i < 20000; i++)
+			bmtSetBit(bmt, rand() & 0xfffff);
+		assert(bmtSetRange(bmt, 0x80000, 0x8ffff) == 0);
+		bmtClearBit(bmt, 0x80123);
+		checkImage(bmt);
+		bmtDelete(bmt);
+	}
+
+	// Containers;
+	bmt = bmtCreate(1 << 24);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (unsigned i = 0; i < 1000; i++)
+		bmtSetBit(bmt, 0x10000 + i * 7);
+	assert(bmtSetRange(bmt, 0x20000, 0x2ffff) == 0);
+	for (unsigned i = 0; i < 100; i++)
+		bmtClearBit(bmt, 0x20000 + rand() % 0x10000);
+	assert(bmtSetRange(bmt, 0x30000, 0x37fff) == 0);
+	for (unsigned i = 0; i < 5000; i++)
+		bmtClearBit(bmt, 0x30000 + i * 3);
+	checkImage(bmt);
+	bmtDelete(bmt);
+
+	// Invalid images;
+	uint64_t hdr[4] = {0};
+	assert(bmtImageOpen(hdr, sizeof(hdr)) == NULL);
+	bmt = bmtCreate(1 << 20);
+	for (unsigned i = 0; i < 100; i++)
+		bmtSetBit(bmt, rand() & 0xfffff);
+	struct imageBuff b = {0};
+	bmtImageWrite(bmt, buffWrite, &b);
+	assert(bmtImageOpen(b.data, b.len - 8) == NULL);
+	assert(bmtImageOpen((uint8_t*)b.data + 4, b.len - 4) == NULL);
+	img = bmtImageOpen(b.data, b.len);
+	assert(img != NULL);
+	// Corrupt the top item; queries are safe, promote fails
+	b.data[b.len / 8 - 1] = 7;
+	b.data[b.len / 8 - 2] = b.len;
+	for (unsigned i = 0; i < 100; i++) {
+		uint64_t x;
+		bmtImageBit(img, rand() & 0xfffff);
+		bmtImageRank(img, rand() & 0xfffff);
+		bmtImageNextSet(img, rand() & 0xfffff, &x);
+		bmtImageNextClear(img, rand() & 0xfffff, &x);
+	}
+	assert(bmtImagePromote(img) == NULL);
+	bmtImageClose(img);
+	free(b.data);
+
+	// A mapped file;
+	FILE* f = tmpfile();
+	assert(f != NULL);
+	b = (struct imageBuff){0};
+	bmtImageWrite(bmt, buffWrite, &b);
+	assert(fwrite(b.data, 1, b.len, f) == b.len);
+	fflush(f);
+	void* data = mmap(NULL, b.len, PROT_READ, MAP_SHARED, fileno(f), 0);
+	assert(data != MAP_FAILED);
+	img = bmtImageOpen(data, b.len);
+	assert(img != NULL);
+	assert(bmtImageOnes(img) == bmtOnes(bmt));
+	for (unsigned i = 0; i < 1000; i++)
+		checkOffset(img, bmt, rand() & 0xfffff);
+	struct BitmapTree* t = bmtImagePromote(img);
+	assert(t != NULL);
+	bmtSetBit(t, 0);
+	bmtClearBit(t, 0);
+	assert(bmtCompare(t, bmt) == 0);
+	bmtDelete(t);
+	bmtImageClose(img);
+	munmap(data, b.len);
+	fclose(f);
+	free(b.data);
+	bmtDelete(bmt);
+
+	printf("=== image OK\n");
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <assert.h>
+
+struct buff {
+	uint8_t* data;
+	size_t len;
+	size_t allocated;
+	size_t cursor;
+	unsigned calls;
+};
+struct storage {
+	struct buff log;
+	struct buff image;
+	struct buff next;			/* The image being written */
+	unsigned checkpoints;
+};
+
+static void buffPut(struct buff* b, void const* data, size_t len)
+{
+	b->calls++;
+	if (b->len + len > b->allocated) {
+		b->allocated = (b->len + len) * 2;
+		b->data = realloc(b->data, b->allocated);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+static size_t buffRead(void* ref, void* data, size_t len)
+{
+	struct buff* b = ref;
+	if (b->cursor + len > b->len)
+		return -1;
+	memcpy(data, b->data + b->cursor, len);
+	b->cursor += len;
+	return len;
+}
+
+static void logAppend(void* ref, void const* data, size_t len)
+{
+	struct storage* s = ref;
+	buffPut(&s->log, data, len);
+}
+static void imageWrite(void* ref, void const* data, size_t len)
+{
+	struct storage* s = ref;
+	buffPut(&s->next, data, len);
+}
+// The image is complete, make it the current one
+static void logTruncate(void* ref)
+{
+	struct storage* s = ref;
+	free(s->image.data);
+	s->image = s->next;
+	s->next = (struct buff){0};
+	s->log.len = 0;
+	s->checkpoints++;
+}
+
+// recover - Read the image and replay the log
+static struct BitmapTree* recover(struct storage* s, int64_t* records)
+{
+	s->image.cursor = 0;
+	s->log.cursor = 0;
+	struct BitmapTree* bmt = bmtRead(buffRead, &s->image);
+	assert(bmt != NULL);
+	*records = bmtJournalReplay(bmt, buffRead, &s->log);
+	return bmt;
+}
+
+// logCommit - Append a commit with 'records' to the log
+static void logCommit(struct storage* s, uint8_t const* records, uint32_t len)
+{
+	uint32_t hdr[2] = {len, 2166136261u};
+	for (uint32_t i = 0; i < len; i++)
+		hdr[1] = (hdr[1] ^ records[i]) * 16777619u; /* FNV-1a */
+	buffPut(&s->log, hdr, sizeof(hdr));
+	buffPut(&s->log, records, len);
+}
+
+static struct storage* storageCreate(void)
+{
+	return CALLOC(sizeof(struct storage));
+}
+static void storageDelete(struct storage* s)
+{
+	free(s->log.data);
+	free(s->image.data);
+	free(s->next.data);
+	free(s);
+}
+
+int main(int argc, char* argv[])
+{
+	struct BitmapTree* bmt;
+	struct BitmapTree* t;
+	struct storage* s;
+	struct bmtJournal j = {logAppend, imageWrite, logTruncate, NULL, 16};
+	uint64_t offset;
+	int64_t records;
+
+	// Invalid params;
+	bmt = bmtCreate(1 << 20);
+	assert(bmtJournalFlush(bmt) != 0);
+	assert(bmtCheckpoint(bmt) != 0);
+	assert(bmtJournalStop(bmt) != 0);
+	struct bmtJournal bad = {NULL, imageWrite, NULL, NULL, 1};
+	assert(bmtJournalStart(bmt, &bad) != 0);
+	s = storageCreate();
+	j.userRef = s;
+	assert(bmtJournalStart(bmt, &j) == 0);
+	assert(s->checkpoints == 1);
+	assert(bmtJournalStart(bmt, &j) != 0);
+	assert(bmtJournalStop(bmt) == 0);
+	bmtDelete(bmt);
+	storageDelete(s);
+
+	// All operations are recovered;
+	bmt = bmtCreate(1 << 20);
+	bmtSetRange(bmt, 100, 5000);
+	s = storageCreate();
+	j.userRef = s;
+	assert(bmtJournalStart(bmt, &j) == 0);
+	for (unsigned i = 0; i < 2000; i++) {
+		uint64_t x = rand() & 0xfffff;
+		uint64_t offsets[4] = {x, x + 3, rand() & 0xfffff, 7};
+		switch (rand() % 10) {
+		case 0:
+			bmtSetBit(bmt, x);
+			break;
+		case 1:
+			bmtClearBit(bmt, x);
+			break;
+		case 2:
+			bmtSetBranch(bmt, x & ~0xffULL, 256);
+			break;
+		case 3:
+			bmtClearBranch(bmt, x & ~0x3fULL, 64);
+			break;
+		case 4:
+			bmtSetRange(bmt, x, x + rand() % 3000);
+			break;
+		case 5:
+			bmtClearRange(bmt, x, x + rand() % 3000);
+			break;
+		case 6:
+			bmtReserveBitFrom(bmt, x, &offset);
+			bmtReserveNextFit(bmt, &offset);
+			bmtReserveBit(bmt, &offset);
+			break;
+		case 7:
+			bmtReserveBranch(bmt, 128, &offset);
+			break;
+		case 8:
+			bmtSetBits(bmt, offsets, 4);
+			break;
+		default:
+			bmtClearBits(bmt, offsets, 4);
+		}
+		if (i == 1000)
+			assert(bmtCheckpoint(bmt) == 0);
+	}
+	assert(s->checkpoints == 2);
+	assert(bmtJournalFlush(bmt) == 0);
+	t = recover(s, &records);
+	assert(records > 1000);
+	assert(bmtCompare(t, bmt) == 0);
+	bmtDelete(t);
+
+	// Set algebra takes a checkpoint, clones are not journaled;
+	t = bmtClone(bmt);
+	bmtSetBit(t, 1);
+	bmtSetBit(bmt, 0);
+	bmtClearBit(t, 0);
+	assert(bmtXor(bmt, t) == 0);
+	assert(s->checkpoints == 3);
+	assert(s->log.len == 0);
+	bmtDelete(t);
+	bmtSetBit(bmt, 77);
+	assert(bmtRestore(bmt, bmt) == 0);
+	assert(s->checkpoints == 4);
+	bmtSetBit(bmt, 78);
+	bmtDelete(bmt);				/* Commits the last record */
+	t = recover(s, &records);
+	assert(records == 1);
+	assert(bmtBit(t, 78) == 1 && bmtBit(t, 77) == 1 && bmtBit(t, 0) == 1);
+	bmtDelete(t);
+	storageDelete(s);
+
+	// A crash during an append (one record per commit);
+	bmt = bmtCreate(0);
+	s = storageCreate();
+	j.userRef = s;
+	j.batch = 1;
+	assert(bmtJournalStart(bmt, &j) == 0);
+	for (unsigned i = 0; i < 100; i++)
+		bmtSetBit(bmt, (uint64_t)rand() * rand() * 1237);
+	assert(s->log.calls == 100);
+	t = bmtClone(bmt);
+	bmtSetRange(bmt, 1ULL << 40, (1ULL << 41) + 5);
+	bmtDelete(bmt);
+	s->log.len -= 3;
+	bmt = recover(s, &records);
+	assert(records == 100);
+	assert(bmtCompare(t, bmt) == 0);
+	bmtDelete(t);
+	// Damaged records
+	s->log.data[9] ^= 0x40;
+	s->log.cursor = 0;
+	assert(bmtJournalReplay(bmt, buffRead, &s->log) == 0);
+	bmtDelete(bmt);
+	storageDelete(s);
+
+	// A commit with an invalid op is not applied at all;
+	bmt = bmtCreate(0);
+	s = storageCreate();
+	uint8_t ok[] = {1, 2};			/* Set bit 1 */
+	uint8_t badOp[] = {1, 20, 1, 2, 9, 2, 1, 2};	/* Set 10, 11, (op 9), 12 */
+	logCommit(s, ok, sizeof(ok));
+	logCommit(s, badOp, sizeof(badOp));
+	logCommit(s, ok, sizeof(ok));
+	assert(bmtJournalReplay(bmt, buffRead, &s->log) == -1);
+	assert(bmtOnes(bmt) == 1);
+	assert(bmtBit(bmt, 1) == 1);
+	bmtDelete(bmt);
+	storageDelete(s);
+
+	// Group commit and record size for reservations;
+	bmt = bmtCreate(1 << 24);
+	s = storageCreate();
+	j.userRef = s;
+	j.batch = 1000;
+	assert(bmtJournalStart(bmt, &j) == 0);
+	for (unsigned i = 0; i < 10000; i++)
+		assert(bmtReserveBit(bmt, &offset) == 0);
+	assert(s->log.calls == 10);
+	assert(s->log.len <= 10 * (8 + 1000 * 2 + 2));	/* + first offsets */
+	for (unsigned i = 0; i < 10; i++)
+		bmtClearBit(bmt, i * 1000);
+	assert(s->log.calls == 10);
+	t = recover(s, &records);
+	assert(records == 10000);
+	assert(bmtOnes(t) == 10000);
+	bmtDelete(t);
+	assert(bmtJournalFlush(bmt) == 0);
+	assert(s->log.calls == 11);
+	t = recover(s, &records);
+	assert(records == 10010);
+	assert(bmtCompare(t, bmt) == 0);
+	bmtDelete(t);
+	bmtDelete(bmt);
+	storageDelete(s);
+
+	printf("=== journal OK\n");
+	return 0;
+}
@@ -23,6 +23,7 @@ struct writeBuffDescriptor {
 	unsigned allocated;
 	void* data;
 	unsigned cursor;
+	unsigned calls;
 };
 static struct writeBuffDescriptor* buffOpenWrite(void)
 {
@@ -35,6 +36,7 @@ static void buffOpenRead(struct writeBuffDescriptor* d)
 {
 	d->allocated = d->cursor;
 	d->cursor = 0;
+	d->calls = 0;
 }
 static void buffClose(struct writeBuffDescriptor* d)
 {
@@ -46,6 +48,7 @@ static void buffClose(struct writeBuffDescriptor* d)
 static void buffWrite(void* ref, void const* data, size_t len)
 {
 	struct writeBuffDescriptor* d = ref;
+	d->calls++;
 	if ((d->cursor + len) > d->allocated) {
 		d->allocated += (len + WBCHUNK);
 		d->data = realloc(d->data, d->allocated);
@@ -59,6 +62,7 @@ static size_t buffRead(void* ref, void* data, size_t len)
 	D(printf(
 		   "buffRead; len=%lu, cursor=%u, allocated=%u\n",
 		   len, d->cursor, d->allocated));
+	d->calls++;
 	if ((d->cursor + len) > d->allocated)
 		return -1;
 	memcpy(data, d->data + d->cursor, len);
@@ -66,6 +70,76 @@ static size_t buffRead(void* ref, void* data, size_t len)
 	return len;
 }
 
+// roundTrip - Write and read back a bmt with the current method and
+// compare. return the number of bytes written
+static uint64_t roundTrip(struct BitmapTree* bmt)
+{
+	struct writeBuffDescriptor* d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	uint64_t len = d->cursor;
+	buffOpenRead(d);
+	struct BitmapTree* bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	assert(d->cursor == d->allocated);
+	buffClose(d);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt2) == bmtOnes(bmt));
+	assert(bmtLeafBits(bmt2) == bmtLeafBits(bmt));
+	assert(bmtNodes(bmt2) == bmtNodes(bmt));
+	assert(bmtLeaves(bmt2) == bmtLeaves(bmt));
+	assert(bmtDepth(bmt2) == bmtDepth(bmt));
+	bmtDelete(bmt2);
+	return len;
+}
+// parallelTrip - Write a bmt with bmtWriteParallel() and read it back
+// both sequentially and in parallel. return the written version
+static unsigned parallelTrip(struct BitmapTree* bmt, unsigned threads)
+{
+	uint64_t byteCount = 0;
+	bmtWrite(bmt, countBytes, &byteCount);
+	// Exact unless container values are allocated with spare capacity
+	if (bmt->pool->count.valueBytes == 0)
+		assert(bmtSerializedSize(bmt) == byteCount);
+	else
+		assert(bmtSerializedSize(bmt) >= byteCount);
+	struct writeBuffDescriptor* d = buffOpenWrite();
+	bmtWriteParallel(bmt, buffWrite, d, threads);
+	unsigned version = ((uint8_t*)d->data)[1] >> 4;
+	buffOpenRead(d);
+	struct BitmapTree* bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	assert(d->cursor == d->allocated);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt2) == bmtOnes(bmt));
+	assert(bmtNodes(bmt2) == bmtNodes(bmt));
+	bmtDelete(bmt2);
+	buffOpenRead(d);
+	bmt2 = bmtReadParallel(buffRead, d, threads);
+	assert(bmt2 != NULL);
+	assert(d->cursor == d->allocated);
+	buffClose(d);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt2) == bmtOnes(bmt));
+	assert(bmtNodes(bmt2) == bmtNodes(bmt));
+	assert(bmtAllocated(bmt2) == bmtAllocated(bmt));
+	// Modify the read tree; items from all pools are used
+	for (unsigned i = 0; i < 1000; i++)
+		bmtClearBit(bmt2, (uint64_t)rand() * rand() * 1237);
+	bmtSetRange(bmt2, 0, 100000);
+	bmtDelete(bmt2);
+	return version;
+}
+
+static uint64_t packedRatio(struct BitmapTree* bmt)
+{
+	uint64_t byteCount = 0;
+	bmtWrite(bmt, countBytes, &byteCount);
+	assert(bmtSerializeMethod("packed-tree") == 0);
+	uint64_t len = roundTrip(bmt);
+	assert(bmtSerializeMethod("tree-store") == 0);
+	D(printf("tree-store %lu, packed-tree %lu\n", byteCount, len));
+	return byteCount * 10 / len;
+}
 
 int main(int argc, char* argv[])
 {
@@ -152,6 +226,328 @@ int main(int argc, char* argv[])
 	
 	bmtDelete(bmt);
 
+	// A size smaller than a leaf;
+	uint8_t small[] = {0x00, 0x20, 0x04, 0x01, 0x00, 0x00, 0x00, 0x44};
+	d = buffOpenWrite();
+	buffWrite(d, small, sizeof(small));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	small[0] = 0x30;			/* 512 bit leaves, size 2^8 */
+	small[2] = 0x08;
+	d = buffOpenWrite();
+	buffWrite(d, small, sizeof(small));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+
+	// Read a version 0 tree (no chains);
+	uint8_t v0[] = {0, 0, 7, 0x47, 0, 1, 0, 0, 0, 0, 0, 0, 0};
+	d = buffOpenWrite();
+	buffWrite(d, v0, sizeof(v0));
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	buffClose(d);
+	bmt = bmtCreate(128);
+	bmtSetBit(bmt, 64);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtNodes(bmt2) == 2);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// Chains in a full size tree;
+	bmt = bmtCreate(0);
+	bmtSetBit(bmt, 0x5555555555555555ULL);
+	bmtSetBit(bmt, UINT64_MAX);
+	assert(bmtClearBranch(bmt, 0x4000000000000000ULL, 0x100000) == 0);
+	d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	buffClose(d);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// Wide leaves;
+	for (unsigned leafBits = 128; leafBits <= 512; leafBits *= 2) {
+		bmt = bmtCreateWithLeaves(0, leafBits, NULL);
+		bmtSetBit(bmt, 0x5555555555555555ULL);
+		assert(bmtSetRange(bmt, 1000, 3000) == 0);
+		bmtClearBit(bmt, 2000);
+		bmtSetBit(bmt, UINT64_MAX);
+		d = buffOpenWrite();
+		bmtWrite(bmt, buffWrite, d);
+		buffOpenRead(d);
+		bmt2 = bmtRead(buffRead, d);
+		assert(bmt2 != NULL);
+		buffClose(d);
+		assert(bmtLeafBits(bmt2) == leafBits);
+		assert(bmtCompare(bmt, bmt2) == 0);
+		assert(bmtOnes(bmt2) == 2002);
+		bmtDelete(bmt2);
+		bmtDelete(bmt);
+	}
+
+	// Large trees are written and read in frames;
+	bmt = bmtCreate(0);
+	for (unsigned i = 0; i < 100000; i++)
+		bmtSetBit(bmt, (uint64_t)rand() * rand() * 1237);
+	d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	assert(d->cursor > 32768 * 4);
+	assert(d->calls <= 2 + d->cursor / 32768);
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	assert(d->calls <= 2 + 2 * (d->allocated / 32768 + 1));
+	assert(d->cursor == d->allocated);
+	buffClose(d);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	bmtDelete(bmt2);
+	// A truncated stream
+	d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	d->cursor -= 1000;
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	bmtDelete(bmt);
+
+	// Parallel write and read;
+	bmt = bmtCreate(0);
+	assert(parallelTrip(bmt, 4) == 2);
+	for (unsigned i = 0; i < 100000; i++)
+		bmtSetBit(bmt, (uint64_t)rand() * rand() * 1237);
+	assert(parallelTrip(bmt, 1) == 2);
+	assert(parallelTrip(bmt, 2) == 3);
+	assert(parallelTrip(bmt, 7) == 3);
+	// The index is in the first frame, the nodes as in version 2
+	d = buffOpenWrite();
+	bmtWriteParallel(bmt, buffWrite, d, 4);
+	bmt2 = bmtCreate(0);
+	bmtSetBit(bmt2, 1);
+	struct writeBuffDescriptor* d2 = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d2);
+	assert(d->cursor > d2->cursor);
+	assert(d->cursor < d2->cursor + 16 * 17 + 12 + 4 * (d->calls + 1));
+	buffClose(d2);
+	bmtDelete(bmt2);
+	// A truncated stream and a damaged index
+	unsigned len = d->cursor;
+	d->cursor = len - 1000;
+	buffOpenRead(d);
+	assert(bmtReadParallel(buffRead, d, 4) == NULL);
+	d->cursor = len;
+	buffOpenRead(d);
+	((uint8_t*)d->data)[3 + 4 + 4 + 8 + 17 * 3 + 2] ^= 0x10; /* 4th offset */
+	assert(bmtReadParallel(buffRead, d, 4) == NULL);
+	d->cursor = 0;
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	bmtDelete(bmt);
+	// Wide leaves, dense
+	bmt = bmtCreateWithLeaves(1 << 24, 256, NULL);
+	for (unsigned i = 0; i < 200000; i++)
+		bmtSetBit(bmt, rand() & 0xffffff);
+	assert(bmtSetRange(bmt, 0x100000, 0x1fffff) == 0);
+	assert(parallelTrip(bmt, 3) == 3);
+	bmtDelete(bmt);
+	// Containers
+	bmt = bmtCreate(1 << 24);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (unsigned i = 0; i < 100000; i++)
+		bmtSetBit(bmt, rand() & 0xffffff);
+	assert(bmtSetRange(bmt, 0x20000, 0x2ffff) == 0);
+	bmtClearBit(bmt, 0x20100);
+	assert(parallelTrip(bmt, 4) == 3);
+	bmtDelete(bmt);
+
+	// Containers;
+	bmt = bmtCreate(0);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (unsigned i = 0; i < 1000; i++)
+		bmtSetBit(bmt, 0x10000 + i * 7);	/* Array */
+	assert(bmtSetRange(bmt, 0x20000, 0x2ffff) == 0);
+	bmtClearBit(bmt, 0x20100);				/* Runs */
+	assert(bmtSetRange(bmt, 0x30000, 0x37fff) == 0);
+	for (unsigned i = 0; i < 5000; i++)
+		bmtClearBit(bmt, 0x30000 + i * 3);	/* Nodes */
+	d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	buffClose(d);
+	assert(bmtCompare(bmt, bmt2) == 0);
+	assert(bmtOnes(bmt2) == bmtOnes(bmt));
+	assert(bmtAllocated(bmt2) == bmtAllocated(bmt));
+	bmtDelete(bmt2);
+	// An invalid (unsorted) array
+	uint8_t bad[] = {0x40, 0x10, 16, 0xa0, 3, 0, 1, 0, 3, 0, 2, 0};
+	d = buffOpenWrite();
+	buffWrite(d, bad, sizeof(bad));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	bad[10] = 4;
+	d = buffOpenWrite();
+	buffWrite(d, bad, sizeof(bad));
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	buffClose(d);
+	assert(bmtOnes(bmt2) == 3);
+	assert(bmtBit(bmt2, 4) == 1);
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// 16-way nodes are stored as binary nodes;
+	bmt = bmtCreate(1 << 24);
+	bmt2 = bmtCreate(1 << 24);
+	assert(bmtSetNode16(bmt, 1) == 0);
+	for (unsigned i = 0; i < 400000; i++) {
+		uint64_t x = rand() & 0xffffff;
+		bmtSetBit(bmt, x);
+		bmtSetBit(bmt2, x);
+	}
+	assert(bmtNodes(bmt) < bmtNodes(bmt2));
+	byteCount = 0;
+	bmtWrite(bmt, countBytes, &byteCount);
+	assert(bmtSerializedSize(bmt) == byteCount);
+	for (unsigned m = 0; m < 3; m++) {
+		// tree-store, packed-tree and parallel
+		if (m == 1)
+			assert(bmtSerializeMethod("packed-tree") == 0);
+		d = buffOpenWrite();
+		d2 = buffOpenWrite();
+		if (m < 2) {
+			bmtWrite(bmt, buffWrite, d);
+			bmtWrite(bmt2, buffWrite, d2);
+		} else {
+			bmtWriteParallel(bmt, buffWrite, d, 4);
+			bmtWriteParallel(bmt2, buffWrite, d2, 4);
+		}
+		assert(d->cursor == d2->cursor);
+		assert(memcmp(d->data, d2->data, d->cursor) == 0);
+		buffOpenRead(d);
+		struct BitmapTree* t =
+			m < 2 ? bmtRead(buffRead, d) : bmtReadParallel(buffRead, d, 4);
+		assert(t != NULL);
+		assert(bmtCompare(t, bmt) == 0);
+		assert(bmtNodes(t) == bmtNodes(bmt2));
+		assert(bmtSetNode16(t, 1) == 0);
+		assert(bmtNodes(t) == bmtNodes(bmt));
+		bmtDelete(t);
+		buffClose(d2);
+		buffClose(d);
+		assert(bmtSerializeMethod("tree-store") == 0);
+	}
+	bmtDelete(bmt2);
+	bmtDelete(bmt);
+
+	// A 64 bit tree is one bitmap kept in the top. Any word is valid
+	bmt = bmtCreate(64);
+	bmtSetBit(bmt, 1);
+	assert(roundTrip(bmt) > 0);
+	assert(bmtSerializeMethod("packed-tree") == 0);
+	roundTrip(bmt);
+	assert(bmtSerializeMethod("tree-store") == 0);
+	bmtDelete(bmt);
+
+	// Packed tree;
+	bmt = bmtCreate(0x100000000ULL);
+	assert(packedRatio(bmt) >= 10);
+	bmtSetBranch(bmt, 0, 0);
+	assert(packedRatio(bmt) >= 10);
+	// Free 10.0.0.0/8 (as ipam)
+	assert(bmtClearBranch(bmt, 0x0a000000, 0x01000000) == 0);
+	assert(packedRatio(bmt) >= 20);
+	bmtDelete(bmt);
+	// As randomSim
+	bmt = bmtCreate(0x100000000ULL);
+	bmtSetBranch(bmt, 0, 0x1000ULL);
+	for (int x = 0; x < 8000; x++)
+		bmtClearBit(bmt, rand() & 0xffff);
+	assert(packedRatio(bmt) >= 17);
+	bmtDelete(bmt);
+	bmt = bmtCreate(0);
+	for (unsigned i = 0; i < 100000; i++)
+		bmtSetBit(bmt, (uint64_t)rand() * rand() * 1237);
+	assert(bmtSetRange(bmt, 0x5555, 0x5555555) == 0);
+	assert(packedRatio(bmt) >= 20);
+	bmtDelete(bmt);
+	for (unsigned leafBits = 64; leafBits <= 512; leafBits *= 2) {
+		bmt = bmtCreateWithLeaves(1 << 20, leafBits, NULL);
+		for (unsigned i = 0; i < 20000; i++)
+			bmtSetBit(bmt, rand() & 0xfffff);
+		bmtClearBit(bmt, 0);
+		bmtSetBit(bmt, 1);
+		assert(bmtSetRange(bmt, 0x80000, 0x8ffff) == 0);
+		for (unsigned i = 0; i < 20; i++)
+			bmtClearBit(bmt, 0x80000 + i * 513);
+		assert(packedRatio(bmt) >= 15);
+		bmtDelete(bmt);
+	}
+	bmt = bmtCreate(0);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (unsigned i = 0; i < 1000; i++)
+		bmtSetBit(bmt, 0x10000 + i * 7);
+	assert(bmtSetRange(bmt, 0x20000, 0x2ffff) == 0);
+	bmtClearBit(bmt, 0x20100);
+	bmtClearBit(bmt, 0x2ffff);
+	for (unsigned i = 0; i < 300; i++)
+		bmtClearBit(bmt, 0x20000 + rand() % 0x10000);
+	bmtSetBit(bmt, 0xffff);
+	bmtSetBit(bmt, 0x40000);
+	assert(packedRatio(bmt) >= 20);
+	// Truncated and invalid streams
+	assert(bmtSerializeMethod("packed-tree") == 0);
+	d = buffOpenWrite();
+	bmtWrite(bmt, buffWrite, d);
+	d->cursor -= 10;
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	d->cursor = 0;
+	((uint8_t*)d->data)[0] = 0x20;
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	// A size smaller than a leaf
+	uint8_t tiny[] = {0x10, 4, 2, 0x01, 0xff};
+	d = buffOpenWrite();
+	buffWrite(d, tiny, sizeof(tiny));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	tiny[0] = 0x16;				/* 512 bit leaves, size 2^8 */
+	tiny[1] = 8;
+	d = buffOpenWrite();
+	buffWrite(d, tiny, sizeof(tiny));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	// A 64-bit leaf with one '1', the offset is > 63
+	uint8_t leaf[] = {0x10, 6, 2, 0x01, 0xff};
+	d = buffOpenWrite();
+	buffWrite(d, leaf, sizeof(leaf));
+	buffOpenRead(d);
+	assert(bmtRead(buffRead, d) == NULL);
+	buffClose(d);
+	leaf[4] = 5 << 1;
+	d = buffOpenWrite();
+	buffWrite(d, leaf, sizeof(leaf));
+	buffOpenRead(d);
+	bmt2 = bmtRead(buffRead, d);
+	assert(bmt2 != NULL);
+	buffClose(d);
+	assert(bmtOnes(bmt2) == 1);
+	assert(bmtBit(bmt2, 5) == 1);
+	bmtDelete(bmt2);
+	assert(bmtSerializeMethod("tree-store") == 0);
+	bmtDelete(bmt);
+
 	printf("=== serialize OK\n");
 	return 0;
 }
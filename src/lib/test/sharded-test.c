@@ -0,0 +1,161 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2022 Lars Ekman
+*/
+
+#include "bmt.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define RESERVES 5000
+#define SIZE (1 << 16)
+
+static struct bmtShards* shared;
+static uint8_t owner[SIZE];
+
+static void* reserver(void* arg)
+{
+	unsigned home = (uintptr_t)arg;
+	uint64_t offset;
+	for (unsigned i = 0; i < RESERVES; i++) {
+		assert(bmtShardsReserveBit(shared, home, &offset) == 0);
+		assert(offset < SIZE);
+		assert(owner[offset] == 0);
+		owner[offset] = home + 1;
+		if (i % 4 == 0) {
+			// Reserve and release one more
+			uint64_t tmp;
+			assert(bmtShardsReserveBit(shared, home, &tmp) == 0);
+			assert(bmtShardsBit(shared, tmp) == 1);
+			bmtShardsClearBit(shared, tmp);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct BitmapTree* bmt;
+	struct BitmapTree* t;
+	struct bmtShards* s;
+	uint64_t offset;
+
+	// Invalid params;
+	bmt = bmtCreate(256);
+	assert(bmtShardsCreate(bmt, 0) == NULL);
+	assert(bmtShardsCreate(bmt, 3) == NULL);
+	assert(bmtShardsCreate(bmt, 8) == NULL); /* 32 bit shards */
+	s = bmtShardsCreate(bmt, 4);
+	assert(s != NULL);
+	bmtShardsDelete(s);
+	bmtDelete(bmt);
+
+	// Split and merge keeps the contents;
+	bmt = bmtCreate(SIZE);
+	bmtSetBranch(bmt, 0x1000, 0x1000);
+	bmtSetRange(bmt, 0x3ff0, 0x4010);
+	bmtSetRange(bmt, 0x8000, 0xffff);
+	bmtClearBit(bmt, 0x9000);
+	for (unsigned i = 0; i < 200; i++)
+		bmtSetBit(bmt, (i * 7919) % SIZE);
+	for (unsigned count = 1; count <= 64; count *= 2) {
+		s = bmtShardsCreate(bmt, count);
+		assert(s != NULL);
+		assert(bmtShardsOnes(s) == bmtOnes(bmt));
+		t = bmtShardsTree(s);
+		assert(bmtCompare(t, bmt) == 0);
+		assert(bmtNodes(t) == bmtNodes(bmt));
+		bmtDelete(t);
+		assert(bmtShardsBit(s, 0x9000) == 0);
+		assert(bmtShardsBit(s, 0x9001) == 1);
+		assert(bmtShardsBit(s, SIZE) == 0);
+		bmtShardsSetBit(s, 0x9000);
+		bmtShardsSetBit(s, SIZE);	/* Ignored */
+		assert(bmtShardsBit(s, 0x9000) == 1);
+		t = bmtShardsTree(s);
+		assert(bmtOnes(t) == bmtOnes(bmt) + 1);
+		assert(bmtBit(t, 0x9000) == 1);
+		bmtDelete(t);
+		bmtShardsDelete(s);
+	}
+	bmtDelete(bmt);
+
+	// Full size tree;
+	bmt = bmtCreate(0);
+	bmtSetBit(bmt, UINT64_MAX);
+	bmtSetBranch(bmt, 0, 1ULL << 62);
+	for (unsigned count = 1; count <= 4; count *= 2) {
+		s = bmtShardsCreate(bmt, count);
+		assert(s != NULL);
+		assert(bmtShardsBit(s, UINT64_MAX) == 1);
+		assert(bmtShardsReserveBit(s, 0, &offset) == 0);
+		assert(offset == 1ULL << 62);
+		t = bmtShardsTree(s);
+		assert(bmtOnes(t) == (1ULL << 62) + 2);
+		bmtDelete(t);
+		bmtShardsDelete(s);
+	}
+	bmtDelete(bmt);
+
+	// Containers are kept in the shards and the tree;
+	bmt = bmtCreate(1ULL << 20);
+	assert(bmtSetContainers(bmt, 4096, 2048) == 0);
+	for (unsigned i = 0; i < 100; i++)
+		bmtSetBit(bmt, i * 5000);
+	for (unsigned count = 1; count <= 32; count *= 4) {
+		s = bmtShardsCreate(bmt, count);
+		assert(s != NULL);
+		assert(bmtShardsReserveBit(s, 0, &offset) == 0);
+		assert(offset == 1);
+		assert(bmtShardsBit(s, 5000) == 1);
+		t = bmtShardsTree(s);
+		assert(bmtOnes(t) == 101);
+		assert(bmtNodes(t) == bmtNodes(bmt));
+		bmtDelete(t);
+		bmtShardsDelete(s);
+	}
+	bmtDelete(bmt);
+
+	// Reserve from other shards when the home shard is full;
+	bmt = bmtCreate(1024);
+	bmtSetBit(bmt, 1023);
+	s = bmtShardsCreate(bmt, 4);
+	for (unsigned i = 0; i < 1023; i++) {
+		assert(bmtShardsReserveBit(s, 1, &offset) == 0);
+		if (i < 256)
+			assert(offset == 256 + i);
+	}
+	assert(bmtShardsReserveBit(s, 1, &offset) != 0);
+	assert(bmtShardsReserveBit(s, 6, &offset) != 0);
+	assert(bmtShardsOnes(s) == 1024);
+	bmtShardsClearBit(s, 17);
+	assert(bmtShardsReserveBit(s, 3, &offset) == 0);
+	assert(offset == 17);
+	bmtShardsDelete(s);
+	bmtDelete(bmt);
+
+	// Threads;
+	bmt = bmtCreate(SIZE);
+	shared = bmtShardsCreate(bmt, THREADS);
+	bmtDelete(bmt);
+	pthread_t threads[THREADS];
+	for (uintptr_t i = 0; i < THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, reserver, (void*)i) == 0);
+	for (unsigned i = 0; i < 10; i++) {
+		t = bmtShardsTree(shared);
+		assert(bmtOnes(t) <= THREADS * RESERVES);
+		bmtDelete(t);
+	}
+	for (unsigned i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	t = bmtShardsTree(shared);
+	assert(bmtOnes(t) == THREADS * RESERVES);
+	for (unsigned i = 0; i < SIZE; i++)
+		assert(bmtBit(t, i) == (owner[i] != 0));
+	bmtDelete(t);
+	bmtShardsDelete(shared);
+
+	printf("=== sharded OK\n");
+	return 0;
+}
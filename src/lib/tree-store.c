@@ -8,25 +8,52 @@
 /*
   The tree is stored as;
 
-    uint16_t 0bvvvv00000000E0zz
-      vvvv - version (0)
+    uint16_t 0bvvvv00000CwwE0zz
+      vvvv - version (2 or 3). Version 0 has no chain nodes, version 1
+        is not framed, version 3 has a subtree index
+      C - Containers are used
+      ww - Leaf size. 00 = 64-bit, 01 = 128-bit, 10 = 256-bit, 11 = 512-bit
       E - Endian. 0-little-endian
       zz - Bitmask size. 00 = 64-bit, 01=32-bit, 10=16-bit
     uint8_t 0bEzxxxxxx
       E - set to '1' if the tree is empty or full
       z - If the tree is empty or full; 0=empty, 1=full
       xxxxxx - ulog2(size). 0 interpreted as 64
-    (nodes...)
+    (frames...)
+
+  Frames hold the nodes in pre-order. A node may span frames;
+
+    uint32_t len, (len bytes, at most 32768)
+
+  In version 3 (bmtWriteParallel()) the frames start with an index of
+  independent subtrees that precedes the nodes;
+
+    uint32_t count, uint64_t len (of the nodes)
+    count * (uint64_t offset, uint64_t len, uint8_t level)
+
+  The offset is from the start of the nodes. The subtrees are stored in
+  place in pre-order, so the nodes are read as in version 2 if the
+  index is skipped.
 
   Nodes are stored as;
 
     Bitmap-node;
-      0b00000000, bitmap
+      0b00000000, bitmap (one uint64_t per 64 bits in a leaf)
     Node;
       0bzzzzoooo
         zzzz - The "zero" leg.
         oooo - The "one" leg.
         Leg encoding; 0b100 - NULL, 0b101 - FULL, 0b111 - pointer
+    Chain-node;
+      0b100foooo, uint8_t skip, path
+        f - The fill. 0=NULL, 1=FULL
+        oooo - The "next" leg
+        path - The chain path bits, (skip+7)/8 bytes little-endian
+    Container; (only for a 2^16 bit chunk)
+      0b1010000k, uint16_t cnt, values
+        k - 0=array, 1=runs
+        values - cnt uint16_t offsets (array) or cnt (first, last)
+          pairs of uint16_t (runs)
 
   Stored Size worst case;
 
@@ -60,132 +87,772 @@
 
 */
 
-#define WRITE(x) writeFn(userRef, &x, sizeof(x));
+/*
+  The nodes are written to a buffer and flushed as frames, so the
+  write callback is called once per frame and the reader reads a whole
+  frame with one call. A frame never has more than FRAME_SIZE bytes.
+  Versions 0 and 1 are not framed and are read with one call per field
+  as they were written. Nodes are traversed with explicit stacks, the
+  depth is bounded by the tree levels.
+
+  Subtrees written or read by worker threads use unframed buffers in
+  memory.
+ */
+#define FRAME_SIZE 32768
+#define STACK_DEPTH 64
+#define SUBTREES_MAX 65536
+
+struct membuf {
+	uint8_t* data;
+	size_t len;
+	size_t pos;					/* Read position */
+	size_t allocated;
+};
+
+// A subtree in the index
+struct subtree {
+	struct bmtitem* top;
+	uint64_t offset;
+	uint64_t len;
+	unsigned level;
+	unsigned path;				/* Of a position in a Node16 */
+	int bad;					/* Not read */
+	struct membuf buf;			/* The encoded subtree when written */
+};
+
+struct wbuf {
+	bmtWriteFn_t writeFn;
+	void* userRef;
+	int framed;
+	uint64_t flushed;			/* Bytes written before the buffer */
+	size_t len;					/* Including the frame header */
+	uint8_t data[FRAME_SIZE + sizeof(uint32_t)];
+};
+
+static struct wbuf* wbufCreate(
+	bmtWriteFn_t writeFn, void* userRef, int framed)
+{
+	struct wbuf* w = malloc(sizeof(struct wbuf));
+	if (w == NULL)
+		die("Out of mem");
+	w->writeFn = writeFn;
+	w->userRef = userRef;
+	w->framed = framed;
+	w->flushed = 0;
+	w->len = sizeof(uint32_t);
+	return w;
+}
+
+static void wflush(struct wbuf* w)
+{
+	uint32_t len = w->len - sizeof(uint32_t);
+	if (len == 0)
+		return;
+	if (w->framed) {
+		memcpy(w->data, &len, sizeof(len));
+		w->writeFn(w->userRef, w->data, w->len);
+	} else {
+		w->writeFn(w->userRef, w->data + sizeof(uint32_t), len);
+	}
+	w->flushed += len;
+	w->len = sizeof(uint32_t);
+}
+
+static inline uint64_t woffset(struct wbuf* w)
+{
+	return w->flushed + w->len - sizeof(uint32_t);
+}
 
-static void writeNodes(struct bmtitem* n, bmtWriteFn_t writeFn, void* userRef)
+static void wput(struct wbuf* w, void const* data, size_t len)
 {
+	uint8_t const* d = data;
+	while (len > 0) {
+		size_t n = sizeof(w->data) - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->data + w->len, d, n);
+		w->len += n;
+		d += n;
+		len -= n;
+		if (w->len == sizeof(w->data))
+			wflush(w);
+	}
+}
+#define WRITE(x) wput(w, &x, sizeof(x))
+
+static uint8_t legCode(struct bmtitem* n)
+{
+	if (n == NULL)
+		return 0x04;
+	if (n == FULL)
+		return 0x05;
+	return 0x07;
+}
+
+// writeItem - Write one item. The legs are written after it
+static inline void writeItem(struct bmtpos p, unsigned leafLevel, struct wbuf* w)
+{
+	struct bmtitem* n = p.n;
 	uint8_t b = 0;
-	if (n->level == 0) {
+	if (p.level == leafLevel) {
 		// Bitmap-node
+		bitmap_t lw;
 		WRITE(b);
-		WRITE(n->bits);
+		wput(w, leafWords(n, p.level, &lw), sizeof(bitmap_t) << leafLevel);
 		return;
 	}
-	if (n->zero == NULL)
-		b = 0x40;
-	else if (n->zero == FULL)
-		b = 0x50;
-	else
-		b = 0x70;
-
-	if (n->one == NULL)
-		b += 0x04;
-	else if (n->one == FULL)
-		b += 0x05;
-	else
-		b += 0x07;
-
+	if (isContainer(n)) {
+		// Container
+		b = n->kind == KIND_ARRAY ? 0xa0 : 0xa1;
+		WRITE(b);
+		uint16_t cnt = n->cnt;
+		WRITE(cnt);
+		wput(w, n->vals,
+			 (n->kind == KIND_RUNS ? 2 * cnt : cnt) * sizeof(uint16_t));
+		return;
+	}
+	if (n->skip > 0) {
+		// Chain-node
+		b = 0x80 | (n->fill << 4) | legCode(n->next);
+		WRITE(b);
+		WRITE(n->skip);
+		uint64_t path = n->prefix >> (p.level - n->skip + 6);
+		for (unsigned i = 0; i < n->skip; i += 8) {
+			b = path >> i;
+			WRITE(b);
+		}
+		return;
+	}
+	// A node, or a position in a Node16 (the legs are items)
+	struct bmtpos zero, one;
+	posLegs(p, &zero, &one);
+	b = (legCode(zero.n) << 4) | legCode(one.n);
 	WRITE(b);
+}
 
-	if (b & 0x20)
-		writeNodes(n->zero, writeFn, userRef);
+// pushLegs - Push the legs to write after an item, "one" first so
+// "zero" is popped first. return the number of pushed legs
+static inline unsigned pushLegs(
+	struct bmtpos p, unsigned leafLevel, struct bmtpos* stack)
+{
+	struct bmtitem* n = p.n;
+	unsigned cnt = 0;
+	if (p.level == leafLevel || isContainer(n))
+		return 0;
+	if (n->skip > 0) {
+		if (n->next != NULL && n->next != FULL)
+			stack[cnt++] = (struct bmtpos){n->next, p.level - n->skip};
+		return cnt;
+	}
+	struct bmtpos zero, one;
+	posLegs(p, &zero, &one);
+	if (one.n != NULL && one.n != FULL)
+		stack[cnt++] = one;
+	if (zero.n != NULL && zero.n != FULL)
+		stack[cnt++] = zero;
+	return cnt;
+}
 
-	if (b & 0x02)
-		writeNodes(n->one, writeFn, userRef);
+// writeNodes - Write the nodes in pre-order ("zero" before "one")
+static void writeNodes(struct bmtpos top, unsigned leafLevel, struct wbuf* w)
+{
+	// Each popped node pushes at most two, so the stack holds at most
+	// one "one" leg per level
+	struct bmtpos stack[2 * STACK_DEPTH];
+	unsigned depth = 0;
+	stack[depth++] = top;
+	while (depth > 0) {
+		struct bmtpos p = stack[--depth];
+		writeItem(p, leafLevel, w);
+		depth += pushLegs(p, leafLevel, stack + depth);
+	}
+}
+
+static void treeHeader(struct BitmapTree* bmt, unsigned v, uint8_t* hdr)
+{
+	uint16_t version = (v << 12) | (bmt->pool->leafLevel << 4);
+	if (bmt->pool->arrayMax > 0 || bmt->pool->runsMax > 0)
+		version |= 0x40;
+	memcpy(hdr, &version, sizeof(version));
+	hdr[2] = ulog2(bmt->size);
 }
 
 static void treeWrite(
 	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef)
 {
-	uint16_t version = 0;
-	WRITE(version);
-	uint8_t b = ulog2(bmt->size);
+	uint8_t hdr[3];
+	treeHeader(bmt, 2, hdr);
 	if (bmt->top == NULL || bmt->top == FULL) {
-		b |= 0x80;				/* Set the empty-bit */
+		hdr[2] |= 0x80;			/* Set the empty-bit */
 		if (bmt->top == FULL)
-			b |= 0x40;
-		WRITE(b);
+			hdr[2] |= 0x40;
+		writeFn(userRef, hdr, sizeof(hdr));
 		return;
 	}
-	WRITE(b);
-	writeNodes(bmt->top, writeFn, userRef);
+	writeFn(userRef, hdr, sizeof(hdr));
+	struct wbuf* w = wbufCreate(writeFn, userRef, 1);
+	struct bmtpos top = {bmt->top, bmt->levels};
+	writeNodes(top, bmt->pool->leafLevel, w);
+	wflush(w);
+	free(w);
 }
 
-#define READ(x) if (readFn(userRef, &x, sizeof(x)) != sizeof(x)) goto errquit
+struct rbuf {
+	bmtReadFn_t readFn;
+	void* userRef;
+	int framed;
+	uint64_t offset;			/* Bytes read */
+	struct subtree* sub;		/* Next subtree already read, or NULL */
+	struct subtree* subEnd;
+	size_t pos;
+	size_t len;
+	uint8_t data[FRAME_SIZE];
+};
+
+static struct rbuf* rbufCreate(bmtReadFn_t readFn, void* userRef, int framed)
+{
+	struct rbuf* r = malloc(sizeof(struct rbuf));
+	if (r == NULL)
+		die("Out of mem");
+	r->readFn = readFn;
+	r->userRef = userRef;
+	r->framed = framed;
+	r->offset = 0;
+	r->sub = r->subEnd = NULL;
+	r->pos = r->len = 0;
+	return r;
+}
 
-static struct bmtitem* readNodes(
-	unsigned level, bmtReadFn_t readFn, void* userRef)
+// rfill - Read the next frame, or 'need' bytes if not framed
+static int rfill(struct rbuf* r, size_t need)
 {
-	struct bmtitem* n = CALLOC(sizeof(struct bmtitem));
-	uint8_t b;
+	uint32_t len = need < FRAME_SIZE ? need : FRAME_SIZE;
+	if (r->framed) {
+		if (r->readFn(r->userRef, &len, sizeof(len)) != sizeof(len))
+			return -1;
+		if (len == 0 || len > FRAME_SIZE)
+			return -1;
+	}
+	if (r->readFn(r->userRef, r->data, len) != len)
+		return -1;
+	r->pos = 0;
+	r->len = len;
+	return 0;
+}
 
-	READ(b);
-	D(printf("Node byte; %02x, level=%u\n", b, level));
-	n->level = level;
-	
-	if (b == 0) {
-		// A bitmap node
-		if (level > 0)
-			goto errquit;
-		READ(n->bits);
-		return n;
-	}
-	
-	switch (b & 0xf0) {
-	case 0x40:
-		break;
-	case 0x50:
-		n->zero = FULL;
-		break;
-	case 0x70:
-		n->zero = readNodes(level - 1, readFn, userRef);
-		break;
-	default:
-		goto errquit;
+static int rget(struct rbuf* r, void* data, size_t len)
+{
+	uint8_t* d = data;
+	while (len > 0) {
+		if (r->pos == r->len && rfill(r, len) != 0)
+			return -1;
+		size_t n = r->len - r->pos;
+		if (n > len)
+			n = len;
+		memcpy(d, r->data + r->pos, n);
+		r->pos += n;
+		r->offset += n;
+		d += n;
+		len -= n;
 	}
+	return 0;
+}
+
+static int rskip(struct rbuf* r, uint64_t len)
+{
+	while (len > 0) {
+		if (r->pos == r->len && rfill(r, len) != 0)
+			return -1;
+		size_t n = r->len - r->pos;
+		if (n > len)
+			n = len;
+		r->pos += n;
+		r->offset += n;
+		len -= n;
+	}
+	return 0;
+}
+#define READ(x) if (rget(r, &x, sizeof(x)) != 0) goto errquit
 
-	switch (b & 0x0f) {
+// legRead - Decode a leg. return; 1 - a node follows, 0 - NULL/FULL,
+// -1 - invalid
+static int legRead(uint8_t code, struct bmtitem** leg)
+{
+	switch (code) {
 	case 0x04:
-		break;
+		*leg = NULL;
+		return 0;
 	case 0x05:
-		n->one = FULL;
-		break;
+		*leg = FULL;
+		return 0;
 	case 0x07:
-		n->one = readNodes(level - 1, readFn, userRef);
-		break;
-	default:
-		goto errquit;
+		return 1;
 	}
+	return -1;
+}
 
-	return n;
+/*
+  Nodes are normalized when read so chains are formed also for
+  version 0 trees. A node with a leg to read is pushed on the stack and
+  the leg is read next. When a subtree is complete it is stored in the
+  node on top of the stack which is normalized when both legs are read.
+  On error the partially read tree is released with the pool.
+  Subtrees in the index that are already read are linked in place.
+  Any value may be a bitmap, so errors are returned separately.
+ */
+enum { READ_NEXT, READ_ZERO, READ_ONE };
+struct rframe {
+	struct bmtitem* n;
+	uint8_t b;
+	uint8_t state;
+};
+static int readNodes(
+	struct bmtpool* p, unsigned level, struct rbuf* r, struct bmtitem** top)
+{
+	struct rframe stack[STACK_DEPTH];
+	unsigned depth = 0;
+	struct bmtitem* v;			/* The last complete subtree */
+	int rc;
+	for (;;) {
+		if (r->sub < r->subEnd && r->offset == r->sub->offset) {
+			v = r->sub->top;
+			if (r->sub->bad || r->sub->level != level ||
+				rskip(r, r->sub->len) != 0)
+				goto errquit;
+			r->sub++;
+			goto complete;
+		}
+		uint8_t b;
+		READ(b);
+		D(printf("Node byte; %02x, level=%u\n", b, level));
+
+		if (b == 0) {
+			// A bitmap node
+			bitmap_t w[8];		/* (leafLevel <= 3) */
+			if (level != p->leafLevel)
+				goto errquit;
+			if (rget(r, w, sizeof(bitmap_t) << level) != 0)
+				goto errquit;
+			v = leafNew(p, level, w);
+			goto complete;
+		}
+		struct bmtitem* n = itemAlloc(p, level);
+		if ((b & 0xfe) == 0xa0) {
+			// A container
+			uint16_t cnt;
+			if (level != CHUNK_LEVEL || (p->arrayMax == 0 && p->runsMax == 0))
+				goto errquit;
+			READ(cnt);
+			if (cnt == 0)
+				goto errquit;
+			unsigned kind = b == 0xa0 ? KIND_ARRAY : KIND_RUNS;
+			size_t len = (kind == KIND_RUNS ? 2 * cnt : cnt) * sizeof(uint16_t);
+			containerReserve(p, n, len / sizeof(uint16_t));
+			n->kind = kind;
+			n->cnt = cnt;
+			if (rget(r, n->vals, len) != 0 || containerCheck(n) != 0)
+				goto errquit;
+			v = containerNormalize(p, n);
+		} else if ((b & 0xe0) == 0x80) {
+			// A chain node
+			uint8_t skip, path;
+			READ(skip);
+			if (skip == 0 || skip > level - p->leafLevel)
+				goto errquit;
+			chainSkip(p, n, skip);
+			n->fill = (b & 0x10) != 0;
+			for (unsigned i = 0; i < skip; i += 8) {
+				READ(path);
+				n->prefix |= (uint64_t)path << i;
+			}
+			n->prefix = (n->prefix << (level - skip + 6)) & chainMask(level, skip);
+			rc = legRead(b & 0x0f, &n->next);
+			if (rc < 0)
+				goto errquit;
+			if (rc > 0) {
+				stack[depth++] = (struct rframe){n, b, READ_NEXT};
+				level -= skip;
+				continue;
+			}
+			v = chainNormalize(p, n);
+		} else {
+			if (level == p->leafLevel)
+				goto errquit;
+			rc = legRead(b >> 4, &n->zero);
+			if (rc < 0 || legRead(b & 0x0f, &n->one) < 0)
+				goto errquit;
+			if (rc > 0 || (b & 0x0f) == 0x07) {
+				stack[depth++] = (struct rframe){n, b, rc > 0 ? READ_ZERO : READ_ONE};
+				level--;
+				continue;
+			}
+			v = itemNormalize(p, n);
+		}
+
+		// Store complete subtrees until a node has a leg to read
+	complete:
+		while (depth > 0) {
+			struct rframe* f = &stack[depth - 1];
+			if (f->state == READ_NEXT) {
+				f->n->next = v;
+				v = chainNormalize(p, f->n);
+			} else if (f->state == READ_ZERO) {
+				f->n->zero = v;
+				if ((f->b & 0x0f) == 0x07) {
+					f->state = READ_ONE;
+					break;
+				}
+				v = itemNormalize(p, f->n);
+			} else {
+				f->n->one = v;
+				v = itemNormalize(p, f->n);
+			}
+			depth--;
+		}
+		if (depth == 0) {
+			*top = v;
+			return 0;
+		}
+		level = stack[depth - 1].n->level - 1;
+	}
 
 errquit:
-	free(n);
+	return -1;
+}
+
+// ----------------------------------------------------------------------
+// Subtrees in parallel;
+
+static void memWrite(void* ref, void const* data, size_t len)
+{
+	struct membuf* b = ref;
+	if (b->len + len > b->allocated) {
+		b->allocated = (b->len + len) * 2;
+		b->data = realloc(b->data, b->allocated);
+		if (b->data == NULL)
+			die("Out of mem");
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+static size_t memRead(void* ref, void* data, size_t len)
+{
+	struct membuf* b = ref;
+	if (len > b->len - b->pos)
+		return -1;
+	memcpy(data, b->data + b->pos, len);
+	b->pos += len;
+	return len;
+}
+
+/*
+  Subtrees are taken by the worker threads from a common index. Items
+  are read into a pool per worker, and the pools are merged into the
+  pool of the tree when the workers are done.
+ */
+struct job {
+	struct subtree* sub;
+	unsigned count;
+	unsigned next;				/* The next subtree to take (atomic) */
+	unsigned leafLevel;
+	uint8_t* data;				/* The nodes when read */
+};
+struct worker {
+	pthread_t tid;
+	struct job* job;
+	struct bmtpool pool;
+};
+
+static struct subtree* takeSubtree(struct job* j)
+{
+	unsigned i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+	return i < j->count ? &j->sub[i] : NULL;
+}
+
+static void* writeWorker(void* arg)
+{
+	struct worker* wk = arg;
+	struct wbuf* w = wbufCreate(memWrite, NULL, 0);
+	struct subtree* s;
+	while ((s = takeSubtree(wk->job)) != NULL) {
+		w->userRef = &s->buf;
+		writeNodes(
+			(struct bmtpos){s->top, s->level, s->path}, wk->job->leafLevel, w);
+		wflush(w);
+	}
+	free(w);
 	return NULL;
 }
 
-static struct BitmapTree* treeRead(bmtReadFn_t readFn, void* userRef)
+static void* readWorker(void* arg)
+{
+	struct worker* wk = arg;
+	struct rbuf* r = rbufCreate(memRead, NULL, 0);
+	struct subtree* s;
+	while ((s = takeSubtree(wk->job)) != NULL) {
+		struct membuf b = {wk->job->data + s->offset, s->len, 0, s->len};
+		r->userRef = &b;
+		r->pos = r->len = 0;
+		s->bad = readNodes(&wk->pool, s->level, r, &s->top) != 0 ||
+			b.pos != b.len;
+	}
+	free(r);
+	return NULL;
+}
+
+// runWorkers - Start the workers and wait for them. The pools are
+// initiated from 'p' if not NULL. return the workers
+static struct worker* runWorkers(
+	struct job* j, unsigned threads, void* (*fn)(void*), struct bmtpool* p)
+{
+	struct worker* wk = CALLOC(threads * sizeof(struct worker));
+	for (unsigned i = 0; i < threads; i++) {
+		wk[i].job = j;
+		if (p != NULL) {
+			poolInit(&wk[i].pool, &p->allocator);
+			wk[i].pool.leafLevel = p->leafLevel;
+			wk[i].pool.items.itemSize = p->items.itemSize;
+			wk[i].pool.arrayMax = p->arrayMax;
+			wk[i].pool.runsMax = p->runsMax;
+			wk[i].pool.node16 = p->node16;
+		}
+		if (pthread_create(&wk[i].tid, NULL, fn, &wk[i]) != 0)
+			die("pthread_create");
+	}
+	for (unsigned i = 0; i < threads; i++)
+		pthread_join(wk[i].tid, NULL);
+	return wk;
+}
+
+// splitTree - Find the subtrees below the 'split' level in pre-order.
+// return the number of subtrees
+static unsigned splitTree(
+	struct bmtpos top, unsigned leafLevel, unsigned split,
+	struct subtree* sub)
+{
+	struct bmtpos stack[2 * STACK_DEPTH];
+	unsigned depth = 0, cnt = 0;
+	stack[depth++] = top;
+	while (depth > 0) {
+		struct bmtpos p = stack[--depth];
+		if (p.level <= split) {
+			if (sub != NULL) {
+				sub[cnt].top = p.n;
+				sub[cnt].level = p.level;
+				sub[cnt].path = p.path;
+			}
+			cnt++;
+			continue;
+		}
+		depth += pushLegs(p, leafLevel, stack + depth);
+	}
+	return cnt;
+}
+
+// writeTop - Write the items above the subtrees. The subtree offsets
+// are set to their position in the written items
+static void writeTop(
+	struct bmtpos top, unsigned leafLevel, struct subtree* sub,
+	struct wbuf* w)
+{
+	struct bmtpos stack[2 * STACK_DEPTH];
+	unsigned depth = 0;
+	stack[depth++] = top;
+	while (depth > 0) {
+		struct bmtpos p = stack[--depth];
+		if (p.n == sub->top && p.level == sub->level && p.path == sub->path) {
+			sub->offset = woffset(w);
+			sub++;
+			continue;
+		}
+		writeItem(p, leafLevel, w);
+		depth += pushLegs(p, leafLevel, stack + depth);
+	}
+}
+
+/*
+  The split level is the highest level where there are at least 4
+  subtrees per thread (if possible), so the work is evenly divided even
+  if the subtrees differ in size. The count at most doubles per level
+  so it stays below SUBTREES_MAX.
+ */
+void bmtWriteParallel(
+	struct BitmapTree* bmt, bmtWriteFn_t writeFn, void* userRef,
+	unsigned threads)
+{
+	unsigned leafLevel = bmt->pool->leafLevel;
+	if (threads > SUBTREES_MAX / 8)
+		threads = SUBTREES_MAX / 8;
+	if (threads < 2 || bmt->top == NULL || bmt->top == FULL ||
+		bmt->levels <= leafLevel) {
+		treeWrite(bmt, writeFn, userRef);
+		return;
+	}
+	struct bmtpos root = {bmt->top, bmt->levels};
+	unsigned split = bmt->levels - 1, count;
+	for (;;) {
+		count = splitTree(root, leafLevel, split, NULL);
+		if (count >= 4 * threads || split == leafLevel)
+			break;
+		split--;
+	}
+	if (count < 2) {
+		treeWrite(bmt, writeFn, userRef);
+		return;
+	}
+
+	// The extra subtree ends writeTop()
+	struct job j = {
+		CALLOC((count + 1) * sizeof(struct subtree)), count, 0, leafLevel};
+	splitTree(root, leafLevel, split, j.sub);
+	free(runWorkers(&j, threads < count ? threads : count, writeWorker, NULL));
+	struct membuf top = {0};
+	struct wbuf* w = wbufCreate(memWrite, &top, 0);
+	writeTop(root, leafLevel, j.sub, w);
+	wflush(w);
+
+	// The subtrees are written in place after the index
+	uint64_t len = top.len;
+	for (unsigned i = 0; i < count; i++) {
+		j.sub[i].offset += len - top.len;
+		j.sub[i].len = j.sub[i].buf.len;
+		len += j.sub[i].len;
+	}
+	uint8_t hdr[3];
+	treeHeader(bmt, 3, hdr);
+	writeFn(userRef, hdr, sizeof(hdr));
+	w->writeFn = writeFn;
+	w->userRef = userRef;
+	w->framed = 1;
+	WRITE(count);
+	WRITE(len);
+	for (unsigned i = 0; i < count; i++) {
+		uint8_t level = j.sub[i].level;
+		WRITE(j.sub[i].offset);
+		WRITE(j.sub[i].len);
+		WRITE(level);
+	}
+	uint64_t pos = 0, shift = 0;
+	for (unsigned i = 0; i < count; i++) {
+		uint64_t at = j.sub[i].offset - shift;
+		wput(w, top.data + pos, at - pos);
+		wput(w, j.sub[i].buf.data, j.sub[i].len);
+		free(j.sub[i].buf.data);
+		pos = at;
+		shift += j.sub[i].len;
+	}
+	wput(w, top.data + pos, top.len - pos);
+	wflush(w);
+	free(w);
+	free(top.data);
+	free(j.sub);
+}
+
+// readIndex - Read and check the subtree index. return 0 - OK
+static int readIndex(struct rbuf* r, struct BitmapTree* bmt, struct job* j)
+{
+	uint64_t len, end = 0;
+	if (rget(r, &j->count, sizeof(j->count)) != 0 ||
+		rget(r, &len, sizeof(len)) != 0 || j->count > SUBTREES_MAX)
+		return -1;
+	j->sub = CALLOC((j->count + 1) * sizeof(struct subtree));
+	for (unsigned i = 0; i < j->count; i++) {
+		struct subtree* s = &j->sub[i];
+		uint8_t level;
+		if (rget(r, &s->offset, sizeof(s->offset)) != 0 ||
+			rget(r, &s->len, sizeof(s->len)) != 0 ||
+			rget(r, &level, sizeof(level)) != 0)
+			return -1;
+		s->level = level;
+		if (s->offset < end || s->offset > len || s->len == 0 ||
+			s->len > len - s->offset ||
+			level < bmt->pool->leafLevel || level >= bmt->levels)
+			return -1;
+		end = s->offset + s->len;
+	}
+	// The last entry holds the length of the nodes
+	j->sub[j->count].offset = len;
+	return 0;
+}
+
+// readParallel - Read the subtrees in the index with worker threads,
+// then the items above them. return 0 - OK
+static int readParallel(
+	struct rbuf* r, struct BitmapTree* bmt, struct job* j, unsigned threads)
+{
+	struct membuf b = {0};
+	uint64_t len = j->sub[j->count].offset;
+	// Grow the buffer as data is read rather than trust the length
+	while (b.len < len) {
+		size_t n = len - b.len;
+		if (n > b.allocated + FRAME_SIZE)
+			n = b.allocated + FRAME_SIZE;
+		if (b.len + n > b.allocated) {
+			b.allocated = b.len + n;
+			b.data = realloc(b.data, b.allocated);
+			if (b.data == NULL)
+				die("Out of mem");
+		}
+		if (rget(r, b.data + b.len, n) != 0) {
+			free(b.data);
+			return -1;
+		}
+		b.len += n;
+	}
+	j->data = b.data;
+	j->leafLevel = bmt->pool->leafLevel;
+	if (threads > j->count)
+		threads = j->count;
+	struct worker* wk = runWorkers(j, threads, readWorker, bmt->pool);
+	for (unsigned i = 0; i < threads; i++)
+		poolMerge(bmt->pool, &wk[i].pool);
+	free(wk);
+
+	r->readFn = memRead;
+	r->userRef = &b;
+	r->framed = 0;
+	r->offset = r->pos = r->len = 0;
+	r->sub = j->sub;
+	r->subEnd = j->sub + j->count;
+	int rc = readNodes(bmt->pool, bmt->levels, r, &bmt->top);
+	if (r->sub != r->subEnd || b.pos != b.len)
+		rc = -1;
+	free(b.data);
+	return rc;
+}
+
+static struct BitmapTree* treeReadThreads(
+	bmtReadFn_t readFn, void* userRef, unsigned threads)
 {
 	struct BitmapTree* bmt = NULL;
+	struct rbuf* r = NULL;
+	struct job j = {0};
 	uint16_t version;
 	uint8_t b;
 
-	READ(version);
-	if (version != 0) {
+	if (readFn(userRef, &version, sizeof(version)) != sizeof(version))
+		return NULL;
+	unsigned v = version >> 12;
+	if (version != 0 && ((version & 0xf8f) != 0 || v < 1 || v > 3)) {
 		Dx(printf("Invalid version; %u\n", version));
 		return NULL;
 	}
 
-	READ(b);
+	if (readFn(userRef, &b, sizeof(b)) != sizeof(b))
+		return NULL;
 	D(printf("Bmt byte; %02x\n", b));
-	bmt = CALLOC(sizeof(struct BitmapTree));
-	unsigned logsize = b & 0x3f;
-	if (logsize > 0) {
-		bmt->size = 1ULL << logsize;
-		bmt->levels = logsize - BM_BITS;
-	} else {
-		bmt->levels = 64 - BM_BITS;
+	unsigned logsize = (b & 0x3f) == 0 ? 64 : b & 0x3f;
+	unsigned leafLevel = (version >> 4) & 3;
+	if (logsize < BM_BITS + leafLevel || logsize > 64) {
+		Dx(printf("Invalid size; %u\n", logsize));
+		return NULL;
 	}
+	bmt = bmtCreateWithLeaves(
+		logsize < 64 ? 1ULL << logsize : 0, 64 << leafLevel, NULL);
+	if (bmt == NULL)
+		return NULL;
+	if ((version & 0x40) && bmtSetContainers(bmt, 4096, 2048) != 0)
+		goto errquit;
 
 	if (b & 0x80) {
 		// Empty or full
@@ -194,15 +861,40 @@ static struct BitmapTree* treeRead(bmtReadFn_t readFn, void* userRef)
 		return bmt;
 	}
 
-	bmt->top = readNodes(bmt->levels, readFn, userRef);
-	if (bmt->top != NULL)
+	int rc;
+	r = rbufCreate(readFn, userRef, v >= 2);
+	if (v >= 3 && readIndex(r, bmt, &j) != 0) {
+		rc = -1;
+	} else if (j.count > 0 && threads > 1) {
+		rc = readParallel(r, bmt, &j, threads);
+	} else {
+		r->offset = 0;
+		rc = readNodes(bmt->pool, bmt->levels, r, &bmt->top);
+		if (rc == 0 && v >= 3 && r->offset != j.sub[j.count].offset)
+			rc = -1;
+	}
+	free(r);
+	free(j.sub);
+	if (rc == 0)
 		return bmt;
+	bmt->top = NULL;
 
 errquit:
 	bmtDelete(bmt);
 	return NULL;
 }
 
+static struct BitmapTree* treeRead(bmtReadFn_t readFn, void* userRef)
+{
+	return treeReadThreads(readFn, userRef, 1);
+}
+
+struct BitmapTree* bmtReadParallel(
+	bmtReadFn_t readFn, void* userRef, unsigned threads)
+{
+	return treeReadThreads(readFn, userRef, threads);
+}
+
 
 __attribute__ ((__constructor__)) static void registerMethod(void) {
 	bmtSerializeMethodRegister("tree-store", treeRead, treeWrite, 1);